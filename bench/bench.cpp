@@ -0,0 +1,192 @@
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <memory>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "nes.hpp"
+#include "utils.hpp"
+#include "programs.hpp"
+
+/*
+Emulation throughput
+
+Each workload (the synthetic programs, smb1 when it is found, the roms given
+on the command line) runs headless for a fixed number of frames, several
+times on a new console. Written to a json file, the min / median / p99 over
+the repetitions of :
+- frames_per_s : emulated frames by host second
+- instructions_per_s : guest instructions by host second (the idle loop
+  iterations skipped by the scheduler are not run, thus not counted)
+- dots_per_s : PPU dots by host second
+- ns_per_frame : host time by emulated frame
+
+usage : nesquick_bench [--frames N] [--reps N] [--jit] [--out FILE] [ROM...]
+*/
+
+typedef std::chrono::steady_clock Clock;
+
+static const std::string SMB1_ROM = "/home/titus/dev/nesquick/rom/smb1/bin/smb1.nes";
+
+struct Workload {
+    std::string name;
+    std::vector<uint8_t> prg;
+    std::vector<uint8_t> chr;
+    uint16_t rom_base_addr;
+};
+
+struct Sample {
+    double frames_per_s;
+    double instructions_per_s;
+    double dots_per_s;
+    double ns_per_frame;
+};
+
+struct Stats {
+    double min;
+    double median;
+    double p99;
+};
+
+static Workload load_rom(const std::string& path) {
+    Workload workload = {path, std::vector<uint8_t>(0x8000), std::vector<uint8_t>(0x4000), 0};
+    uint16_t prg_len, chr_len;
+    parseInes(path, workload.prg.data(), workload.chr.data(), &prg_len, &chr_len);
+    workload.rom_base_addr = 0x10000 - prg_len;
+    return workload;
+}
+
+static Sample run(Workload& workload, long nframes, bool use_jit) {
+    // too big for the stack
+    std::unique_ptr<Nes> nes(new Nes(workload.prg.data(), workload.chr.data(), workload.rom_base_addr));
+    nes->cpu.set_jit(use_jit);
+
+    auto start = Clock::now();
+    for (long frame = 0; frame < nframes; frame++) {
+        nes->scheduler.run_frame();
+    }
+    double elapsed = std::chrono::duration<double>(Clock::now() - start).count();
+
+    return {
+        nframes / elapsed,
+        nes->cpu.get_instruction_count() / elapsed,
+        nes->ppu.get_dot() / elapsed,
+        elapsed * 1e9 / nframes,
+    };
+}
+
+// nearest rank percentiles
+static Stats get_stats(std::vector<double> values) {
+    std::sort(values.begin(), values.end());
+    auto rank = [&values](double percentile) {
+        size_t index = static_cast<size_t>(std::ceil(percentile * values.size()));
+        return values[std::max<size_t>(index, 1) - 1];
+    };
+    return {values.front(), rank(0.5), rank(0.99)};
+}
+
+// s as a json string, quoted
+static std::string json_string(const std::string& s) {
+    std::ostringstream text;
+    text << '"';
+    for (char c : s) {
+        if (c == '"' || c == '\\') {
+            text << '\\' << c;
+        } else if (static_cast<unsigned char>(c) < 0x20) {
+            text << "\\u" << std::hex << std::setw(4) << std::setfill('0') << static_cast<int>(c) << std::dec;
+        } else {
+            text << c;
+        }
+    }
+    text << '"';
+    return text.str();
+}
+
+static void write_stats(std::ostream& out, const std::string& key, const std::vector<Sample>& samples, double Sample::*field) {
+    std::vector<double> values;
+    for (const Sample& sample : samples) {
+        values.push_back(sample.*field);
+    }
+    Stats stats = get_stats(values);
+    out << "      \"" << key << "\": {\"min\": " << stats.min << ", \"median\": " << stats.median
+        << ", \"p99\": " << stats.p99 << "}";
+}
+
+int main(int argc, char **argv) {
+    long nframes = 600;
+    int nreps = 5;
+    bool use_jit = false;
+    std::string out_path = "nesquick_bench.json";
+    std::vector<Workload> workloads;
+    for (const Program& program : synthetic_programs()) {
+        workloads.push_back({program.name, program.prg, program.chr, 0x8000});
+    }
+    if (std::ifstream(SMB1_ROM)) {
+        workloads.push_back(load_rom(SMB1_ROM));
+        workloads.back().name = "smb1";
+    }
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        if (arg == "--frames" && i + 1 < argc) {
+            nframes = std::stol(argv[++i]);
+        } else if (arg == "--reps" && i + 1 < argc) {
+            nreps = std::stoi(argv[++i]);
+        } else if (arg == "--jit") {
+            use_jit = true;
+        } else if (arg == "--out" && i + 1 < argc) {
+            out_path = argv[++i];
+        } else if (arg[0] != '-') {
+            workloads.push_back(load_rom(arg));
+        } else {
+            std::cerr << "Unknown option " << arg << std::endl;
+            return 1;
+        }
+    }
+    if (nframes < 1 || nreps < 1) {
+        std::cerr << "--frames and --reps have to be at least 1" << std::endl;
+        return 1;
+    }
+
+    std::ofstream out(out_path);
+    if (!out) {
+        std::cerr << "Unable to open " << out_path << std::endl;
+        return 1;
+    }
+    out << std::setprecision(10);
+    out << "{\n  \"frames\": " << nframes << ",\n  \"repetitions\": " << nreps
+        << ",\n  \"jit\": " << (use_jit ? "true" : "false") << ",\n  \"workloads\": [\n";
+
+    for (size_t w = 0; w < workloads.size(); w++) {
+        Workload& workload = workloads[w];
+        // warm up the host caches and the branch predictors, not measured
+        run(workload, nframes, use_jit);
+        std::vector<Sample> samples;
+        for (int rep = 0; rep < nreps; rep++) {
+            samples.push_back(run(workload, nframes, use_jit));
+        }
+
+        std::vector<double> fps;
+        for (const Sample& sample : samples) {
+            fps.push_back(sample.frames_per_s);
+        }
+        std::cout << std::left << std::setw(16) << workload.name << " " << std::fixed << std::setprecision(1)
+            << get_stats(fps).median << " fps" << std::endl;
+
+        out << "    {\n      \"name\": " << json_string(workload.name) << ",\n";
+        write_stats(out, "frames_per_s", samples, &Sample::frames_per_s);
+        out << ",\n";
+        write_stats(out, "instructions_per_s", samples, &Sample::instructions_per_s);
+        out << ",\n";
+        write_stats(out, "dots_per_s", samples, &Sample::dots_per_s);
+        out << ",\n";
+        write_stats(out, "ns_per_frame", samples, &Sample::ns_per_frame);
+        out << "\n    }" << (w + 1 < workloads.size() ? "," : "") << "\n";
+    }
+    out << "  ]\n}\n";
+    return 0;
+}
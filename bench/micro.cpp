@@ -0,0 +1,389 @@
+#include <algorithm>
+#include <chrono>
+#include <fstream>
+#include <functional>
+#include <iomanip>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <sstream>
+#include <string>
+#include <tuple>
+#include <vector>
+
+#ifdef __linux__
+#include <sched.h>
+#endif
+
+#include "nes.hpp"
+#include "audio.hpp"
+#include "programs.hpp"
+
+/*
+Microbenchmarks of the hot paths
+
+Each case times one function in a loop : after a warm up, the number of
+calls of a batch is raised until a batch lasts BATCH_NS, then BATCH_NUMBER
+batches are timed. The median and the min ns per call over the batches are
+printed, the thread pinned to a single host cpu.
+
+Two builds are compared by saving the results of one (--out) and giving
+them to the other (--baseline), printed side by side with their ratio.
+
+usage : nesquick_micro [--filter SUBSTRING] [--cpu N] [--out FILE] [--baseline FILE]
+*/
+
+typedef std::chrono::steady_clock Clock;
+
+const long BATCH_NS = 1000000;
+const int BATCH_NUMBER = 15;
+const int WARMUP_BATCH_NUMBER = 3;
+// instructions of the exec_inst mixes between two jumps back
+const int MIX_LENGTH = 32;
+// the scanline the PPU cases render
+const uint8_t BENCH_SCANLINE = 100;
+
+// results are stored here so that the timed work is not optimized away
+static volatile uint32_t g_sink;
+
+struct Result {
+    std::string name;
+    double median_ns;
+    double min_ns;
+};
+
+class MicroBench {
+public:
+    MicroBench() {
+        Program program = synthetic_programs()[0];
+        m_chr = program.chr;
+        m_nes = make_nes(program.prg);
+    }
+
+    // the cases, each one runs n calls of the timed function
+    std::vector<std::pair<std::string, std::function<void(long)>>> cases() {
+        std::vector<std::pair<std::string, std::function<void(long)>>> cases;
+        add_memory_cases(cases);
+        add_cpu_cases(cases);
+        add_ppu_cases(cases);
+        add_audio_cases(cases);
+        return cases;
+    }
+
+private:
+    typedef std::vector<std::pair<std::string, std::function<void(long)>>> Cases;
+
+    std::unique_ptr<Nes> make_nes(const std::vector<uint8_t>& prg) {
+        // the rom and the PPU keep copies of the prg and chr
+        std::vector<uint8_t> prg_copy = prg;
+        // too big for the stack
+        return std::unique_ptr<Nes>(new Nes(prg_copy.data(), m_chr.data(), 0x8000));
+    }
+
+    void add_memory_cases(Cases& cases) {
+        Memory *mem = &m_nes->mem;
+        // region, address read, address written (0 for read only)
+        const std::vector<std::tuple<std::string, uint16_t, uint16_t>> regions = {
+            {"ram", 0x0123, 0x0123},
+            {"ram_mirror", 0x1923, 0x1923},
+            {"rom", 0x9000, 0},
+            {"ppu_2002", 0x2002, 0},
+            {"ppu_2006", 0, 0x2006},
+            {"apu_4015", 0x4015, 0},
+            {"apu_4000", 0, 0x4000},
+            {"controller_4016", 0x4016, 0x4016},
+        };
+        for (const auto& region : regions) {
+            uint16_t get_addr = std::get<1>(region);
+            uint16_t set_addr = std::get<2>(region);
+            if (get_addr != 0) {
+                cases.push_back({"mem_get_" + std::get<0>(region), [mem, get_addr](long n) {
+                    for (long i = 0; i < n; i++) {
+                        g_sink = mem->get(get_addr);
+                    }
+                }});
+            }
+            if (set_addr != 0) {
+                cases.push_back({"mem_set_" + std::get<0>(region), [mem, set_addr](long n) {
+                    for (long i = 0; i < n; i++) {
+                        mem->set(set_addr, static_cast<uint8_t>(i));
+                    }
+                }});
+            }
+        }
+    }
+
+    // runs the mix body in a loop, MIX_LENGTH instructions and a jump back
+    void add_mix(Cases& cases, const std::string& name, const std::function<void(Assembler&)>& emit_inst) {
+        Assembler a;
+        uint16_t reset = a.here();
+        a.init();
+        uint16_t loop = a.here();
+        for (int i = 0; i < MIX_LENGTH; i++) {
+            emit_inst(a);
+        }
+        a.emit16(JMP_ABS, loop);
+        uint16_t nmi = a.here();
+        a.emit(RTI);
+
+        m_mixes.push_back(make_nes(a.link(reset, nmi)));
+        Emu6502 *cpu = &m_mixes.back()->cpu;
+        // the first call runs the reset sequence
+        cpu->exec_inst();
+        cases.push_back({"exec_inst_" + name, [cpu](long n) {
+            uint32_t ncycle = 0;
+            for (long i = 0; i < n; i++) {
+                ncycle += cpu->exec_inst();
+            }
+            g_sink = ncycle;
+        }});
+    }
+
+    void add_cpu_cases(Cases& cases) {
+        int k = 0;
+        add_mix(cases, "loads", [&k](Assembler& a) {
+            switch (k++ % 7) {
+            case 0: a.emit(LDA_IMM, 0x12); break;
+            case 1: a.emit(LDA_ZP, 0x10); break;
+            case 2: a.emit(LDA_ZPX, 0x10); break;
+            case 3: a.emit16(LDA_ABS, 0x0300); break;
+            // X is 0xff after init, crosses a page
+            case 4: a.emit16(LDA_ABSX, 0x0310); break;
+            case 5: a.emit(LDY_ZP, 0x20); break;
+            case 6: a.emit(LDA_INDY, 0x30); break;
+            }
+        });
+        k = 0;
+        add_mix(cases, "stores", [&k](Assembler& a) {
+            switch (k++ % 7) {
+            case 0: a.emit(STA_ZP, 0x10); break;
+            case 1: a.emit(STA_ZPX, 0x10); break;
+            case 2: a.emit16(STA_ABS, 0x0300); break;
+            case 3: a.emit16(STA_ABSX, 0x0310); break;
+            case 4: a.emit(STX_ZP, 0x20); break;
+            case 5: a.emit16(STY_ABS, 0x0400); break;
+            // the pointer at 0x30 is 0x0000
+            case 6: a.emit(STA_INDY, 0x30); break;
+            }
+        });
+        k = 0;
+        // to the next instruction, taken or not : the flags are those of
+        // LDX #$ff in init, i.e. N set, Z and C clear
+        add_mix(cases, "branches", [&k](Assembler& a) {
+            static const uint8_t opcodes[] = {BNE, BEQ, BMI, BPL, BCS};
+            a.branch(opcodes[k++ % 5], a.here() + 2);
+        });
+        k = 0;
+        add_mix(cases, "rmw", [&k](Assembler& a) {
+            switch (k++ % 7) {
+            case 0: a.emit(INC_ZP, 0x10); break;
+            case 1: a.emit16(INC_ABS, 0x0300); break;
+            case 2: a.emit16(INC_ABSX, 0x0310); break;
+            case 3: a.emit16(DEC_ABS, 0x0400); break;
+            case 4: a.emit16(ASL_ABS, 0x0500); break;
+            case 5: a.emit(LSR_ZP, 0x20); break;
+            case 6: a.emit(ROR_ZPX, 0x30); break;
+            }
+        });
+    }
+
+    // sprite k on BENCH_SCANLINE for k < nsprite, the others hidden
+    void set_line_sprites(PpuDevice *ppu, int nsprite) {
+        ppu->set(0x2003, 0);
+        for (int k = 0; k < 64; k++) {
+            bool visible = k < nsprite;
+            ppu->set(0x2004, visible ? BENCH_SCANLINE - 4 : 0xff);
+            ppu->set(0x2004, k);
+            ppu->set(0x2004, k & 0b11);
+            ppu->set(0x2004, nsprite > 8 ? k * 4 : k * 30);
+        }
+    }
+
+    void add_ppu_cases(Cases& cases) {
+        PpuDevice *ppu = &m_nes->ppu;
+        // background and sprites on, left 8 pixels shown
+        ppu->set(0x2001, 0x1e);
+        for (uint16_t addr = 0x2000; addr < 0x2400; addr++) {
+            ppu->m_vram[addr] = addr * 7;
+        }
+        ppu->m_scanline = BENCH_SCANLINE;
+
+        cases.push_back({"ppu_render_nametable_segment", [ppu](long n) {
+            for (long i = 0; i < n; i++) {
+                // the segments of the visible dots (columns 8 to 240), 2 to 31
+                ppu->render_nametable_segment(2 + i % 30);
+            }
+        }});
+        for (int nsprite : {0, 8, 64}) {
+            cases.push_back({"ppu_render_oam_scanline_" + std::to_string(nsprite), [this, ppu, nsprite](long n) {
+                set_line_sprites(ppu, nsprite);
+                for (long i = 0; i < n; i++) {
+                    ppu->render_oam_scanline(BENCH_SCANLINE);
+                }
+            }});
+        }
+        cases.push_back({"ppu_get_sprite_line", [ppu](long n) {
+            uint32_t rows = 0;
+            for (long i = 0; i < n; i++) {
+                rows += ppu->get_sprite_line(i, i & 0x100, i & 0b111, i & 0x200, i & 0x400);
+            }
+            g_sink = rows;
+        }});
+    }
+
+    void add_audio_cases(Cases& cases) {
+        m_samples.reset(new SampleStream());
+        m_sound.reset(new SoundEngine(m_samples->get_ring()));
+        SampleStream *samples = m_samples.get();
+        SoundEngine *sound = m_sound.get();
+        for (int channel = 0; channel < 3; channel++) {
+            samples->set_channel_enable(channel, true);
+            samples->set_frequency(channel, 220 * (channel + 1));
+            samples->set_amplitude(channel, AMPLITUDE / 4);
+        }
+        cases.push_back({"audio_synthesize_256", [samples](long n) {
+            int16_t stream[256];
+            for (long i = 0; i < n; i++) {
+                // never runs out
+                for (int channel = 0; channel < 3; channel++) {
+                    samples->set_duration(channel, 1.0f);
+                }
+                samples->synthesize(stream, 256);
+                g_sink = stream[i % 256];
+            }
+        }});
+        // through the ring, from the emulation side to the device callback
+        cases.push_back({"audio_generate_samples_256", [samples, sound](long n) {
+            int16_t chunk[256] = {0};
+            Sint16 stream[256];
+            for (long i = 0; i < n; i++) {
+                samples->get_ring()->push(chunk, 256);
+                sound->generate_samples(stream, 256);
+                g_sink = stream[i % 256];
+            }
+        }});
+    }
+
+    std::vector<uint8_t> m_chr;
+    std::unique_ptr<Nes> m_nes;
+    std::vector<std::unique_ptr<Nes>> m_mixes;
+    std::unique_ptr<SampleStream> m_samples;
+    std::unique_ptr<SoundEngine> m_sound;
+};
+
+static double time_batch(const std::function<void(long)>& run, long n) {
+    auto start = Clock::now();
+    run(n);
+    return std::chrono::duration<double, std::nano>(Clock::now() - start).count();
+}
+
+static Result measure(const std::string& name, const std::function<void(long)>& run) {
+    // calibration, also warms up the caches and the branch predictors
+    long n = 1;
+    while (time_batch(run, n) < BATCH_NS) {
+        n *= 2;
+    }
+    for (int i = 0; i < WARMUP_BATCH_NUMBER; i++) {
+        time_batch(run, n);
+    }
+    std::vector<double> ns_per_op;
+    for (int i = 0; i < BATCH_NUMBER; i++) {
+        ns_per_op.push_back(time_batch(run, n) / n);
+    }
+    std::sort(ns_per_op.begin(), ns_per_op.end());
+    return {name, ns_per_op[BATCH_NUMBER / 2], ns_per_op.front()};
+}
+
+static void pin_thread(int cpu) {
+#ifdef __linux__
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    if (sched_setaffinity(0, sizeof(set), &set) != 0) {
+        std::cerr << "Unable to pin the thread to cpu " << cpu << std::endl;
+    }
+#else
+    std::cerr << "Thread pinning not supported on this host" << std::endl;
+#endif
+}
+
+// name -> median ns, from a file written with --out
+static std::map<std::string, double> load_baseline(const std::string& path) {
+    std::ifstream in(path);
+    if (!in) {
+        throw std::runtime_error("Unable to open " + path);
+    }
+    std::map<std::string, double> baseline;
+    std::string line;
+    while (std::getline(in, line)) {
+        std::istringstream fields(line);
+        std::string name;
+        double median_ns;
+        if (fields >> name >> median_ns) {
+            baseline[name] = median_ns;
+        }
+    }
+    return baseline;
+}
+
+int main(int argc, char **argv) {
+    std::string filter;
+    std::string out_path;
+    std::string baseline_path;
+    int cpu = 0;
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        if (arg == "--filter" && i + 1 < argc) {
+            filter = argv[++i];
+        } else if (arg == "--cpu" && i + 1 < argc) {
+            cpu = std::stoi(argv[++i]);
+        } else if (arg == "--out" && i + 1 < argc) {
+            out_path = argv[++i];
+        } else if (arg == "--baseline" && i + 1 < argc) {
+            baseline_path = argv[++i];
+        } else {
+            std::cerr << "Unknown option " << arg << std::endl;
+            return 1;
+        }
+    }
+
+    pin_thread(cpu);
+    std::map<std::string, double> baseline;
+    if (!baseline_path.empty()) {
+        baseline = load_baseline(baseline_path);
+    }
+    std::ofstream out;
+    if (!out_path.empty()) {
+        out.open(out_path);
+        if (!out) {
+            std::cerr << "Unable to open " << out_path << std::endl;
+            return 1;
+        }
+    }
+
+    MicroBench bench;
+    std::cout << std::left << std::setw(32) << "case" << std::right << std::setw(12) << "median ns"
+        << std::setw(12) << "min ns";
+    if (!baseline.empty()) {
+        std::cout << std::setw(12) << "baseline" << std::setw(10) << "ratio";
+    }
+    std::cout << std::endl << std::fixed << std::setprecision(2);
+    for (const auto& bench_case : bench.cases()) {
+        if (bench_case.first.find(filter) == std::string::npos) {
+            continue;
+        }
+        Result result = measure(bench_case.first, bench_case.second);
+        std::cout << std::left << std::setw(32) << result.name << std::right << std::setw(12) << result.median_ns
+            << std::setw(12) << result.min_ns;
+        auto it = baseline.find(result.name);
+        if (it != baseline.end()) {
+            // above 1 when this build is slower
+            std::cout << std::setw(12) << it->second << std::setw(10) << result.median_ns / it->second;
+        }
+        std::cout << std::endl;
+        if (out.is_open()) {
+            out << result.name << " " << result.median_ns << " " << result.min_ns << "\n";
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,164 @@
+#include "programs.hpp"
+
+// tiles of pseudo random pixels, all the color values are used
+static std::vector<uint8_t> noise_chr() {
+    std::vector<uint8_t> chr(0x4000);
+    uint32_t state = 0x12345678;
+    for (uint8_t& byte : chr) {
+        // xorshift32
+        state ^= state << 13;
+        state ^= state >> 17;
+        state ^= state << 5;
+        byte = state;
+    }
+    return chr;
+}
+
+static Program cpu_alu() {
+    Assembler a;
+    uint16_t reset = a.here();
+    a.init();
+    uint16_t loop = a.here();
+    a.emit(LDX_IMM, 0);
+    uint16_t inner = a.here();
+    a.emit(LDA_ZPX, 0x00);
+    a.emit(ADC_IMM, 3);
+    a.emit(STA_ZPX, 0x00);
+    a.emit(EOR_ZP, 0x10);
+    a.emit(ROL_ACC);
+    a.emit(STA_ZP, 0x10);
+    a.emit(INX);
+    a.branch(BNE, inner);
+    a.emit(INC_ZP, 0x20);
+    a.emit16(JMP_ABS, loop);
+    uint16_t nmi = a.here();
+    a.emit(RTI);
+    return {"cpu_alu", a.link(reset, nmi), noise_chr()};
+}
+
+static Program ram_copy() {
+    Assembler a;
+    uint16_t reset = a.here();
+    a.init();
+    // ($00) = $0300, ($02) = $0400
+    a.emit(LDA_IMM, 0x00);
+    a.emit(STA_ZP, 0x00);
+    a.emit(STA_ZP, 0x02);
+    a.emit(LDA_IMM, 0x03);
+    a.emit(STA_ZP, 0x01);
+    a.emit(LDA_IMM, 0x04);
+    a.emit(STA_ZP, 0x03);
+    uint16_t loop = a.here();
+    a.emit(LDY_IMM, 0);
+    uint16_t copy = a.here();
+    a.emit(LDA_INDY, 0x00);
+    a.emit(STA_INDY, 0x02);
+    a.emit(INY);
+    a.branch(BNE, copy);
+    a.emit16(INC_ABS, 0x0300);
+    a.emit16(JMP_ABS, loop);
+    uint16_t nmi = a.here();
+    a.emit(RTI);
+    return {"ram_copy", a.link(reset, nmi), noise_chr()};
+}
+
+static Program ppu_game() {
+    Assembler a;
+    uint16_t reset = a.here();
+    a.init();
+    // two vblanks for the PPU to warm up
+    for (int i = 0; i < 2; i++) {
+        uint16_t wait = a.here();
+        a.emit16(BIT_ABS, 0x2002);
+        a.branch(BPL, wait);
+    }
+    // palettes
+    a.emit(LDA_IMM, 0x3f);
+    a.emit16(STA_ABS, 0x2006);
+    a.emit(LDA_IMM, 0x00);
+    a.emit16(STA_ABS, 0x2006);
+    a.emit(LDX_IMM, 0);
+    uint16_t palette = a.here();
+    a.emit(TXA);
+    a.emit16(STA_ABS, 0x2007);
+    a.emit(INX);
+    a.emit(CPX_IMM, 32);
+    a.branch(BNE, palette);
+    // sprites of $0200 spread over the screen
+    a.emit(LDX_IMM, 0);
+    uint16_t sprites = a.here();
+    a.emit(TXA);
+    a.emit16(STA_ABSX, 0x0200);
+    a.emit(INX);
+    a.branch(BNE, sprites);
+    // NMI, 8x8 sprites, background and sprites shown
+    a.emit(LDA_IMM, 0x80);
+    a.emit16(STA_ABS, 0x2000);
+    a.emit(LDA_IMM, 0x1e);
+    a.emit16(STA_ABS, 0x2001);
+
+    uint16_t main = a.here();
+    // wait for the NMI to set $30
+    uint16_t wait = a.here();
+    a.emit(LDA_ZP, 0x30);
+    a.branch(BEQ, wait);
+    a.emit(LDA_IMM, 0);
+    a.emit(STA_ZP, 0x30);
+    // move the sprites right
+    a.emit(LDX_IMM, 0);
+    uint16_t move = a.here();
+    a.emit16(INC_ABSX, 0x0203);
+    a.emit(INX);
+    a.emit(INX);
+    a.emit(INX);
+    a.emit(INX);
+    a.branch(BNE, move);
+    a.emit16(JMP_ABS, main);
+
+    uint16_t nmi = a.here();
+    a.emit(PHA);
+    a.emit(LDA_IMM, 0x02);
+    a.emit16(STA_ABS, 0x4014);
+    // 32 tiles of the first nametable, a different row each frame
+    a.emit(LDA_IMM, 0x20);
+    a.emit16(STA_ABS, 0x2006);
+    a.emit(LDA_ZP, 0x31);
+    a.emit16(STA_ABS, 0x2006);
+    a.emit(LDX_IMM, 32);
+    uint16_t tiles = a.here();
+    a.emit(TXA);
+    a.emit16(STA_ABS, 0x2007);
+    a.emit(DEX);
+    a.branch(BNE, tiles);
+    a.emit(INC_ZP, 0x31);
+    // scroll back to the top left of the first nametable
+    a.emit(LDA_IMM, 0);
+    a.emit16(STA_ABS, 0x2005);
+    a.emit16(STA_ABS, 0x2005);
+    a.emit(LDA_IMM, 0x80);
+    a.emit16(STA_ABS, 0x2000);
+    a.emit(INC_ZP, 0x30);
+    a.emit(PLA);
+    a.emit(RTI);
+    return {"ppu_game", a.link(reset, nmi), noise_chr()};
+}
+
+static Program vblank_poll() {
+    Assembler a;
+    uint16_t reset = a.here();
+    a.init();
+    a.emit(LDA_IMM, 0x1e);
+    a.emit16(STA_ABS, 0x2001);
+    uint16_t loop = a.here();
+    a.emit16(BIT_ABS, 0x2002);
+    a.branch(BPL, loop);
+    a.emit(INC_ZP, 0x00);
+    a.emit16(JMP_ABS, loop);
+    uint16_t nmi = a.here();
+    a.emit(RTI);
+    return {"vblank_poll", a.link(reset, nmi), noise_chr()};
+}
+
+std::vector<Program> synthetic_programs() {
+    return {cpu_alu(), ram_copy(), ppu_game(), vblank_poll()};
+}
@@ -0,0 +1,138 @@
+#pragma once
+
+#include <cstdint>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+// opcodes used by the programs and the microbenchmarks
+enum : uint8_t {
+    ADC_IMM = 0x69,
+    ASL_ABS = 0x0e,
+    BCS = 0xb0,
+    BEQ = 0xf0,
+    BIT_ABS = 0x2c,
+    BMI = 0x30,
+    BNE = 0xd0,
+    BPL = 0x10,
+    CLD = 0xd8,
+    CMP_IMM = 0xc9,
+    CPX_IMM = 0xe0,
+    DEC_ABS = 0xce,
+    DEX = 0xca,
+    EOR_ZP = 0x45,
+    INC_ABS = 0xee,
+    INC_ABSX = 0xfe,
+    INC_ZP = 0xe6,
+    INX = 0xe8,
+    INY = 0xc8,
+    JMP_ABS = 0x4c,
+    LDA_ABS = 0xad,
+    LDA_ABSX = 0xbd,
+    LDA_IMM = 0xa9,
+    LDA_INDY = 0xb1,
+    LDA_ZP = 0xa5,
+    LDA_ZPX = 0xb5,
+    LDX_IMM = 0xa2,
+    LDY_IMM = 0xa0,
+    LDY_ZP = 0xa4,
+    LSR_ZP = 0x46,
+    PHA = 0x48,
+    PLA = 0x68,
+    ROL_ACC = 0x2a,
+    ROR_ZPX = 0x76,
+    RTI = 0x40,
+    SEI = 0x78,
+    STA_ABS = 0x8d,
+    STA_ABSX = 0x9d,
+    STA_INDY = 0x91,
+    STA_ZP = 0x85,
+    STA_ZPX = 0x95,
+    STX_ZP = 0x86,
+    STY_ABS = 0x8c,
+    TXA = 0x8a,
+    TXS = 0x9a,
+};
+
+/*
+Minimal assembler : the code is emitted from 0x8000 on, the branches can
+only target addresses already emitted (all the loops jump backward) or the
+next instruction
+*/
+class Assembler {
+public:
+    Assembler() : m_prg(0x8000, 0) {}
+
+    uint16_t here() { return 0x8000 + m_size; }
+
+    void emit(uint8_t opcode) {
+        put(opcode);
+    }
+
+    void emit(uint8_t opcode, uint8_t operand) {
+        put(opcode);
+        put(operand);
+    }
+
+    void emit16(uint8_t opcode, uint16_t operand) {
+        put(opcode);
+        put(operand & 0xff);
+        put(operand >> 8);
+    }
+
+    void branch(uint8_t opcode, uint16_t target) {
+        int offset = target - (here() + 2);
+        if (offset < -128) {
+            throw std::runtime_error("Branch out of range");
+        }
+        emit(opcode, static_cast<uint8_t>(offset));
+    }
+
+    // stack and flags set up, first thing of the reset handler
+    void init() {
+        emit(SEI);
+        emit(CLD);
+        emit(LDX_IMM, 0xff);
+        emit(TXS);
+    }
+
+    std::vector<uint8_t> link(uint16_t reset, uint16_t nmi) {
+        for (uint16_t vector : {0x7ffa, 0x7ffc, 0x7ffe}) {
+            uint16_t addr = vector == 0x7ffc ? reset : nmi;
+            m_prg[vector] = addr & 0xff;
+            m_prg[vector + 1] = addr >> 8;
+        }
+        return m_prg;
+    }
+
+private:
+    void put(uint8_t byte) {
+        if (m_size >= 0x7ffa) {
+            throw std::runtime_error("Program too long");
+        }
+        m_prg[m_size++] = byte;
+    }
+
+    std::vector<uint8_t> m_prg;
+    uint16_t m_size = 0;
+};
+
+/*
+Synthetic workloads of the benchmarks, 6502 programs assembled in memory
+Each one is a 32KB PRG mapped at 0x8000 with its vectors, and a CHR rom
+*/
+struct Program {
+    std::string name;
+    std::vector<uint8_t> prg; // 0x8000 bytes
+    std::vector<uint8_t> chr; // 0x4000 bytes
+};
+
+/**
+ * cpu_alu : arithmetic and branches on the zero page, no device access
+ * ram_copy : indirect indexed copy of a ram page
+ * ppu_game : a game frame loop, sprites moved in ram, OAM DMA and nametable
+ *   writes in the NMI, 64 sprites on screen
+ * vblank_poll : PPUSTATUS polled until the vblank, the idle loops skipped by
+ *   the scheduler
+ */
+std::vector<Program> synthetic_programs();
@@ -10,8 +10,8 @@ ApuDevice::ApuDevice() {
     return;
 }
 
-void ApuDevice::start_sound() {
-    m_sound_engine.startSound();
+void ApuDevice::set_audio_sink(AudioSink * audio) {
+    m_audio = audio;
 }
 
 void ApuDevice::set_cpu(Emu6502 * cpu) {
@@ -24,7 +24,7 @@ uint8_t ApuDevice::get(uint16_t addr) {
 
 void ApuDevice::set_duty_envelope(int chan, uint16_t value) {
     m_square[chan].duty_cycle_no = value >> 6;
-    m_sound_engine.set_duty_cycle(chan, DUTY_CYCLE_VALUES[m_square[chan].duty_cycle_no]);
+    m_audio->set_duty_cycle(chan, DUTY_CYCLE_VALUES[m_square[chan].duty_cycle_no]);
     m_square[chan].constant_volume = ((value & BIT4) != 0);
     if (m_square[chan].constant_volume) {
         m_square[chan].volume = value & 0b1111;
@@ -34,7 +34,7 @@ void ApuDevice::set_duty_envelope(int chan, uint16_t value) {
         m_square[chan].envolope_decay_speed = value & 0b1111;
         m_square[chan].decay_counter = m_square[chan].envolope_decay_speed;
     }
-    m_sound_engine.set_amplitude(chan, static_cast<float>(m_square[chan].volume)/15*MAX_AMPLITUDE);
+    m_audio->set_amplitude(chan, static_cast<float>(m_square[chan].volume)/15*MAX_AMPLITUDE);
 }
 
 void ApuDevice::set_sweep(int chan, uint16_t value) {
@@ -53,8 +53,8 @@ void ApuDevice::set_period_low(int chan, int16_t value) {
 void ApuDevice::set_period_high(int chan, int16_t value) {
     m_square[chan].period = (static_cast<uint16_t>(value & 0b111) << 8) | (m_square[chan].period & 0x00ff);
     m_square[chan].length = APU_LENGTH_COUNTER_LOAD[(value & 0b11111000) >> 3];
-    m_sound_engine.set_frequency(chan, period_to_frequency(m_square[chan].period));
-    m_sound_engine.set_duration(chan, m_square[0].length / 240.0f);
+    m_audio->set_frequency(chan, period_to_frequency(m_square[chan].period));
+    m_audio->set_duration(chan, m_square[0].length / 240.0f);
 }
 
 void ApuDevice::handle_sweep(int chan) {
@@ -72,7 +72,7 @@ void ApuDevice::handle_sweep(int chan) {
                 m_square[chan].period += change_amout;
             }
             // std::cout << "period " << m_square[chan].period << std::endl;
-            m_sound_engine.set_frequency(0, period_to_frequency(m_square[chan].period));
+            m_audio->set_frequency(0, period_to_frequency(m_square[chan].period));
         }
         m_square[chan].sweep_counter--;
     }
@@ -81,6 +81,7 @@ void ApuDevice::handle_sweep(int chan) {
 void ApuDevice::set(uint16_t addr, uint8_t value) {
     uint8_t retval;
     float dur, freq;
+    m_audio->set_cycle(m_cycle);
     
     switch (addr) {
     case KEY_PULSE1_DUTY_ENVELOPE:
@@ -126,16 +127,16 @@ void ApuDevice::set(uint16_t addr, uint8_t value) {
         freq = CLOCK_FREQUENCY / 2.0f / (16.0f*( static_cast<float>(m_triangle.period) + 1));
         dur = m_triangle.length / 6.0f / 240.0f; // why 6 ?
         dur = static_cast<float>(static_cast<int>(dur*freq)/freq); // round duration to a multiple of the period, to prevent popping when ending the sound
-        m_sound_engine.set_frequency(2, freq); 
-        m_sound_engine.set_duration(2, dur);
+        m_audio->set_frequency(2, freq); 
+        m_audio->set_duration(2, dur);
         break;
         
     case KEY_STATUS:
         // TODO : send 0 on powerup / reset
         // TODO : partially implemented
-        m_sound_engine.set_channel_enable(0, (value & BIT0) != 0);
-        m_sound_engine.set_channel_enable(1, (value & BIT1) != 0);
-        m_sound_engine.set_channel_enable(2, (value & BIT2) != 0);
+        m_audio->set_channel_enable(0, (value & BIT0) != 0);
+        m_audio->set_channel_enable(1, (value & BIT1) != 0);
+        m_audio->set_channel_enable(2, (value & BIT2) != 0);
         break;
         
     case KEY_SETMODE:
@@ -158,7 +159,9 @@ void ApuDevice::set(uint16_t addr, uint8_t value) {
 // https://www.nesdev.org/wiki/APU_Frame_Counter
 void ApuDevice::tick() {
     m_apu_cycle_count++;
+    m_cycle += 2;
     if (m_apu_cycle_count % APU_FRAME_CYCLE_COUNT == 0) {
+        m_audio->set_cycle(m_cycle);
         if (m_apu_cycle_count == APU_FRAME_CYCLE_COUNT) {
             // step 1
             quarter_frame_tick();
@@ -207,7 +210,7 @@ void ApuDevice::quarter_frame_tick() {
         squarePulse * square = &m_square[chan_no];
         
         if (chan_no == 0 && m_square[0].sweep_enable && (m_square[0].period <= MIN_PERIOD || m_square[0].period >= MAX_PERIOD)) {
-            m_sound_engine.set_amplitude(chan_no, 0);
+            m_audio->set_amplitude(chan_no, 0);
         }
         
         if (!square->constant_volume && square->volume > 0) {
@@ -216,7 +219,7 @@ void ApuDevice::quarter_frame_tick() {
             }
             if (square->decay_counter == 0) {
                 square->volume--; // testted in the upper if that it was non zero
-                m_sound_engine.set_amplitude(chan_no, static_cast<float>(square->volume)/15*MAX_AMPLITUDE);
+                m_audio->set_amplitude(chan_no, static_cast<float>(square->volume)/15*MAX_AMPLITUDE);
                 square->decay_counter = square->envolope_decay_speed;
             }
         }
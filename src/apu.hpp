@@ -1,6 +1,6 @@
 #pragma once
 #include "device.hpp"
-#include "audio.hpp"
+#include "sinks.hpp"
 #include "cpu.hpp"
 
 enum {
@@ -67,8 +67,11 @@ class ApuDevice : public Device {
     void tick();
     uint8_t get(uint16_t addr);
     void set(uint16_t addr, uint8_t val);
-    void start_sound();
+    // registers are write only, reads have no effect
+    bool is_idle_read(uint16_t addr) { return true; }
     void set_cpu(Emu6502 * cpu);
+    // where the channel changes go, nothing by default
+    void set_audio_sink(AudioSink * audio);
 
  private:
     void quarter_frame_tick();
@@ -91,6 +94,9 @@ private:
     bool m_sequencer_mode = false;
 
     long m_apu_cycle_count = 0;
+    // cpu cycles since power up, the apu ticks every other one
+    uint64_t m_cycle = 0;
 
-    SoundEngine m_sound_engine;
+    AudioSink m_no_audio;
+    AudioSink * m_audio = &m_no_audio;
 };
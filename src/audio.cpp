@@ -2,8 +2,7 @@
 
 void audio_callback(void*, Uint8*, int);
 
-SoundEngine::SoundEngine() {
-    m_square[2].current_phase = M_PI/2.0f; // set init phase of tri wave so that the sound wave starts at 0
+SoundEngine::SoundEngine(SampleRing * ring) : m_ring(ring) {
 }
 
 void SoundEngine::startSound() {
@@ -12,7 +11,7 @@ void SoundEngine::startSound() {
     desiredSpec.freq = SAMPLE_RATE;
     desiredSpec.format = AUDIO_S16SYS;
     desiredSpec.channels = 1;
-    desiredSpec.samples = 256;
+    desiredSpec.samples = DEVICE_BUFFER_SAMPLES;
     desiredSpec.callback = audio_callback;
     desiredSpec.userdata = this;
 
@@ -23,9 +22,6 @@ void SoundEngine::startSound() {
         exit(1);
     }
 
-    // Initialize phase and start time
-    start_time = SDL_GetTicks();
-
     // Start playing audio
     SDL_PauseAudio(0);
 }
@@ -35,82 +31,17 @@ SoundEngine::~SoundEngine()
     SDL_CloseAudio();
 }
 
-void SoundEngine::validate_channel_no(int channel) {
-    if (!(channel <= 2 && channel >= 0)) {
-        throw std::runtime_error("Bad channel number");
-    }
-}
-
-void SoundEngine::set_frequency(int channel, float frequency)
-{   
-    validate_channel_no(channel);
-    m_square[channel].frequency = frequency;
-}
-
-void SoundEngine::set_duration(int channel, float duration) {
-    validate_channel_no(channel);
-    m_square[channel].left_duration = duration;
-}
-
-void SoundEngine::set_amplitude(int channel, float amplitude)
-{   
-    validate_channel_no(channel);
-    m_square[channel].amplitude = amplitude;
-}
-
-void SoundEngine::set_duty_cycle(int channel, float duty_cycle)
-{   
-    validate_channel_no(channel);
-    m_square[channel].duty_cycle = duty_cycle;
-}
-
-void SoundEngine::set_channel_enable(int channel, float enable)
-{   
-    validate_channel_no(channel);
-    m_square[channel].enabled = enable;
-}
-
 void SoundEngine::generate_samples(Sint16 *stream, int length)
 {
-    for (int i = 0; i < length; i++) {
-        stream[i] = 0;
-        
-        for (int chan_no=0; chan_no < 2; chan_no++) {
-            squareWave * channel = &m_square[chan_no];
-            // std::cout << channel->enabled << " " << channel->left_duration << " " << channel->duty_cycle << " " << channel->current_phase << " " << channel->amplitude << std::endl;
-            if (!(channel->enabled && channel->left_duration > 0)) {
-                continue;
-            }
-            stream[i] += channel->amplitude * ((channel->current_phase < 2 * M_PI * channel->duty_cycle) ? 1.0f:-1.0f);
-            channel->left_duration -= 1.0f/SAMPLE_RATE;
-            // increase phase only if playing
-            channel->current_phase += 2 * M_PI * channel->frequency / SAMPLE_RATE;
-            // Wrap phase to avoid overflow
-            if (channel->current_phase > 2 * M_PI) {
-                channel->current_phase -= 2 * M_PI;
-            }
-        }
-
-        squareWave * channel = &m_square[2];
-
-        if ((channel->enabled && channel->left_duration > 0)) {
-            if (channel->current_phase < M_PI) {
-                stream[i] += 2*channel->amplitude * (channel->current_phase/M_PI*2 - 1);
-            } else {
-                stream[i] += 2*channel->amplitude * (3 - channel->current_phase/M_PI*2);
-            }
-        } else {
-            channel->current_phase = M_PI/2.0f; // resets phase so that we start at 0
-        }
-        channel->left_duration -= 1.0f/SAMPLE_RATE;
-        // increase phase only if playing
-        channel->current_phase += 2 * M_PI * channel->frequency / SAMPLE_RATE;
-        // Wrap phase to avoid overflow
-        if (channel->current_phase > 2 * M_PI) {
-            channel->current_phase -= 2 * M_PI;
-        }
-
+    size_t npopped = m_ring->pop(stream, length);
+    if (npopped > 0) {
+        m_last_sample = stream[npopped - 1];
+    }
+    for (int i = npopped; i < length; i++) {
+        stream[i] = m_last_sample;
     }
+    m_underrun_samples.fetch_add(length - npopped, std::memory_order_relaxed);
+    m_samples_played.fetch_add(length, std::memory_order_relaxed);
 }
 
 void audio_callback(void *_beeper, Uint8 *_stream, int _length)
@@ -1,47 +1,39 @@
 #pragma once
 #include <SDL2/SDL.h>
 #include <SDL2/SDL_audio.h>
+#include <atomic>
 #include <cmath>
 #include <iostream>
 
-const int AMPLITUDE = 28000;
-const int SAMPLE_RATE = 44100;
-const float SAMPLE_RATE_PERIOD = 1.0f / SAMPLE_RATE;
-const int BASE_FREQUENCY = 440;  // Base frequency in Hz (A4 note)
-const float MODULATION_FREQUENCY = 10;  // Frequency of the frequency modulation in Hz
+#include "samplestream.hpp"
 
-enum {
-    PULSE_DUTY_12 = 0,
-    PULSE_DUTY_25 = 1,
-    PULSE_DUTY_50 = 2,
-    PULSE_DUTY_25_NEGATED = 3,
-};
-
-struct squareWave {
-    float frequency = 400;
-    float left_duration = 0;
-    float amplitude = AMPLITUDE/4; // TODO : try setting at 0 the init amplitude
-    double current_phase = 0; // Tracks the phase of the wave
-    float duty_cycle = 0.5;
-    bool enabled = true;
-};
+// samples of the device buffer, played after the ones of the ring
+const int DEVICE_BUFFER_SAMPLES = 256;
 
+/*
+Plays the samples of the emulation (see SampleStream) through SDL audio
+The device callback only drains the ring, when it runs dry the last sample
+is held.
+*/
 class SoundEngine
 {
 private:
-    Uint32 start_time;  // Tracks the start time for modulation
-    squareWave m_square[3];
-    void validate_channel_no(int channel);
-    float get_wave(float phase, int duty_cycle);
+    SampleRing * m_ring;
+    std::atomic<uint64_t> m_samples_played{0};
+    std::atomic<uint64_t> m_underrun_samples{0};
+    // only used by the device thread
+    Sint16 m_last_sample = 0;
 
 public:
-    SoundEngine();
+    SoundEngine(SampleRing * ring);
     ~SoundEngine();
     void startSound();
-    void set_frequency(int channel, float frequency);
-    void set_duration(int channel, float duration);
-    void set_amplitude(int channel, float amplitude);
-    void set_duty_cycle(int channel, float duty_cycle);
-    void set_channel_enable(int channel, float enable);
+    // fills stream from the ring, called by the device
     void generate_samples(Sint16 *stream, int length);
+    // sound handed to the device so far, its clock (see Pacer::set_audio_clock)
+    double get_seconds_played() const { return m_samples_played.load(std::memory_order_relaxed) / static_cast<double>(SAMPLE_RATE); }
+    // samples the ring was short of
+    uint64_t get_underrun_samples() const { return m_underrun_samples.load(std::memory_order_relaxed); }
+    // time a sample pushed now waits before being played, in seconds
+    double get_latency() const { return (m_ring->size() + DEVICE_BUFFER_SAMPLES) / static_cast<double>(SAMPLE_RATE); }
 };
@@ -0,0 +1,111 @@
+#include <csignal>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+
+#include "counters.hpp"
+
+#ifdef NESQUICK_COUNTERS
+
+Counters g_counters = {};
+
+static volatile std::sig_atomic_t g_dump_requested = 0;
+
+// indexed by the addressing mode constants of cpu.hpp, empty when unused
+static const char * ADDR_MODE_NAMES[COUNTERS_ADDR_MODE_NUMBER] = {
+    "immediate", "zeropage", "zeropage_x", "zeropage_y", "absolute", "absolute_x",
+    "absolute_y", "", "indirect", "pre_index_indirect", "post_index_indirect",
+    "accumulator", "implicit",
+};
+
+static std::string counters_path() {
+    const char *path = std::getenv("NESQUICK_COUNTERS_FILE");
+    return path != nullptr ? path : "nesquick_counters.json";
+}
+
+// the entries of values that are not 0, as "key": value with the given key prefix
+static void write_nonzero(std::ostream& out, const char *name, const uint64_t *values, int size, const char *prefix) {
+    out << "  \"" << name << "\": {";
+    bool first = true;
+    for (int i = 0; i < size; i++) {
+        if (values[i] == 0) {
+            continue;
+        }
+        char key[8];
+        snprintf(key, sizeof(key), "%02x", i);
+        out << (first ? "" : ", ") << "\"" << prefix << key << "\": " << values[i];
+        first = false;
+    }
+    out << "}";
+}
+
+void dump_counters(const std::string& path) {
+    std::ofstream out(path);
+    if (!out) {
+        std::cerr << "Unable to write the counters to " << path << std::endl;
+        return;
+    }
+    out << "{\n";
+    write_nonzero(out, "opcode_execs", g_counters.opcode_execs, 256, "0x");
+    out << ",\n";
+    write_nonzero(out, "opcode_cycles", g_counters.opcode_cycles, 256, "0x");
+    out << ",\n  \"addr_mode_execs\": {";
+    bool first = true;
+    for (int mode = 0; mode < COUNTERS_ADDR_MODE_NUMBER; mode++) {
+        if (ADDR_MODE_NAMES[mode][0] == '\0') {
+            continue;
+        }
+        out << (first ? "" : ", ") << "\"" << ADDR_MODE_NAMES[mode] << "\": " << g_counters.addr_mode_execs[mode];
+        first = false;
+    }
+    out << "},\n  \"page_cross_penalties\": " << g_counters.page_cross_penalties << ",\n";
+    // keyed by the page high byte, i.e. "0x20" for $2000-$20ff
+    write_nonzero(out, "page_reads", g_counters.page_reads, 256, "0x");
+    out << ",\n";
+    write_nonzero(out, "page_writes", g_counters.page_writes, 256, "0x");
+    out << ",\n";
+    // keyed by the register address
+    write_nonzero(out, "ppu_reg_reads", g_counters.ppu_reg_reads, COUNTERS_PPU_REG_NUMBER, "0x20");
+    out << ",\n";
+    write_nonzero(out, "ppu_reg_writes", g_counters.ppu_reg_writes, COUNTERS_PPU_REG_NUMBER, "0x20");
+    out << ",\n";
+    write_nonzero(out, "apu_reg_reads", g_counters.apu_reg_reads, COUNTERS_APU_REG_NUMBER, "0x40");
+    out << ",\n";
+    write_nonzero(out, "apu_reg_writes", g_counters.apu_reg_writes, COUNTERS_APU_REG_NUMBER, "0x40");
+    out << "\n}\n";
+}
+
+void poll_counters_signal() {
+    if (g_dump_requested) {
+        g_dump_requested = 0;
+        dump_counters(counters_path());
+    }
+}
+
+/*
+The dump cannot be written from the signal handler (not async signal safe),
+the emulation thread writes it at the next frame end (see PpuDevice::saveFrame)
+*/
+static void request_dump(int) {
+    g_dump_requested = 1;
+}
+
+static void dump_at_exit() {
+    dump_counters(counters_path());
+}
+
+// installed when the core starts, before main
+static const bool g_counters_installed = [] {
+    std::signal(SIGUSR1, request_dump);
+    std::atexit(dump_at_exit);
+    return true;
+}();
+
+#else
+
+void dump_counters(const std::string& path) {}
+
+void poll_counters_signal() {}
+
+#endif
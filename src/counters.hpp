@@ -0,0 +1,65 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+
+/*
+Hot path counters, to find out where the time goes on a given game
+Compiled in with the NESQUICK_COUNTERS cmake option, COUNTERS(...) expands to
+nothing otherwise and the emulator is left untouched.
+
+Counted :
+- executions and cycles per opcode, executions per addressing mode and the
+  page crossing penalties, by the interpreter (the blocks compiled by the JIT
+  and the idle loop iterations skipped by the scheduler are not counted)
+- reads and writes per 256 bytes page of the cpu bus, by the instructions and
+  the OAM DMA (the instruction fetches are counted when decoded, only once for
+  the rom code)
+- reads and writes per PPU ($2000-$2007, mirrors folded) and APU / IO
+  ($4000-$4017) register
+
+The counters are dumped as json to $NESQUICK_COUNTERS_FILE (default
+nesquick_counters.json) at exit, and at the end of the frame following a
+SIGUSR1.
+*/
+
+#ifdef NESQUICK_COUNTERS
+#define COUNTERS(statement) statement
+#else
+#define COUNTERS(statement)
+#endif
+
+// the addressing mode constants of cpu.hpp are below 13
+const int COUNTERS_ADDR_MODE_NUMBER = 13;
+const int COUNTERS_PPU_REG_NUMBER = 8;
+const int COUNTERS_APU_REG_NUMBER = 0x18;
+
+struct Counters {
+    uint64_t opcode_execs[256];
+    uint64_t opcode_cycles[256];
+    uint64_t addr_mode_execs[COUNTERS_ADDR_MODE_NUMBER];
+    uint64_t page_cross_penalties;
+    uint64_t page_reads[256];
+    uint64_t page_writes[256];
+    uint64_t ppu_reg_reads[COUNTERS_PPU_REG_NUMBER];
+    uint64_t ppu_reg_writes[COUNTERS_PPU_REG_NUMBER];
+    uint64_t apu_reg_reads[COUNTERS_APU_REG_NUMBER];
+    uint64_t apu_reg_writes[COUNTERS_APU_REG_NUMBER];
+};
+
+extern Counters g_counters;
+
+// bus access to addr outside of plain memory
+inline void count_register_access(uint16_t addr, bool write) {
+    if (addr >= 0x2000 && addr < 0x4000) {
+        (write ? g_counters.ppu_reg_writes : g_counters.ppu_reg_reads)[addr & 0x7]++;
+    } else if (addr >= 0x4000 && addr < 0x4000 + COUNTERS_APU_REG_NUMBER) {
+        (write ? g_counters.apu_reg_writes : g_counters.apu_reg_reads)[addr - 0x4000]++;
+    }
+}
+
+// writes the counters as json to path
+void dump_counters(const std::string& path);
+
+// dumps the counters if a SIGUSR1 came since the last call, once per frame
+void poll_counters_signal();
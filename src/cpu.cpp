@@ -1,13 +1,260 @@
 #include <iostream>
 #include <vector>
-#include <map>
 #include <stdexcept>
+#include <utility>
 
 #include "utils.hpp"
 #include "cpu.hpp"
+#include "jit.hpp"
+#include "counters.hpp"
 
 #define DEBUG_TYPE_MESEN true
 
+template<void (Emu6502::*OP)(), int MODE, int EC>
+constexpr Emu6502::Opcode Emu6502::make_op(uint nbytes, uint base_ncycle) {
+    return {&Emu6502::exec_op<OP, MODE, EC>, MODE, nbytes, base_ncycle, EC};
+}
+
+constexpr std::array<Emu6502::Opcode, 256> Emu6502::make_opcode_table() {
+    std::array<Opcode, 256> table {};
+
+    // BRK and RTI
+    table[0x00] = make_op<&Emu6502::op_brk, IMPLICIT, NOEC>(0, 7);
+    table[0x40] = make_op<&Emu6502::op_rti, IMPLICIT, NOEC>(0, 6);
+
+    // NOP
+    table[0xea] = make_op<&Emu6502::op_nop, IMPLICIT, NOEC>(1, 2);
+
+    // BIT TEST
+    table[0x24] = make_op<&Emu6502::op_bit, ZEROPAGE, NOEC>(2, 3);
+    table[0x2c] = make_op<&Emu6502::op_bit, ABSOLUTE, NOEC>(3, 4);
+
+    // ADC (Add with Carry)
+    table[0x69] = make_op<&Emu6502::op_adc, IMMEDIATE, NOEC>(2, 2);
+    table[0x65] = make_op<&Emu6502::op_adc, ZEROPAGE, NOEC>(2, 3);
+    table[0x75] = make_op<&Emu6502::op_adc, ZEROPAGE_X, NOEC>(2, 4);
+    table[0x6d] = make_op<&Emu6502::op_adc, ABSOLUTE, NOEC>(3, 4);
+    table[0x7d] = make_op<&Emu6502::op_adc, ABSOLUTE_X, YESEC>(3, 4);
+    table[0x79] = make_op<&Emu6502::op_adc, ABSOLUTE_Y, YESEC>(3, 4);
+    table[0x61] = make_op<&Emu6502::op_adc, PRE_INDEX_INDIRECT, NOEC>(2, 6);
+    table[0x71] = make_op<&Emu6502::op_adc, POST_INDEX_INDIRECT, YESEC>(2, 5);
+
+    // SBC (Subtract with Carry)
+    table[0xe9] = make_op<&Emu6502::op_sbc, IMMEDIATE, NOEC>(2, 2);
+    table[0xe5] = make_op<&Emu6502::op_sbc, ZEROPAGE, NOEC>(2, 3);
+    table[0xf5] = make_op<&Emu6502::op_sbc, ZEROPAGE_X, NOEC>(2, 4);
+    table[0xed] = make_op<&Emu6502::op_sbc, ABSOLUTE, NOEC>(3, 4);
+    table[0xfd] = make_op<&Emu6502::op_sbc, ABSOLUTE_X, YESEC>(3, 4);
+    table[0xf9] = make_op<&Emu6502::op_sbc, ABSOLUTE_Y, YESEC>(3, 4);
+    table[0xe1] = make_op<&Emu6502::op_sbc, PRE_INDEX_INDIRECT, NOEC>(2, 6);
+    table[0xf1] = make_op<&Emu6502::op_sbc, POST_INDEX_INDIRECT, YESEC>(2, 5);
+
+    // AND (Logical AND)
+    table[0x29] = make_op<&Emu6502::op_and, IMMEDIATE, NOEC>(2, 2);
+    table[0x25] = make_op<&Emu6502::op_and, ZEROPAGE, NOEC>(2, 3);
+    table[0x35] = make_op<&Emu6502::op_and, ZEROPAGE_X, NOEC>(2, 4);
+    table[0x2d] = make_op<&Emu6502::op_and, ABSOLUTE, NOEC>(3, 4);
+    table[0x3d] = make_op<&Emu6502::op_and, ABSOLUTE_X, YESEC>(3, 4);
+    table[0x39] = make_op<&Emu6502::op_and, ABSOLUTE_Y, YESEC>(3, 4);
+    table[0x21] = make_op<&Emu6502::op_and, PRE_INDEX_INDIRECT, NOEC>(2, 6);
+    table[0x31] = make_op<&Emu6502::op_and, POST_INDEX_INDIRECT, YESEC>(2, 5);
+
+    // ORA (Logical OR)
+    table[0x09] = make_op<&Emu6502::op_ora, IMMEDIATE, NOEC>(2, 2);
+    table[0x05] = make_op<&Emu6502::op_ora, ZEROPAGE, NOEC>(2, 3);
+    table[0x15] = make_op<&Emu6502::op_ora, ZEROPAGE_X, NOEC>(2, 4);
+    table[0x0d] = make_op<&Emu6502::op_ora, ABSOLUTE, NOEC>(3, 4);
+    table[0x1d] = make_op<&Emu6502::op_ora, ABSOLUTE_X, YESEC>(3, 4);
+    table[0x19] = make_op<&Emu6502::op_ora, ABSOLUTE_Y, YESEC>(3, 4);
+    table[0x01] = make_op<&Emu6502::op_ora, PRE_INDEX_INDIRECT, NOEC>(2, 6);
+    table[0x11] = make_op<&Emu6502::op_ora, POST_INDEX_INDIRECT, YESEC>(2, 5);
+
+    // EOR (Logical Exclusive OR)
+    table[0x49] = make_op<&Emu6502::op_eor, IMMEDIATE, NOEC>(2, 2);
+    table[0x45] = make_op<&Emu6502::op_eor, ZEROPAGE, NOEC>(2, 3);
+    table[0x55] = make_op<&Emu6502::op_eor, ZEROPAGE_X, NOEC>(2, 4);
+    table[0x4d] = make_op<&Emu6502::op_eor, ABSOLUTE, NOEC>(3, 4);
+    table[0x5d] = make_op<&Emu6502::op_eor, ABSOLUTE_X, YESEC>(3, 4);
+    table[0x59] = make_op<&Emu6502::op_eor, ABSOLUTE_Y, YESEC>(3, 4);
+    table[0x41] = make_op<&Emu6502::op_eor, PRE_INDEX_INDIRECT, NOEC>(2, 6);
+    table[0x51] = make_op<&Emu6502::op_eor, POST_INDEX_INDIRECT, YESEC>(2, 5);
+
+    // CLEAR STATUS
+    table[0x18] = make_op<&Emu6502::op_clc, IMPLICIT, NOEC>(1, 2); // CLC
+    table[0xd8] = make_op<&Emu6502::op_cld, IMPLICIT, NOEC>(1, 2); // CLD
+    table[0x58] = make_op<&Emu6502::op_cli, IMPLICIT, NOEC>(1, 2); // CLI
+    table[0xb8] = make_op<&Emu6502::op_clv, IMPLICIT, NOEC>(1, 2); // CLV
+
+    // SET STATUS
+    table[0x38] = make_op<&Emu6502::op_sec, IMPLICIT, NOEC>(1, 2); // SEC
+    table[0xf8] = make_op<&Emu6502::op_sed, IMPLICIT, NOEC>(1, 2); // SED
+    table[0x78] = make_op<&Emu6502::op_sei, IMPLICIT, NOEC>(1, 2); // SEI
+
+    // BIT SHIFT
+    // LSR
+    table[0x4a] = make_op<&Emu6502::op_lsr_acc, ACCUMULATOR, NOEC>(1, 2);
+    table[0x46] = make_op<&Emu6502::op_lsr_mem, ZEROPAGE, NOEC>(2, 5);
+    table[0x56] = make_op<&Emu6502::op_lsr_mem, ZEROPAGE_X, NOEC>(2, 6);
+    table[0x4e] = make_op<&Emu6502::op_lsr_mem, ABSOLUTE, NOEC>(3, 6);
+    table[0x5e] = make_op<&Emu6502::op_lsr_mem, ABSOLUTE_X, NOEC>(3, 7);
+
+    // ASL
+    table[0x0a] = make_op<&Emu6502::op_asl_acc, ACCUMULATOR, NOEC>(1, 2);
+    table[0x06] = make_op<&Emu6502::op_asl_mem, ZEROPAGE, NOEC>(2, 5);
+    table[0x16] = make_op<&Emu6502::op_asl_mem, ZEROPAGE_X, NOEC>(2, 6);
+    table[0x0e] = make_op<&Emu6502::op_asl_mem, ABSOLUTE, NOEC>(3, 6);
+    table[0x1e] = make_op<&Emu6502::op_asl_mem, ABSOLUTE_X, NOEC>(3, 7);
+
+    // ROL
+    table[0x2a] = make_op<&Emu6502::op_rol_acc, ACCUMULATOR, NOEC>(1, 2);
+    table[0x26] = make_op<&Emu6502::op_rol_mem, ZEROPAGE, NOEC>(2, 5);
+    table[0x36] = make_op<&Emu6502::op_rol_mem, ZEROPAGE_X, NOEC>(2, 6);
+    table[0x2e] = make_op<&Emu6502::op_rol_mem, ABSOLUTE, NOEC>(3, 6);
+    table[0x3e] = make_op<&Emu6502::op_rol_mem, ABSOLUTE_X, NOEC>(3, 7);
+
+    // ROR
+    table[0x6a] = make_op<&Emu6502::op_ror_acc, ACCUMULATOR, NOEC>(1, 2);
+    table[0x66] = make_op<&Emu6502::op_ror_mem, ZEROPAGE, NOEC>(2, 5);
+    table[0x76] = make_op<&Emu6502::op_ror_mem, ZEROPAGE_X, NOEC>(2, 6);
+    table[0x6e] = make_op<&Emu6502::op_ror_mem, ABSOLUTE, NOEC>(3, 6);
+    table[0x7e] = make_op<&Emu6502::op_ror_mem, ABSOLUTE_X, NOEC>(3, 7);
+
+    // LOADS
+    // LDA
+    table[0xa9] = make_op<&Emu6502::op_lda, IMMEDIATE, NOEC>(2, 2);
+    table[0xa5] = make_op<&Emu6502::op_lda, ZEROPAGE, NOEC>(2, 3);
+    table[0xb5] = make_op<&Emu6502::op_lda, ZEROPAGE_X, NOEC>(2, 4);
+    table[0xad] = make_op<&Emu6502::op_lda, ABSOLUTE, NOEC>(3, 4);
+    table[0xbd] = make_op<&Emu6502::op_lda, ABSOLUTE_X, YESEC>(3, 4);
+    table[0xb9] = make_op<&Emu6502::op_lda, ABSOLUTE_Y, YESEC>(3, 4);
+    table[0xa1] = make_op<&Emu6502::op_lda, PRE_INDEX_INDIRECT, NOEC>(2, 6);
+    table[0xb1] = make_op<&Emu6502::op_lda, POST_INDEX_INDIRECT, YESEC>(2, 5);
+
+    // LDX
+    table[0xa2] = make_op<&Emu6502::op_ldx, IMMEDIATE, NOEC>(2, 2);
+    table[0xa6] = make_op<&Emu6502::op_ldx, ZEROPAGE, NOEC>(2, 3);
+    table[0xb6] = make_op<&Emu6502::op_ldx, ZEROPAGE_Y, NOEC>(2, 4);
+    table[0xae] = make_op<&Emu6502::op_ldx, ABSOLUTE, NOEC>(3, 4);
+    table[0xbe] = make_op<&Emu6502::op_ldx, ABSOLUTE_Y, YESEC>(3, 4);
+
+    // LDY
+    table[0xa0] = make_op<&Emu6502::op_ldy, IMMEDIATE, NOEC>(2, 2);
+    table[0xa4] = make_op<&Emu6502::op_ldy, ZEROPAGE, NOEC>(2, 3);
+    table[0xb4] = make_op<&Emu6502::op_ldy, ZEROPAGE_X, NOEC>(2, 4);
+    table[0xac] = make_op<&Emu6502::op_ldy, ABSOLUTE, NOEC>(3, 4);
+    table[0xbc] = make_op<&Emu6502::op_ldy, ABSOLUTE_X, YESEC>(3, 4);
+
+    // STORE
+    // STA
+    table[0x85] = make_op<&Emu6502::op_sta, ZEROPAGE, NOEC>(2, 3);
+    table[0x95] = make_op<&Emu6502::op_sta, ZEROPAGE_X, NOEC>(2, 4);
+    table[0x8d] = make_op<&Emu6502::op_sta, ABSOLUTE, NOEC>(3, 4);
+    table[0x9d] = make_op<&Emu6502::op_sta, ABSOLUTE_X, NOEC>(3, 5);
+    table[0x99] = make_op<&Emu6502::op_sta, ABSOLUTE_Y, NOEC>(3, 5);
+    table[0x81] = make_op<&Emu6502::op_sta, PRE_INDEX_INDIRECT, NOEC>(2, 6);
+    table[0x91] = make_op<&Emu6502::op_sta, POST_INDEX_INDIRECT, NOEC>(2, 6);
+
+    // STX
+    table[0x86] = make_op<&Emu6502::op_stx, ZEROPAGE, NOEC>(2, 3);
+    table[0x96] = make_op<&Emu6502::op_stx, ZEROPAGE_Y, NOEC>(2, 4);
+    table[0x8e] = make_op<&Emu6502::op_stx, ABSOLUTE, NOEC>(3, 4);
+
+    // STY
+    table[0x84] = make_op<&Emu6502::op_sty, ZEROPAGE, NOEC>(2, 3);
+    table[0x94] = make_op<&Emu6502::op_sty, ZEROPAGE_X, NOEC>(2, 4);
+    table[0x8c] = make_op<&Emu6502::op_sty, ABSOLUTE, NOEC>(3, 4);
+
+    // TRANSFER
+    table[0xaa] = make_op<&Emu6502::op_tax, IMPLICIT, NOEC>(1, 2); // TAX
+    table[0xa8] = make_op<&Emu6502::op_tay, IMPLICIT, NOEC>(1, 2); // TAY
+    table[0xba] = make_op<&Emu6502::op_tsx, IMPLICIT, NOEC>(1, 2); // TSX
+    table[0x8a] = make_op<&Emu6502::op_txa, IMPLICIT, NOEC>(1, 2); // TXA
+    table[0x9a] = make_op<&Emu6502::op_txs, IMPLICIT, NOEC>(1, 2); // TXS
+    table[0x98] = make_op<&Emu6502::op_tya, IMPLICIT, NOEC>(1, 2); // TYA
+
+    // COMPARE
+    table[0xc9] = make_op<&Emu6502::op_cpa, IMMEDIATE, NOEC>(2, 2);
+    table[0xc5] = make_op<&Emu6502::op_cpa, ZEROPAGE, NOEC>(2, 3);
+    table[0xd5] = make_op<&Emu6502::op_cpa, ZEROPAGE_X, NOEC>(2, 4);
+    table[0xcd] = make_op<&Emu6502::op_cpa, ABSOLUTE, NOEC>(3, 4);
+    table[0xdd] = make_op<&Emu6502::op_cpa, ABSOLUTE_X, YESEC>(3, 4);
+    table[0xd9] = make_op<&Emu6502::op_cpa, ABSOLUTE_Y, YESEC>(3, 4);
+    table[0xc1] = make_op<&Emu6502::op_cpa, PRE_INDEX_INDIRECT, NOEC>(2, 6);
+    table[0xd1] = make_op<&Emu6502::op_cpa, POST_INDEX_INDIRECT, YESEC>(2, 5);
+
+    table[0xe0] = make_op<&Emu6502::op_cpx, IMMEDIATE, NOEC>(2, 2);
+    table[0xe4] = make_op<&Emu6502::op_cpx, ZEROPAGE, NOEC>(2, 3);
+    table[0xec] = make_op<&Emu6502::op_cpx, ABSOLUTE, NOEC>(3, 4);
+
+    table[0xc0] = make_op<&Emu6502::op_cpy, IMMEDIATE, NOEC>(2, 2);
+    table[0xc4] = make_op<&Emu6502::op_cpy, ZEROPAGE, NOEC>(2, 3);
+    table[0xcc] = make_op<&Emu6502::op_cpy, ABSOLUTE, NOEC>(3, 4);
+
+    // STACK PUSH/PULL
+    table[0x48] = make_op<&Emu6502::op_pha, IMPLICIT, NOEC>(1, 3); // PHA
+    table[0x68] = make_op<&Emu6502::op_pla, IMPLICIT, NOEC>(1, 4); // PLA
+    table[0x08] = make_op<&Emu6502::op_php, IMPLICIT, NOEC>(1, 3); // PHP
+    table[0x28] = make_op<&Emu6502::op_plp, IMPLICIT, NOEC>(1, 4); // PLP
+
+    // INCREASE / DECREASE
+    table[0xca] = make_op<&Emu6502::op_dex, IMPLICIT, NOEC>(1, 2); // DEX
+    table[0x88] = make_op<&Emu6502::op_dey, IMPLICIT, NOEC>(1, 2); // DEY
+
+    table[0xe8] = make_op<&Emu6502::op_inx, IMPLICIT, NOEC>(1, 2); // INX
+    table[0xc8] = make_op<&Emu6502::op_iny, IMPLICIT, NOEC>(1, 2); // INY
+
+    table[0xc6] = make_op<&Emu6502::op_dec, ZEROPAGE, NOEC>(2, 5); // DEC
+    table[0xd6] = make_op<&Emu6502::op_dec, ZEROPAGE_X, NOEC>(2, 6); // DEC
+    table[0xce] = make_op<&Emu6502::op_dec, ABSOLUTE, NOEC>(3, 6); // DEC
+    table[0xde] = make_op<&Emu6502::op_dec, ABSOLUTE_X, NOEC>(3, 7); // DEC
+
+    table[0xe6] = make_op<&Emu6502::op_inc, ZEROPAGE, NOEC>(2, 5); // INC
+    table[0xf6] = make_op<&Emu6502::op_inc, ZEROPAGE_X, NOEC>(2, 6); // INC
+    table[0xee] = make_op<&Emu6502::op_inc, ABSOLUTE, NOEC>(3, 6); // INC
+    table[0xfe] = make_op<&Emu6502::op_inc, ABSOLUTE_X, NOEC>(3, 7); // INC
+
+    // BRANCH
+    table[0xd0] = make_op<&Emu6502::op_bne, IMPLICIT, BRANCHEC>(2, 2); // BNE
+    table[0xf0] = make_op<&Emu6502::op_beq, IMPLICIT, BRANCHEC>(2, 2); // BEQ
+    table[0x90] = make_op<&Emu6502::op_bcc, IMPLICIT, BRANCHEC>(2, 2); // BCC
+    table[0xb0] = make_op<&Emu6502::op_bcs, IMPLICIT, BRANCHEC>(2, 2); // BCS
+    table[0x30] = make_op<&Emu6502::op_bmi, IMPLICIT, BRANCHEC>(2, 2); // BMI
+    table[0x10] = make_op<&Emu6502::op_bpl, IMPLICIT, BRANCHEC>(2, 2); // BPL
+    table[0x50] = make_op<&Emu6502::op_bvc, IMPLICIT, BRANCHEC>(2, 2); // BVC
+    table[0x70] = make_op<&Emu6502::op_bvs, IMPLICIT, BRANCHEC>(2, 2); // BVS
+
+    // JUMP
+    table[0x4c] = make_op<&Emu6502::op_jmp, ABSOLUTE, NOEC>(0, 3); // JMP
+    table[0x6c] = make_op<&Emu6502::op_jmp, INDIRECT, NOEC>(0, 5); // JMP
+    table[0x20] = make_op<&Emu6502::op_jsr, ABSOLUTE, NOEC>(0, 6); // JSR
+    table[0x60] = make_op<&Emu6502::op_rts, IMPLICIT, NOEC>(0, 6); // RTS
+
+    return table;
+}
+
+constexpr std::array<Emu6502::Opcode, 256> Emu6502::opcodes = Emu6502::make_opcode_table();
+
+constexpr bool Emu6502::check_page_cross_cycles(const std::array<Opcode, 256>& table) {
+    for (const auto& op : table) {
+        if (op.extra_cycle_type == YESEC) {
+            if (op.addr_mode != ABSOLUTE_X && op.addr_mode != ABSOLUTE_Y && op.addr_mode != POST_INDEX_INDIRECT) {
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+constexpr bool Emu6502::check_branch_cycles(const std::array<Opcode, 256>& table) {
+    for (const auto& op : table) {
+        // branches are encoded with a relative offset, thus 2 bytes
+        if (op.extra_cycle_type == BRANCHEC && (op.addr_mode != IMPLICIT || op.nbytes != 2)) {
+            return false;
+        }
+    }
+    return true;
+}
+
 Emu6502::Emu6502(Memory *mem, bool debug, LstDebuggerAsm6 *lst)
     : m_debug(debug), mem(mem), lst(lst) {
     regs[REG_SP] = 0xff;
@@ -16,21 +263,79 @@ Emu6502::Emu6502(Memory *mem, bool debug, LstDebuggerAsm6 *lst)
     instruction_cycle = 0;
     instruction_nbcycles = 0;
 
-    check_opcode_map();
+    flush_decode_cache();
+
+    static_assert(check_page_cross_cycles(opcodes), "Invalid opcode map: page crossing extra cycle on a non indexed mode");
+    static_assert(check_branch_cycles(opcodes), "Invalid opcode map: branch extra cycle on a non branch opcode");
+}
+
+Emu6502::~Emu6502() {
 }
 
 void Emu6502::setDebug(bool debug) {
     m_debug = debug;
 }
 
-void Emu6502::check_opcode_map() {
-    for (const auto& pair : opcodes) {
-        if (pair.second.extra_cycle_type == YESEC) {
-            if (pair.second.addr_mode != ABSOLUTE_X && pair.second.addr_mode != ABSOLUTE_Y && pair.second.addr_mode != POST_INDEX_INDIRECT) {
-                throw std::runtime_error("Invalid opcode map");
-            }
+void Emu6502::flush_decode_cache() {
+    block_cache.clear();
+    idle_loop_cache.clear();
+    idle_watch.active = false;
+    if (jit) {
+        jit->flush();
+    }
+    for (uint16_t page_no = 0; page_no < 256; page_no++) {
+        if (mem->is_read_only(page_no << 8)) {
+            decode_cache[page_no].reset(new DecodedInst[256]);
+        } else {
+            decode_cache[page_no].reset();
+        }
+    }
+}
+
+uint Emu6502::decode_inst(uint16_t addr, DecodedInst *inst) {
+    uint8_t opcode = mem->get(addr);
+    const Opcode& op = opcodes[opcode];
+    if (op.func == nullptr) {
+        throw std::runtime_error("Unknown opcode");
+    }
+    uint operand_len = operand_size(op);
+    inst->operand = 0;
+    if (operand_len >= 1) {
+        inst->operand = mem->get(addr + 1);
+    }
+    if (operand_len == 2) {
+        inst->operand += mem->get(addr + 2) << 8;
+    }
+    inst->opcode = opcode;
+    inst->addr_mode = op.addr_mode;
+    inst->nbytes = op.nbytes;
+    inst->base_ncycle = op.base_ncycle;
+    inst->extra_cycle_type = op.extra_cycle_type;
+    // set last, it flags the entry as decoded
+    inst->func = op.func;
+    // length of the encoded instruction
+    return 1 + operand_len;
+}
+
+const Emu6502::DecodedInst * Emu6502::fetch_inst(DecodedInst *scratch) {
+    /*
+    Code living in rom is decoded only once, ram code (or an instruction
+    whose operand overflows the rom) is decoded in scratch at each execution
+    */
+    DecodedInst *cache_page = decode_cache[high_byte(prgm_ctr)].get();
+    if (cache_page != nullptr) {
+        DecodedInst *cached = &cache_page[low_byte(prgm_ctr)];
+        if (cached->func != nullptr) {
+            return cached;
+        }
+        uint inst_len = decode_inst(prgm_ctr, scratch);
+        if (mem->is_read_only(prgm_ctr + inst_len - 1)) {
+            *cached = *scratch;
         }
+        return scratch;
     }
+    decode_inst(prgm_ctr, scratch);
+    return scratch;
 }
 
 void Emu6502::set_status_bit(uint8_t status_bit, bool on) {
@@ -45,67 +350,76 @@ bool Emu6502::get_status_bit(uint8_t status_bit) {
     return (regs[REG_S] & status_bit) != 0;
 }
 
-uint16_t Emu6502::get_addr(int mode, bool * page_crossed) {
+template<int MODE>
+uint16_t Emu6502::get_addr(uint16_t operand, bool * page_crossed) {
     *page_crossed = false;
     bool dummy_bool;
     uint16_t addr = 0;
 
-    if (mode == ABSOLUTE || mode == ABSOLUTE_X || mode == ABSOLUTE_Y) {
-        addr = mem->get(prgm_ctr + 1) + (mem->get(prgm_ctr + 2) << 8);
+    if constexpr (MODE == ABSOLUTE || MODE == ABSOLUTE_X || MODE == ABSOLUTE_Y) {
+        addr = operand;
         uint8_t base_page_no = high_byte(addr);
-        if (mode == ABSOLUTE_X) {
+        if constexpr (MODE == ABSOLUTE_X) {
             addr += regs[REG_X];
-            addr &= 0xffff;
-        } else if (mode == ABSOLUTE_Y) {
+        } else if constexpr (MODE == ABSOLUTE_Y) {
             addr += regs[REG_Y];
-            addr &= 0xffff;
         }
         uint8_t new_page_no = high_byte(addr);
         *page_crossed = (new_page_no != base_page_no);
 
-    } else if (mode == ZEROPAGE || mode == ZEROPAGE_X || mode == ZEROPAGE_Y) {
-        addr = mem->get(prgm_ctr + 1);
-        if (mode == ZEROPAGE_X) {
+    } else if constexpr (MODE == ZEROPAGE || MODE == ZEROPAGE_X || MODE == ZEROPAGE_Y) {
+        addr = low_byte(operand);
+        if constexpr (MODE == ZEROPAGE_X) {
             addr += regs[REG_X];
             addr &= 0xff;
-        } else if (mode == ZEROPAGE_Y) {
+        } else if constexpr (MODE == ZEROPAGE_Y) {
             addr += regs[REG_Y];
             addr &= 0xff;
         }
 
-    } else if (mode == INDIRECT) {
-        uint16_t implicit_addr = get_addr(ABSOLUTE, &dummy_bool);
+    } else if constexpr (MODE == INDIRECT) {
+        uint16_t implicit_addr = get_addr<ABSOLUTE>(operand, &dummy_bool);
         uint8_t dest_addr_lsb = mem->get(implicit_addr);
         uint8_t dest_addr_msb = mem->get((implicit_addr + 1) & 0xffff);
         addr = dest_addr_lsb + (dest_addr_msb << 8);
 
-    } else if (mode == PRE_INDEX_INDIRECT) {
-        uint16_t implicit_addr = get_addr(ZEROPAGE_X, &dummy_bool);
+    } else if constexpr (MODE == PRE_INDEX_INDIRECT) {
+        uint16_t implicit_addr = get_addr<ZEROPAGE_X>(operand, &dummy_bool);
         uint8_t dest_addr_lsb = mem->get(implicit_addr);
         uint8_t dest_addr_msb = mem->get((implicit_addr + 1) & 0xffff);
         addr = dest_addr_lsb + (dest_addr_msb << 8);
 
-    } else if (mode == POST_INDEX_INDIRECT) {
-        uint16_t implicit_addr = get_addr(ZEROPAGE, &dummy_bool);
+    } else if constexpr (MODE == POST_INDEX_INDIRECT) {
+        uint16_t implicit_addr = get_addr<ZEROPAGE>(operand, &dummy_bool);
         uint8_t dest_addr_lsb = mem->get(implicit_addr);
         uint8_t dest_addr_msb = mem->get((implicit_addr + 1) & 0xffff);
         addr = dest_addr_lsb + (dest_addr_msb << 8);
         uint8_t base_page_no = high_byte(addr);
         addr += regs[REG_Y];
-        addr &= 0xffff;
         uint8_t new_page_no = high_byte(addr);
         *page_crossed = (new_page_no != base_page_no);
 
-    } else if (mode == IMMEDIATE) {
-        *page_crossed = false;
+    } else if constexpr (MODE == IMMEDIATE) {
         addr = prgm_ctr + 1;
     } else {
-        throw std::runtime_error("Invalid addressing mode");
+        static_assert(MODE == IMMEDIATE, "Invalid addressing mode");
     }
 
     return addr;
 }
 
+template<void (Emu6502::*OP)(), int MODE, int EC>
+void Emu6502::exec_op() {
+    if constexpr (MODE != IMPLICIT && MODE != ACCUMULATOR) {
+        bool page_crossed;
+        op_addr = get_addr<MODE>(op_operand, &page_crossed);
+        if (EC == YESEC && page_crossed) {
+            op_extra_cycles = 1;
+            COUNTERS(g_counters.page_cross_penalties++);
+        }
+    }
+    (this->*OP)();
+}
 
 void Emu6502::update_zn_flag(uint8_t value) {
     set_status_bit(STATUS_ZERO, value == 0);
@@ -149,22 +463,24 @@ void Emu6502::op_rts() {
     prgm_ctr = (high << 8) + low + 1;
 }
 
-void Emu6502::ph(int reg) {
+template<int REG>
+void Emu6502::ph() {
     // stack begins at 0x01ff and ends at 0x0100
     if (regs[REG_SP] == 0) {
         throw std::runtime_error("Stack overflow");
     }
-    stack_push(regs[reg]);
+    stack_push(regs[REG]);
 }
 
-void Emu6502::pl(int reg) {
+template<int REG>
+void Emu6502::pl() {
     // stack begins at 0x01ff and ends at 0x0100
     if (regs[REG_SP] == 0xff) {
         throw std::runtime_error("Empty stack");
     }
     uint8_t val = stack_pull();
-    regs[reg] = val;
-    if (reg != REG_S) {
+    regs[REG] = val;
+    if constexpr (REG != REG_S) {
         // for REG_S it is already handled!
         update_zn_flag(val);
     }
@@ -179,61 +495,50 @@ void Emu6502::op_bit() {
     set_status_bit(STATUS_OVFLO, (val & 0b01000000) != 0);
 }
 
-void Emu6502::load(int reg, uint8_t val) {
+template<int REG>
+void Emu6502::load(uint8_t val) {
     // load accumulator
-    regs[reg] = val;
+    regs[REG] = val;
     update_zn_flag(val);
 }
 
-void Emu6502::store(int reg, uint16_t addr) {
-    uint8_t val = regs[reg];
+template<int REG>
+void Emu6502::store(uint16_t addr) {
+    uint8_t val = regs[REG];
     mem->set(addr, val);
 }
 
-void Emu6502::transfer(int sreg, int dreg, bool update_zn) {
-    uint8_t val = regs[sreg];
-    regs[dreg] = val;
-    if (update_zn) {
+template<int SREG, int DREG, bool UPDATE_ZN>
+void Emu6502::transfer() {
+    uint8_t val = regs[SREG];
+    regs[DREG] = val;
+    if constexpr (UPDATE_ZN) {
         update_zn_flag(val);
     }
 }
 
-void Emu6502::compare(int reg, uint8_t val) {
-    bool is_carry = (static_cast<uint16_t>(regs[reg]) + static_cast<uint16_t>(byte_not(val)) + 1) > 255;
-    int diff = regs[reg] - val;
+template<int REG>
+void Emu6502::compare(uint8_t val) {
+    bool is_carry = (static_cast<uint16_t>(regs[REG]) + static_cast<uint16_t>(byte_not(val)) + 1) > 255;
+    int diff = regs[REG] - val;
     set_status_bit(STATUS_CARRY, is_carry);
     update_zn_flag(diff); // status_zero goes to 0 if equality
 }
 
-void Emu6502::in_de_reg(int reg, bool sign_plus) {
-    if (sign_plus) {
-        regs[reg]++;
+template<int REG, bool SIGN_PLUS>
+void Emu6502::in_de_reg() {
+    if constexpr (SIGN_PLUS) {
+        regs[REG]++;
     } else {
-        regs[reg]--;
+        regs[REG]--;
     }
-    regs[reg] &= 0xff;
-    update_zn_flag(regs[reg]);
+    update_zn_flag(regs[REG]);
 }
 
-void Emu6502::op_inx() {
-    in_de_reg(REG_X, true);
-}
-
-void Emu6502::op_dex() {
-    in_de_reg(REG_X, false);
-}
-
-void Emu6502::op_iny() {
-    in_de_reg(REG_Y, true);
-}
-
-void Emu6502::op_dey() {
-    in_de_reg(REG_Y, false);
-}
-
-void Emu6502::in_de_mem(uint16_t addr, bool sign_plus) {
+template<bool SIGN_PLUS>
+void Emu6502::in_de_mem(uint16_t addr) {
     uint8_t val = mem->get(addr);
-    if (sign_plus) {
+    if constexpr (SIGN_PLUS) {
         val++;
     } else {
         val--;
@@ -294,18 +599,14 @@ void Emu6502::op_eor() {
     update_zn_flag(regs[REG_A]);
 }
 
-void Emu6502::branch(uint8_t status_bit, bool branch_if_zero) {
+template<uint8_t STATUS_BIT, bool BRANCH_IF_ZERO>
+void Emu6502::branch() {
     int extra_cycles = 0;
-    bool do_branch = false;
-    if (get_status_bit(status_bit) == 0) {
-        do_branch = true;
-    }
-    if (!branch_if_zero) {
-        do_branch = !do_branch;
-    }
+    // branch if the status bit is 0 and BRANCH_IF_ZERO, or 1 and not BRANCH_IF_ZERO
+    bool do_branch = (get_status_bit(STATUS_BIT) != BRANCH_IF_ZERO);
     if (do_branch) {
         // cast to int8_t to takeaccount for a sign
-        int8_t branch_addr = static_cast<int8_t>(mem->get(prgm_ctr + 1));
+        int8_t branch_addr = static_cast<int8_t>(low_byte(op_operand));
         uint8_t base_page = high_byte(prgm_ctr);
         prgm_ctr += branch_addr;
         // no need to crop to 65536 because it is a uint16_t
@@ -457,54 +758,324 @@ void Emu6502::op_reset() {
     prgm_ctr = (mem->get(reset_vector + 1) << 8) + mem->get(reset_vector);
 }
 
-int Emu6502::exec_inst() {
-    if (m_debug) {
-        dbg();
+int Emu6502::exec_interrupt() {
+    /*
+    hw interrupts are not part of the instruction set
+    so they do not go through the opcode table
+    */
+    int type = interrupt_type;
+    // reset interrupt type
+    interrupt_type = INTERRUPT_NO;
+    if (type == INTERRUPT_IRQ) {
+        op_irq();
+    } else if (type == INTERRUPT_NMI) {
+        op_nmi();
+    } else if (type == INTERRUPT_RST) {
+        op_reset();
+    } else {
+        throw std::runtime_error("Invalid interrupt type");
     }
+    return INTERRUPT_NCYCLE;
+}
 
-    uint16_t opcode = 0;
-    if (interrupt_type != INTERRUPT_NO) {
-        // hw interrupt is requested
-        // retreive the fake opcode to run the instruct
-        // as if it was any other function
-        if (interrupt_type == INTERRUPT_IRQ) {
-            opcode = OPCODE_IRQ;
-        } else if (interrupt_type == INTERRUPT_NMI) {
-            opcode = OPCODE_NMI;
-        } else if (interrupt_type == INTERRUPT_RST) {
-            opcode = OPCODE_RST;
-        } else {
-            throw std::runtime_error("Invalid interrupt type");
+bool Emu6502::is_block_safe(const DecodedInst& inst) {
+    /*
+    Blocks run ahead of the PPU and APU, so their instructions must not
+    access the I/O registers. It is decided statically from the operand,
+    indirect modes are unknown until run time thus never safe.
+    */
+    if (is_control_flow(inst.nbytes, inst.extra_cycle_type)) {
+        // the absolute operand of JMP and JSR is a target, not an access
+        return inst.addr_mode != INDIRECT;
+    }
+    switch (inst.addr_mode) {
+    case IMPLICIT:
+    case ACCUMULATOR:
+    case IMMEDIATE:
+    case ZEROPAGE:
+    case ZEROPAGE_X:
+    case ZEROPAGE_Y:
+        return true;
+    case ABSOLUTE:
+        return mem->is_plain(inst.operand);
+    case ABSOLUTE_X:
+    case ABSOLUTE_Y:
+        // the index can move the access up to the next page
+        return mem->is_plain(inst.operand) && mem->is_plain(inst.operand + 0xff);
+    default:
+        return false;
+    }
+}
+
+const Emu6502::Block * Emu6502::get_block(uint16_t addr) {
+    auto it = block_cache.find(addr);
+    if (it != block_cache.end()) {
+        return &it->second;
+    }
+    // blocks are only built from rom, so they never have to be invalidated on write
+    if (!mem->is_read_only(addr)) {
+        return nullptr;
+    }
+    Block block;
+    uint16_t inst_addr = addr;
+    while (block.insts.size() < BLOCK_MAX_LENGTH && mem->is_read_only(inst_addr)) {
+        DecodedInst inst;
+        uint inst_len = decode_inst(inst_addr, &inst);
+        if (!mem->is_read_only(inst_addr + inst_len - 1) || !is_block_safe(inst)) {
+            break;
         }
-        // reset interrupt type
-        interrupt_type = INTERRUPT_NO;
-    } else {
-        // no interrupt, run the next intruction normally
-        opcode = mem->get(prgm_ctr);
+        block.insts.push_back(inst);
+        if (is_control_flow(inst.nbytes, inst.extra_cycle_type)) {
+            break;
+        }
+        inst_addr += inst.nbytes;
     }
+    // an empty block means the first instruction has to run alone
+    return &(block_cache[addr] = std::move(block));
+}
 
-    if (opcodes.find(opcode) == opcodes.end()) {
-        throw std::runtime_error("Unknown opcode");
+bool Emu6502::set_jit(bool enable) {
+    if (!enable) {
+        jit.reset();
+        return true;
+    }
+    if (!Jit6502::is_supported()) {
+        return false;
+    }
+    if (!jit) {
+        jit.reset(new Jit6502(this));
     }
+    return true;
+}
 
-    auto& op = opcodes[opcode];
+uint64_t Emu6502::state_hash() {
+    // FNV-1a
+    uint64_t hash = 0xcbf29ce484222325;
+    auto add = [&hash](uint8_t val) {
+        hash = (hash ^ val) * 0x100000001b3;
+    };
+    for (uint8_t reg : regs) {
+        add(reg);
+    }
+    add(low_byte(prgm_ctr));
+    add(high_byte(prgm_ctr));
+    for (uint16_t addr = 0; addr < CPU_RAM_SIZE; addr++) {
+        add(mem->get(addr));
+    }
+    return hash;
+}
 
-    // holds the addr specified depending on the addressing scheme
-    op_addr = 0;
-    // op_extra_cycles used only by branch ot report if the branching caused an extrac cycle
-    op_extra_cycles = 0;
+int Emu6502::run_block(int max_cycles) {
+    int ncycle = jit ? jit->run_block(max_cycles) : interpret_block(max_cycles);
+    idle_watch.ncycle += ncycle;
+    return ncycle;
+}
 
-    if (!(op.addr_mode == IMPLICIT || op.addr_mode == ACCUMULATOR)) {
-        bool page_crossed;
-        op_addr = get_addr(op.addr_mode, &page_crossed);
-        if (page_crossed) {
-            op_extra_cycles = 1;
+int Emu6502::run_cycles(int budget) {
+    int ncycle = 0;
+    if (instruction_cycle != 0) {
+        // finish the instruction started by tick
+        ncycle = instruction_nbcycles - instruction_cycle;
+        instruction_cycle = 0;
+    }
+    while (ncycle < budget) {
+        ncycle += run_block(budget - ncycle);
+    }
+    return ncycle - budget;
+}
+
+bool Emu6502::is_idle_inst(uint8_t opcode, const DecodedInst& inst) {
+    // register and flag only instructions, plus reads
+    switch (opcode) {
+    case 0xa9: case 0xa5: case 0xb5: case 0xad: case 0xbd: case 0xb9: // LDA
+    case 0xa2: case 0xa6: case 0xb6: case 0xae: case 0xbe: // LDX
+    case 0xa0: case 0xa4: case 0xb4: case 0xac: case 0xbc: // LDY
+    case 0x24: case 0x2c: // BIT
+    case 0xc9: case 0xc5: case 0xd5: case 0xcd: case 0xdd: case 0xd9: // CMP
+    case 0xe0: case 0xe4: case 0xec: // CPX
+    case 0xc0: case 0xc4: case 0xcc: // CPY
+    case 0x29: case 0x25: case 0x35: case 0x2d: case 0x3d: case 0x39: // AND
+    case 0x09: case 0x05: case 0x15: case 0x0d: case 0x1d: case 0x19: // ORA
+    case 0x49: case 0x45: case 0x55: case 0x4d: case 0x5d: case 0x59: // EOR
+    case 0x69: case 0x65: case 0x75: case 0x6d: case 0x7d: case 0x79: // ADC
+    case 0xe9: case 0xe5: case 0xf5: case 0xed: case 0xfd: case 0xf9: // SBC
+    case 0xe8: case 0xca: case 0xc8: case 0x88: // INX DEX INY DEY
+    case 0x18: case 0xd8: case 0x58: case 0xb8: case 0x38: case 0xf8: case 0x78: // flags
+    case 0x4a: case 0x0a: case 0x6a: case 0x2a: // shifts on A
+    case 0xaa: case 0xa8: case 0xba: case 0x8a: case 0x98: // transfers but TXS
+    case 0xea: // NOP
+        break;
+    default:
+        return false;
+    }
+    switch (inst.addr_mode) {
+    case IMPLICIT:
+    case ACCUMULATOR:
+    case IMMEDIATE:
+        return true;
+    case ZEROPAGE:
+    case ABSOLUTE:
+        return mem->is_idle_read(inst.operand);
+    case ZEROPAGE_X:
+    case ZEROPAGE_Y:
+        return mem->is_plain(0);
+    case ABSOLUTE_X:
+    case ABSOLUTE_Y:
+        return mem->is_plain(inst.operand) && mem->is_plain(inst.operand + 0xff);
+    default:
+        // the indirect modes read a pointer that may change
+        return false;
+    }
+}
+
+int Emu6502::find_idle_loop(uint16_t addr) {
+    auto it = idle_loop_cache.find(addr);
+    if (it != idle_loop_cache.end()) {
+        return it->second;
+    }
+    int end = -1;
+    uint16_t inst_addr = addr;
+    for (int i = 0; i < IDLE_LOOP_MAX_LENGTH; i++) {
+        // the analysis is cached, the loop has to stay in rom
+        if (!mem->is_read_only(inst_addr) || opcodes[mem->get(inst_addr)].func == nullptr) {
+            break;
+        }
+        uint8_t opcode = mem->get(inst_addr);
+        DecodedInst inst;
+        uint len = decode_inst(inst_addr, &inst);
+        if (!mem->is_read_only(inst_addr + len - 1)) {
+            break;
+        }
+        if (is_control_flow(inst.nbytes, inst.extra_cycle_type)) {
+            // JMP abs
+            bool jump_back = opcode == 0x4c && inst.operand == addr;
+            if (inst.extra_cycle_type == BRANCHEC) {
+                uint16_t dest = inst_addr + 2 + static_cast<int8_t>(low_byte(inst.operand));
+                jump_back = (dest == addr);
+            }
+            if (jump_back) {
+                end = inst_addr;
+            }
+            break;
         }
+        if (!is_idle_inst(opcode, inst)) {
+            break;
+        }
+        inst_addr += len;
+    }
+    idle_loop_cache[addr] = end;
+    return end;
+}
+
+int Emu6502::idle_loop_cycles(long event_count) {
+    // a loop head is reached by jumping backward
+    bool backward = prgm_ctr <= idle_prev_pc;
+    idle_prev_pc = prgm_ctr;
+    if (m_debug || interrupt_type != INTERRUPT_NO) {
+        idle_watch.active = false;
+        return 0;
+    }
+    if (idle_watch.active) {
+        if (prgm_ctr != idle_watch.head) {
+            if (prgm_ctr < idle_watch.head || prgm_ctr > idle_watch.end) {
+                // left the loop
+                idle_watch.active = false;
+            }
+            return 0;
+        }
+        // one more iteration, the next ones are identical if it changed nothing
+        bool same_regs = true;
+        for (int reg = 0; reg < 5; reg++) {
+            same_regs = same_regs && regs[reg] == idle_watch.regs[reg];
+            idle_watch.regs[reg] = regs[reg];
+        }
+        bool same_events = (event_count == idle_watch.event_count);
+        idle_watch.event_count = event_count;
+        int ncycle = idle_watch.ncycle;
+        idle_watch.ncycle = 0;
+        return (same_regs && same_events) ? ncycle : 0;
+    }
+    if (!backward) {
+        return 0;
+    }
+    int end = find_idle_loop(prgm_ctr);
+    if (end < 0) {
+        return 0;
+    }
+    idle_watch.active = true;
+    idle_watch.head = prgm_ctr;
+    idle_watch.end = end;
+    for (int reg = 0; reg < 5; reg++) {
+        idle_watch.regs[reg] = regs[reg];
+    }
+    idle_watch.event_count = event_count;
+    idle_watch.ncycle = 0;
+    return 0;
+}
+
+#ifdef NESQUICK_COUNTERS
+static void count_inst(uint8_t opcode, uint8_t addr_mode, uint ncycle) {
+    g_counters.opcode_execs[opcode]++;
+    g_counters.opcode_cycles[opcode] += ncycle;
+    g_counters.addr_mode_execs[addr_mode]++;
+}
+#endif
+
+int Emu6502::interpret_block(int max_cycles) {
+    if (m_debug || interrupt_type != INTERRUPT_NO) {
+        return exec_inst();
+    }
+    const Block *block = get_block(prgm_ctr);
+    if (block == nullptr || block->insts.empty()) {
+        return exec_inst();
     }
-    (this->*op.func)();
+    // threaded dispatch : one indirect call per instruction, nothing left to decode
+    int ncycle = 0;
+    for (const DecodedInst& inst : block->insts) {
+        op_operand = inst.operand;
+        op_extra_cycles = 0;
+        (this->*inst.func)();
+        prgm_ctr += inst.nbytes;
+        ncycle += inst.base_ncycle + op_extra_cycles;
+        instruction_count++;
+        COUNTERS(count_inst(inst.opcode, inst.addr_mode, inst.base_ncycle + op_extra_cycles));
+        if (ncycle >= max_cycles || interrupt_type != INTERRUPT_NO) {
+            break;
+        }
+    }
+    return ncycle;
+}
+
+int Emu6502::exec_inst() {
+    if (m_debug) {
+        dbg();
+    }
+
+    if (interrupt_type != INTERRUPT_NO) {
+        // hw interrupt is requested
+        return exec_interrupt();
+    }
+
+    // no interrupt, run the next intruction normally
+    DecodedInst scratch;
+    const DecodedInst *inst = fetch_inst(&scratch);
+
+    // the addr specified by the addressing scheme is resolved by the handler in op_addr
+    op_operand = inst->operand;
+    // op_extra_cycles reports page crossing and branching extra cycles
+    op_extra_cycles = 0;
 
-    uint ncycle = op.base_ncycle + op_extra_cycles;
-    prgm_ctr += op.nbytes;
+    // inst may point in the decode cache, read it before running the op
+    uint nbytes = inst->nbytes;
+    uint base_ncycle = inst->base_ncycle;
+    COUNTERS(uint8_t opcode = inst->opcode);
+    COUNTERS(uint8_t addr_mode = inst->addr_mode);
+    (this->*inst->func)();
+
+    uint ncycle = base_ncycle + op_extra_cycles;
+    prgm_ctr += nbytes;
+    instruction_count++;
+    COUNTERS(count_inst(opcode, addr_mode, ncycle));
     return ncycle;
 }
 
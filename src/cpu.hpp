@@ -1,7 +1,9 @@
 #pragma once
 
 #include <vector>
-#include <map>
+#include <array>
+#include <memory>
+#include <unordered_map>
 #include <cstdint>
 
 #include "cpumem.hpp"
@@ -50,35 +52,89 @@ const int INTERRUPT_IRQ = 1; // Interrupt ReQuest
 const int INTERRUPT_NMI = 2; // Non maskable interrupt
 const int INTERRUPT_RST = 3; // Reset
 
-// Opcodes for interrupts
-const uint16_t OPCODE_RST = 0xffd;
-const uint16_t OPCODE_IRQ = 0xffe;
-const uint16_t OPCODE_NMI = 0xfff;
+// Number of cycles taken by the hw interrupt sequence (IRQ, NMI, RST)
+const int INTERRUPT_NCYCLE = 7;
+
+class Jit6502;
 
 class Emu6502 {
+    friend class Jit6502;
+    // times the private hot paths (bench/micro.cpp)
+    friend class MicroBench;
 public:
     Emu6502(Memory *mem, bool debug = false, LstDebuggerAsm6 *lst = nullptr);
+    ~Emu6502();
     void interrupt(bool maskable);
     void op_reset();
     bool tick();
     void setDebug(bool debug);
+    /**
+     * Drop all the predecoded instructions and blocks
+     * Has to be called whenever the rom mapped on the cpu bus changes (bank switch)
+     */
+    void flush_decode_cache();
+    /**
+     * Runs the cached basic block starting at the PC, stopping early once
+     * max_cycles have been spent or an interrupt is pending
+     * Falls back to a single exec_inst when there is no block at the PC
+     * Returns the number of cycles spent, with the same accounting as exec_inst
+     * The block is run by the JIT when it is enabled
+     */
+    int run_block(int max_cycles);
+    /**
+     * Runs whole instructions (by blocks) until budget cycles have been spent
+     * Pending interrupts are taken at the instruction boundaries
+     * If tick left an instruction in progress, its remaining cycles are spent first
+     * Returns the overshoot, i.e. the cycles spent beyond budget by the last instruction
+     * Only for a bus with the devices mapped directly : the ports of the
+     * Scheduler (as in Nes) bring the devices up to its clock, which this does
+     * not move, use Scheduler::run_until there
+     */
+    int run_cycles(int budget);
+    /**
+     * Enables the x86-64 block compiler used by run_block
+     * Returns false if the host is not supported
+     */
+    bool set_jit(bool enable);
+    // Hash of the registers and of the cpu ram, to compare two runs
+    uint64_t state_hash();
+    /**
+     * Idle loop detection, has to be called after each run_block
+     * event_count is a counter of the device events (see PpuDevice::get_event_count)
+     * Returns the cycles of one iteration when the cpu spins in a short rom
+     * loop that neither writes memory nor touches the stack, only reads ram,
+     * rom or idle registers (see Device::is_idle_read), and whose last
+     * iteration left the registers unchanged without any device event in between.
+     * The next iterations are then identical until the next event or interrupt,
+     * the caller may skip them and only tick the devices. Returns 0 otherwise.
+     */
+    int idle_loop_cycles(long event_count);
+    /**
+     * Suspends the cpu for ncycle more cycles, charged to the instruction
+     * being run. For the devices, during the accesses of the instruction (OAM DMA)
+     */
+    void stall(int ncycle) { op_extra_cycles += ncycle; }
+    // instructions run so far, without the idle loop iterations skipped by the scheduler
+    uint64_t get_instruction_count() { return instruction_count; }
 
 private:
     void set_status_bit(uint8_t status_bit, bool on);
     bool get_status_bit(uint8_t status_bit);
     void update_zn_flag(uint8_t value);
-    void ph(int reg);
-    void pl(int reg);
-    void load(int reg, uint8_t val);
+    // register, status bits and addressing modes are template parameters
+    // so that each handler gets them as compile time constants
+    template<int REG> void ph();
+    template<int REG> void pl();
+    template<int REG> void load(uint8_t val);
     void stack_push(uint8_t val);
     uint8_t stack_pull();
-    void store(int reg, uint16_t addr);
-    void transfer(int sreg, int dreg, bool update_zn = true);
-    void compare(int reg, uint8_t val);
-    void in_de_reg(int reg, bool sign_plus);
-    void in_de_mem(uint16_t addr, bool sign_plus);
+    template<int REG> void store(uint16_t addr);
+    template<int SREG, int DREG, bool UPDATE_ZN = true> void transfer();
+    template<int REG> void compare(uint8_t val);
+    template<int REG, bool SIGN_PLUS> void in_de_reg();
+    template<bool SIGN_PLUS> void in_de_mem(uint16_t addr);
     void add_val_to_acc_carry(uint8_t val);
-    void branch(uint8_t status_bit, bool branch_if_zero);
+    template<uint8_t STATUS_BIT, bool BRANCH_IF_ZERO> void branch();
     uint8_t shift_right(uint8_t val);
     uint8_t shift_left(uint8_t val);
     uint8_t rotate_right(uint8_t val);
@@ -86,6 +142,8 @@ private:
     void hw_interrupt(bool maskable);
     void dbg();
     int exec_inst();
+    int exec_interrupt();
+    int interpret_block(int max_cycles);
     
     // op functions
     void op_nmi();
@@ -98,24 +156,24 @@ private:
     void op_rts();
     void op_bit();
 
-    void op_lda() { load(REG_A, mem->get(op_addr)); }
-    void op_ldx() { load(REG_X, mem->get(op_addr)); }
-    void op_ldy() { load(REG_Y, mem->get(op_addr)); }
+    void op_lda() { load<REG_A>(mem->get(op_addr)); }
+    void op_ldx() { load<REG_X>(mem->get(op_addr)); }
+    void op_ldy() { load<REG_Y>(mem->get(op_addr)); }
 
-    void op_cpa() { compare(REG_A, mem->get(op_addr)); }
-    void op_cpx() { compare(REG_X, mem->get(op_addr)); }
-    void op_cpy() { compare(REG_Y, mem->get(op_addr)); }
+    void op_cpa() { compare<REG_A>(mem->get(op_addr)); }
+    void op_cpx() { compare<REG_X>(mem->get(op_addr)); }
+    void op_cpy() { compare<REG_Y>(mem->get(op_addr)); }
 
-    void op_sta() { store(REG_A, op_addr); }
-    void op_stx() { store(REG_X, op_addr); }
-    void op_sty() { store(REG_Y, op_addr); }
+    void op_sta() { store<REG_A>(op_addr); }
+    void op_stx() { store<REG_X>(op_addr); }
+    void op_sty() { store<REG_Y>(op_addr); }
 
-    void op_inx();
-    void op_dex();
-    void op_iny();
-    void op_dey();
-    void op_inc() { in_de_mem(op_addr, true); }
-    void op_dec() { in_de_mem(op_addr, false); }
+    void op_inx() { in_de_reg<REG_X, true>(); }
+    void op_dex() { in_de_reg<REG_X, false>(); }
+    void op_iny() { in_de_reg<REG_Y, true>(); }
+    void op_dey() { in_de_reg<REG_Y, false>(); }
+    void op_inc() { in_de_mem<true>(op_addr); }
+    void op_dec() { in_de_mem<false>(op_addr); }
     
     void op_adc();
     void op_sbc();
@@ -140,26 +198,26 @@ private:
     void op_ror_mem() { mem->set(op_addr, rotate_right(mem->get(op_addr))); }
     void op_rol_mem() { mem->set(op_addr, rotate_left(mem->get(op_addr))); }
 
-    void op_tax() { transfer(REG_A, REG_X); }
-    void op_tay() { transfer(REG_A, REG_Y); }
-    void op_tsx() { transfer(REG_SP, REG_X); }
-    void op_txa() { transfer(REG_X, REG_A); }
-    void op_txs() { transfer(REG_X, REG_SP, false); }
-    void op_tya() { transfer(REG_Y, REG_A); }
-
-    void op_pha() { ph(REG_A); }
-    void op_pla() { pl(REG_A); }
-    void op_php() { ph(REG_S); }
-    void op_plp() { pl(REG_S); }
-
-    void op_bne() { branch(STATUS_ZERO, true); }
-    void op_beq() { branch(STATUS_ZERO, false); }
-    void op_bcc() { branch(STATUS_CARRY, true); }
-    void op_bcs() { branch(STATUS_CARRY, false); }
-    void op_bmi() { branch(STATUS_NEG, false); }
-    void op_bpl() { branch(STATUS_NEG, true); }
-    void op_bvc() { branch(STATUS_OVFLO, true); }
-    void op_bvs() { branch(STATUS_OVFLO, false); }
+    void op_tax() { transfer<REG_A, REG_X>(); }
+    void op_tay() { transfer<REG_A, REG_Y>(); }
+    void op_tsx() { transfer<REG_SP, REG_X>(); }
+    void op_txa() { transfer<REG_X, REG_A>(); }
+    void op_txs() { transfer<REG_X, REG_SP, false>(); }
+    void op_tya() { transfer<REG_Y, REG_A>(); }
+
+    void op_pha() { ph<REG_A>(); }
+    void op_pla() { pl<REG_A>(); }
+    void op_php() { ph<REG_S>(); }
+    void op_plp() { pl<REG_S>(); }
+
+    void op_bne() { branch<STATUS_ZERO, true>(); }
+    void op_beq() { branch<STATUS_ZERO, false>(); }
+    void op_bcc() { branch<STATUS_CARRY, true>(); }
+    void op_bcs() { branch<STATUS_CARRY, false>(); }
+    void op_bmi() { branch<STATUS_NEG, false>(); }
+    void op_bpl() { branch<STATUS_NEG, true>(); }
+    void op_bvc() { branch<STATUS_OVFLO, true>(); }
+    void op_bvs() { branch<STATUS_OVFLO, false>(); }
 
     void op_nop() {}
 
@@ -176,6 +234,7 @@ private:
     LstDebuggerAsm6 *lst;
     int instruction_cycle;
     int instruction_nbcycles;
+    uint64_t instruction_count = 0;
 
     struct Opcode {
         void (Emu6502::*func)();
@@ -185,229 +244,100 @@ private:
         uint extra_cycle_type;
     };
 
+    // the instruction sets the PC itself (jumps, returns, BRK) or may branch
+    static constexpr bool is_control_flow(uint nbytes, uint extra_cycle_type) {
+        return nbytes == 0 || extra_cycle_type == BRANCHEC;
+    }
+
+    // number of operand bytes following the opcode
+    static constexpr uint operand_size(const Opcode& op) {
+        if (op.addr_mode == ABSOLUTE || op.addr_mode == ABSOLUTE_X || op.addr_mode == ABSOLUTE_Y || op.addr_mode == INDIRECT) {
+            return 2;
+        }
+        if (op.addr_mode == IMPLICIT || op.addr_mode == ACCUMULATOR) {
+            // branches relative offset
+            return op.extra_cycle_type == BRANCHEC ? 1 : 0;
+        }
+        return 1;
+    }
+
     // used specifically for opcode execution (e.g. for  passing mem addr to some opcodes)
     uint op_extra_cycles;
     uint16_t op_addr;
+    uint16_t op_operand;
 
+    template<int MODE> uint16_t get_addr(uint16_t operand, bool *page_crossed);
 
-    void check_opcode_map();
-    uint16_t get_addr(int mode, bool *page_crossed);
+    /**
+     * Runs OP after resolving op_addr for the addressing mode MODE
+     * One instantiation per entry of the opcode table
+     * EC tells if a page crossing costs an extra cycle
+     */
+    template<void (Emu6502::*OP)(), int MODE, int EC> void exec_op();
 
-    std::map<uint16_t, Opcode> opcodes {
-        // INTERRUPTS
-        {OPCODE_IRQ, {&Emu6502::op_irq, IMPLICIT, 0, 7, NOEC}},
-        {OPCODE_NMI, {&Emu6502::op_nmi, IMPLICIT, 0, 7, NOEC}},
-        {OPCODE_RST, {&Emu6502::op_reset, IMPLICIT, 0, 7, NOEC}},
-    
-        // BRK and RTI
-        {0x00, {&Emu6502::op_brk, IMPLICIT, 0, 7, NOEC}},
-        {0x40, {&Emu6502::op_rti, IMPLICIT, 0, 6, NOEC}},
-    
-        // NOP
-        {0xea, {&Emu6502::op_nop, IMPLICIT, 1, 2, NOEC}},
-    
-        // BIT TEST
-        {0x24, {&Emu6502::op_bit, ZEROPAGE, 2, 3, NOEC}},
-        {0x2c, {&Emu6502::op_bit, ABSOLUTE, 3, 4, NOEC}},
-    
-        // ADC (Add with Carry)
-        {0x69, {&Emu6502::op_adc, IMMEDIATE, 2, 2, NOEC}},
-        {0x65, {&Emu6502::op_adc, ZEROPAGE, 2, 3, NOEC}},
-        {0x75, {&Emu6502::op_adc, ZEROPAGE_X, 2, 4, NOEC}},
-        {0x6d, {&Emu6502::op_adc, ABSOLUTE, 3, 4, NOEC}},
-        {0x7d, {&Emu6502::op_adc, ABSOLUTE_X, 3, 4, YESEC}},
-        {0x79, {&Emu6502::op_adc, ABSOLUTE_Y, 3, 4, YESEC}},
-        {0x61, {&Emu6502::op_adc, PRE_INDEX_INDIRECT, 2, 6, NOEC}},
-        {0x71, {&Emu6502::op_adc, POST_INDEX_INDIRECT, 2, 5, YESEC}},
-    
-        // SBC (Subtract with Carry)
-        {0xe9, {&Emu6502::op_sbc, IMMEDIATE, 2, 2, NOEC}},
-        {0xe5, {&Emu6502::op_sbc, ZEROPAGE, 2, 3, NOEC}},
-        {0xf5, {&Emu6502::op_sbc, ZEROPAGE_X, 2, 4, NOEC}},
-        {0xed, {&Emu6502::op_sbc, ABSOLUTE, 3, 4, NOEC}},
-        {0xfd, {&Emu6502::op_sbc, ABSOLUTE_X, 3, 4, YESEC}},
-        {0xf9, {&Emu6502::op_sbc, ABSOLUTE_Y, 3, 4, YESEC}},
-        {0xe1, {&Emu6502::op_sbc, PRE_INDEX_INDIRECT, 2, 6, NOEC}},
-        {0xf1, {&Emu6502::op_sbc, POST_INDEX_INDIRECT, 2, 5, YESEC}},
-    
-        // AND (Logical AND)
-        {0x29, {&Emu6502::op_and, IMMEDIATE, 2, 2, NOEC}},
-        {0x25, {&Emu6502::op_and, ZEROPAGE, 2, 3, NOEC}},
-        {0x35, {&Emu6502::op_and, ZEROPAGE_X, 2, 4, NOEC}},
-        {0x2d, {&Emu6502::op_and, ABSOLUTE, 3, 4, NOEC}},
-        {0x3d, {&Emu6502::op_and, ABSOLUTE_X, 3, 4, YESEC}},
-        {0x39, {&Emu6502::op_and, ABSOLUTE_Y, 3, 4, YESEC}},
-        {0x21, {&Emu6502::op_and, PRE_INDEX_INDIRECT, 2, 6, NOEC}},
-        {0x31, {&Emu6502::op_and, POST_INDEX_INDIRECT, 2, 5, YESEC}},
-    
-        // ORA (Logical OR)
-        {0x09, {&Emu6502::op_ora, IMMEDIATE, 2, 2, NOEC}},
-        {0x05, {&Emu6502::op_ora, ZEROPAGE, 2, 3, NOEC}},
-        {0x15, {&Emu6502::op_ora, ZEROPAGE_X, 2, 4, NOEC}},
-        {0x0d, {&Emu6502::op_ora, ABSOLUTE, 3, 4, NOEC}},
-        {0x1d, {&Emu6502::op_ora, ABSOLUTE_X, 3, 4, YESEC}},
-        {0x19, {&Emu6502::op_ora, ABSOLUTE_Y, 3, 4, YESEC}},
-        {0x01, {&Emu6502::op_ora, PRE_INDEX_INDIRECT, 2, 6, NOEC}},
-        {0x11, {&Emu6502::op_ora, POST_INDEX_INDIRECT, 2, 5, YESEC}},
-    
-        // EOR (Logical Exclusive OR)
-        {0x49, {&Emu6502::op_eor, IMMEDIATE, 2, 2, NOEC}},
-        {0x45, {&Emu6502::op_eor, ZEROPAGE, 2, 3, NOEC}},
-        {0x55, {&Emu6502::op_eor, ZEROPAGE_X, 2, 4, NOEC}},
-        {0x4d, {&Emu6502::op_eor, ABSOLUTE, 3, 4, NOEC}},
-        {0x5d, {&Emu6502::op_eor, ABSOLUTE_X, 3, 4, YESEC}},
-        {0x59, {&Emu6502::op_eor, ABSOLUTE_Y, 3, 4, YESEC}},
-        {0x41, {&Emu6502::op_eor, PRE_INDEX_INDIRECT, 2, 6, NOEC}},
-        {0x51, {&Emu6502::op_eor, POST_INDEX_INDIRECT, 2, 5, YESEC}},
-    
-        // CLEAR STATUS
-        {0x18, {&Emu6502::op_clc, IMPLICIT, 1, 2, NOEC}}, // CLC
-        {0xd8, {&Emu6502::op_cld, IMPLICIT, 1, 2, NOEC}}, // CLD
-        {0x58, {&Emu6502::op_cli, IMPLICIT, 1, 2, NOEC}}, // CLI
-        {0xb8, {&Emu6502::op_clv, IMPLICIT, 1, 2, NOEC}}, // CLV
-    
-        // SET STATUS
-        {0x38, {&Emu6502::op_sec, IMPLICIT, 1, 2, NOEC}}, // SEC
-        {0xf8, {&Emu6502::op_sed, IMPLICIT, 1, 2, NOEC}}, // SED
-        {0x78, {&Emu6502::op_sei, IMPLICIT, 1, 2, NOEC}}, // SEI
-    
-        // BIT SHIFT
-        // LSR
-        {0x4a, {&Emu6502::op_lsr_acc, ACCUMULATOR, 1, 2, NOEC}},
-        {0x46, {&Emu6502::op_lsr_mem, ZEROPAGE, 2, 5, NOEC}},
-        {0x56, {&Emu6502::op_lsr_mem, ZEROPAGE_X, 2, 6, NOEC}},
-        {0x4e, {&Emu6502::op_lsr_mem, ABSOLUTE, 3, 6, NOEC}},
-        {0x5e, {&Emu6502::op_lsr_mem, ABSOLUTE_X, 3, 7, NOEC}},
-    
-        // ASL
-        {0x0a, {&Emu6502::op_asl_acc, ACCUMULATOR, 1, 2, NOEC}},
-        {0x06, {&Emu6502::op_asl_mem, ZEROPAGE, 2, 5, NOEC}},
-        {0x16, {&Emu6502::op_asl_mem, ZEROPAGE_X, 2, 6, NOEC}},
-        {0x0e, {&Emu6502::op_asl_mem, ABSOLUTE, 3, 6, NOEC}},
-        {0x1e, {&Emu6502::op_asl_mem, ABSOLUTE_X, 3, 7, NOEC}},
-    
-        // ROL
-        {0x2a, {&Emu6502::op_rol_acc, ACCUMULATOR, 1, 2, NOEC}},
-        {0x26, {&Emu6502::op_rol_mem, ZEROPAGE, 2, 5, NOEC}},
-        {0x36, {&Emu6502::op_rol_mem, ZEROPAGE_X, 2, 6, NOEC}},
-        {0x2e, {&Emu6502::op_rol_mem, ABSOLUTE, 3, 6, NOEC}},
-        {0x3e, {&Emu6502::op_rol_mem, ABSOLUTE_X, 3, 7, NOEC}},
-    
-        // ROR
-        {0x6a, {&Emu6502::op_ror_acc, ACCUMULATOR, 1, 2, NOEC}},
-        {0x66, {&Emu6502::op_ror_mem, ZEROPAGE, 2, 5, NOEC}},
-        {0x76, {&Emu6502::op_ror_mem, ZEROPAGE_X, 2, 6, NOEC}},
-        {0x6e, {&Emu6502::op_ror_mem, ABSOLUTE, 3, 6, NOEC}},
-        {0x7e, {&Emu6502::op_ror_mem, ABSOLUTE_X, 3, 7, NOEC}},
-    
-        // LOADS
-        // LDA
-        {0xa9, {&Emu6502::op_lda, IMMEDIATE, 2, 2, NOEC}},
-        {0xa5, {&Emu6502::op_lda, ZEROPAGE, 2, 3, NOEC}},
-        {0xb5, {&Emu6502::op_lda, ZEROPAGE_X, 2, 4, NOEC}},
-        {0xad, {&Emu6502::op_lda, ABSOLUTE, 3, 4, NOEC}},
-        {0xbd, {&Emu6502::op_lda, ABSOLUTE_X, 3, 4, YESEC}},
-        {0xb9, {&Emu6502::op_lda, ABSOLUTE_Y, 3, 4, YESEC}},
-        {0xa1, {&Emu6502::op_lda, PRE_INDEX_INDIRECT, 2, 6, NOEC}},
-        {0xb1, {&Emu6502::op_lda, POST_INDEX_INDIRECT, 2, 5, YESEC}},
-    
-        // LDX
-        {0xa2, {&Emu6502::op_ldx, IMMEDIATE, 2, 2, NOEC}},
-        {0xa6, {&Emu6502::op_ldx, ZEROPAGE, 2, 3, NOEC}},
-        {0xb6, {&Emu6502::op_ldx, ZEROPAGE_Y, 2, 4, NOEC}},
-        {0xae, {&Emu6502::op_ldx, ABSOLUTE, 3, 4, NOEC}},
-        {0xbe, {&Emu6502::op_ldx, ABSOLUTE_Y, 3, 4, YESEC}},
-    
-        // LDY
-        {0xa0, {&Emu6502::op_ldy, IMMEDIATE, 2, 2, NOEC}},
-        {0xa4, {&Emu6502::op_ldy, ZEROPAGE, 2, 3, NOEC}},
-        {0xb4, {&Emu6502::op_ldy, ZEROPAGE_X, 2, 4, NOEC}},
-        {0xac, {&Emu6502::op_ldy, ABSOLUTE, 3, 4, NOEC}},
-        {0xbc, {&Emu6502::op_ldy, ABSOLUTE_X, 3, 4, YESEC}},
-    
-        // STORE
-        // STA
-        {0x85, {&Emu6502::op_sta, ZEROPAGE, 2, 3, NOEC}},
-        {0x95, {&Emu6502::op_sta, ZEROPAGE_X, 2, 4, NOEC}},
-        {0x8d, {&Emu6502::op_sta, ABSOLUTE, 3, 4, NOEC}},
-        {0x9d, {&Emu6502::op_sta, ABSOLUTE_X, 3, 5, NOEC}},
-        {0x99, {&Emu6502::op_sta, ABSOLUTE_Y, 3, 5, NOEC}},
-        {0x81, {&Emu6502::op_sta, PRE_INDEX_INDIRECT, 2, 6, NOEC}},
-        {0x91, {&Emu6502::op_sta, POST_INDEX_INDIRECT, 2, 6, NOEC}},
-    
-        // STX
-        {0x86, {&Emu6502::op_stx, ZEROPAGE, 2, 3, NOEC}},
-        {0x96, {&Emu6502::op_stx, ZEROPAGE_Y, 2, 4, NOEC}},
-        {0x8e, {&Emu6502::op_stx, ABSOLUTE, 3, 4, NOEC}},
-    
-        // STY
-        {0x84, {&Emu6502::op_sty, ZEROPAGE, 2, 3, NOEC}},
-        {0x94, {&Emu6502::op_sty, ZEROPAGE_X, 2, 4, NOEC}},
-        {0x8c, {&Emu6502::op_sty, ABSOLUTE, 3, 4, NOEC}},
-    
-        // TRANSFER
-        {0xaa, {&Emu6502::op_tax, IMPLICIT, 1, 2, NOEC}}, // TAX
-        {0xa8, {&Emu6502::op_tay, IMPLICIT, 1, 2, NOEC}}, // TAY
-        {0xba, {&Emu6502::op_tsx, IMPLICIT, 1, 2, NOEC}}, // TSX
-        {0x8a, {&Emu6502::op_txa, IMPLICIT, 1, 2, NOEC}}, // TXA
-        {0x9a, {&Emu6502::op_txs, IMPLICIT, 1, 2, NOEC}}, // TXS
-        {0x98, {&Emu6502::op_tya, IMPLICIT, 1, 2, NOEC}}, // TYA
-    
-        // COMPARE
-        {0xc9, {&Emu6502::op_cpa, IMMEDIATE, 2, 2, NOEC}},
-        {0xc5, {&Emu6502::op_cpa, ZEROPAGE, 2, 3, NOEC}},
-        {0xd5, {&Emu6502::op_cpa, ZEROPAGE_X, 2, 4, NOEC}},
-        {0xcd, {&Emu6502::op_cpa, ABSOLUTE, 3, 4, NOEC}},
-        {0xdd, {&Emu6502::op_cpa, ABSOLUTE_X, 3, 4, YESEC}},
-        {0xd9, {&Emu6502::op_cpa, ABSOLUTE_Y, 3, 4, YESEC}},
-        {0xc1, {&Emu6502::op_cpa, PRE_INDEX_INDIRECT, 2, 6, NOEC}},
-        {0xd1, {&Emu6502::op_cpa, POST_INDEX_INDIRECT, 2, 5, YESEC}},
-    
-        {0xe0, {&Emu6502::op_cpx, IMMEDIATE, 2, 2, NOEC}},
-        {0xe4, {&Emu6502::op_cpx, ZEROPAGE, 2, 3, NOEC}},
-        {0xec, {&Emu6502::op_cpx, ABSOLUTE, 3, 4, NOEC}},
-    
-        {0xc0, {&Emu6502::op_cpy, IMMEDIATE, 2, 2, NOEC}},
-        {0xc4, {&Emu6502::op_cpy, ZEROPAGE, 2, 3, NOEC}},
-        {0xcc, {&Emu6502::op_cpy, ABSOLUTE, 3, 4, NOEC}},
-    
-        // STACK PUSH/PULL
-        {0x48, {&Emu6502::op_pha, IMPLICIT, 1, 3, NOEC}}, // PHA
-        {0x68, {&Emu6502::op_pla, IMPLICIT, 1, 4, NOEC}}, // PLA
-        {0x08, {&Emu6502::op_php, IMPLICIT, 1, 3, NOEC}}, // PHP
-        {0x28, {&Emu6502::op_plp, IMPLICIT, 1, 4, NOEC}}, // PLP
-    
-        // INCREASE / DECREASE
-        {0xca, {&Emu6502::op_dex, IMPLICIT, 1, 2, NOEC}}, // DEX
-        {0x88, {&Emu6502::op_dey, IMPLICIT, 1, 2, NOEC}}, // DEY
-    
-        {0xe8, {&Emu6502::op_inx, IMPLICIT, 1, 2, NOEC}}, // INX
-        {0xc8, {&Emu6502::op_iny, IMPLICIT, 1, 2, NOEC}}, // INY
-    
-        {0xc6, {&Emu6502::op_dec, ZEROPAGE, 2, 5, NOEC}}, // DEC
-        {0xd6, {&Emu6502::op_dec, ZEROPAGE_X, 2, 6, NOEC}}, // DEC
-        {0xce, {&Emu6502::op_dec, ABSOLUTE, 3, 6, NOEC}}, // DEC
-        {0xde, {&Emu6502::op_dec, ABSOLUTE_X, 3, 7, NOEC}}, // DEC
-    
-        {0xe6, {&Emu6502::op_inc, ZEROPAGE, 2, 5, NOEC}}, // INC
-        {0xf6, {&Emu6502::op_inc, ZEROPAGE_X, 2, 6, NOEC}}, // INC
-        {0xee, {&Emu6502::op_inc, ABSOLUTE, 3, 6, NOEC}}, // INC
-        {0xfe, {&Emu6502::op_inc, ABSOLUTE_X, 3, 7, NOEC}}, // INC
-    
-        // BRANCH
-        {0xd0, {&Emu6502::op_bne, IMPLICIT, 2, 2, BRANCHEC}}, // BNE
-        {0xf0, {&Emu6502::op_beq, IMPLICIT, 2, 2, BRANCHEC}}, // BEQ
-        {0x90, {&Emu6502::op_bcc, IMPLICIT, 2, 2, BRANCHEC}}, // BCC
-        {0xb0, {&Emu6502::op_bcs, IMPLICIT, 2, 2, BRANCHEC}}, // BCS
-        {0x30, {&Emu6502::op_bmi, IMPLICIT, 2, 2, BRANCHEC}}, // BMI
-        {0x10, {&Emu6502::op_bpl, IMPLICIT, 2, 2, BRANCHEC}}, // BPL
-        {0x50, {&Emu6502::op_bvc, IMPLICIT, 2, 2, BRANCHEC}}, // BVC
-        {0x70, {&Emu6502::op_bvs, IMPLICIT, 2, 2, BRANCHEC}}, // BVS
-    
-        // JUMP
-        {0x4c, {&Emu6502::op_jmp, ABSOLUTE, 0, 3, NOEC}}, // JMP
-        {0x6c, {&Emu6502::op_jmp, INDIRECT, 0, 5, NOEC}}, // JMP
-        {0x20, {&Emu6502::op_jsr, ABSOLUTE, 0, 6, NOEC}}, // JSR
-        {0x60, {&Emu6502::op_rts, IMPLICIT, 0, 6, NOEC}}, // RTS
+    // Instruction predecoded from the opcode table and the operand bytes
+    struct DecodedInst {
+        void (Emu6502::*func)() = nullptr; // nullptr : not decoded yet
+        uint8_t opcode;
+        uint8_t addr_mode;
+        uint8_t nbytes;
+        uint8_t base_ncycle;
+        uint8_t extra_cycle_type;
+        uint16_t operand;
     };
+
+    // One array of 256 entries per read only (i.e. rom) page, indexed by the low byte of the PC
+    // nullptr for the other pages, their code is decoded at each execution
+    std::unique_ptr<DecodedInst[]> decode_cache[256];
+
+    uint decode_inst(uint16_t addr, DecodedInst *inst);
+    const DecodedInst * fetch_inst(DecodedInst *scratch);
+
+    /*
+    Straight line run of rom instructions, ending at a control flow instruction
+    (branch, JMP, JSR, RTS, RTI, BRK) or before an instruction that may touch
+    an I/O register, which has to run in sync with the PPU and APU
+    */
+    struct Block {
+        std::vector<DecodedInst> insts;
+    };
+    // max number of instructions in a block
+    static const int BLOCK_MAX_LENGTH = 64;
+
+    // keyed by the block start address
+    std::unordered_map<uint16_t, Block> block_cache;
+
+    const Block * get_block(uint16_t addr);
+    bool is_block_safe(const DecodedInst& inst);
+
+    // nullptr when the blocks are interpreted
+    std::unique_ptr<Jit6502> jit;
+
+    // max number of instructions in an idle loop
+    static const int IDLE_LOOP_MAX_LENGTH = 8;
+    // keyed by the loop start address, address of the jump back to it, -1 if not an idle loop
+    std::unordered_map<uint16_t, int> idle_loop_cache;
+    // idle loop candidate being watched by idle_loop_cycles
+    struct IdleLoopWatch {
+        bool active = false;
+        uint16_t head;
+        uint16_t end;
+        uint8_t regs[5];
+        long event_count;
+        int ncycle; // cycles since the last visit of head
+    };
+    IdleLoopWatch idle_watch;
+    uint16_t idle_prev_pc = 0;
+
+    int find_idle_loop(uint16_t addr);
+    bool is_idle_inst(uint8_t opcode, const DecodedInst& inst);
+
+    // 256 entries table indexed by the opcode byte, built at compile time in cpu.cpp
+    // unknown opcodes have a null func
+    template<void (Emu6502::*OP)(), int MODE, int EC>
+    static constexpr Opcode make_op(uint nbytes, uint base_ncycle);
+    static constexpr std::array<Opcode, 256> make_opcode_table();
+    static constexpr bool check_page_cross_cycles(const std::array<Opcode, 256>& table);
+    static constexpr bool check_branch_cycles(const std::array<Opcode, 256>& table);
+    static const std::array<Opcode, 256> opcodes;
 };
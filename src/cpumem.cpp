@@ -1,4 +1,5 @@
 #include <algorithm>
+#include <cstring>
 #include <stdexcept>
 
 #include "cpumem.hpp"
@@ -7,7 +8,10 @@ Memory map is a list of tuples
 (startaddr, device)
 From lowest startaddr to greatest
 
-TODO : investigate the extent of this interface being the source of inefficiency
+The map is flattened into a page table (one entry per 256 bytes)
+so that ram and rom accesses are a single indexed load. Only the pages
+shared by several devices (i.e. 0x4000 : apu and ppu regs) still need to
+search the map.
 */
 Memory::Memory(const std::vector<std::pair<uint16_t, Device *>>& memory_map) {
     for (const auto& pair : memory_map) {
@@ -17,22 +21,51 @@ Memory::Memory(const std::vector<std::pair<uint16_t, Device *>>& memory_map) {
     // search from the biggest addr and stop at the
     // first one lowest than the addr were looking for
     std::reverse(mmap.begin(), mmap.end());
-}
 
-uint8_t Memory::get(uint16_t index) {
-    for (auto& pair : mmap) {
-        if (index >= pair.first) {
-            return pair.second->get(index);
+    for (uint16_t page_no = 0; page_no < 256; page_no++) {
+        uint16_t page_addr = page_no << 8;
+        Device * device = nullptr;
+        for (auto& pair : mmap) {
+            if (page_addr >= pair.first) {
+                device = pair.second;
+                break;
+            }
+        }
+        if (device == nullptr) {
+            // left unmapped, accesses will throw in find_device
+            continue;
+        }
+        bool shared_page = false;
+        for (auto& pair : mmap) {
+            if (pair.first > page_addr && pair.first <= page_addr + 0xff) {
+                shared_page = true;
+            }
+        }
+        if (shared_page) {
+            continue;
         }
+        pages[page_no].device = device;
+        pages[page_no].read = device->read_page(page_addr);
+        pages[page_no].write = device->write_page(page_addr);
+    }
+}
+
+void Memory::copy_page(uint16_t page_addr, uint8_t *dst) {
+    const MemoryPage& page = pages[page_addr >> 8];
+    COUNTERS(g_counters.page_reads[page_addr >> 8] += 256);
+    if (page.read != nullptr) {
+        memcpy(dst, page.read, 256);
+        return;
+    }
+    for (uint16_t offset = 0; offset < 256; offset++) {
+        dst[offset] = get_device(page_addr + offset)->get(page_addr + offset);
     }
-    throw std::runtime_error("Bad memory map");
 }
 
-void Memory::set(uint16_t index, uint8_t value) {
+Device * Memory::find_device(uint16_t index) {
     for (auto& pair : mmap) {
         if (index >= pair.first) {
-            pair.second->set(index, value);
-            return;
+            return pair.second;
         }
     }
     throw std::runtime_error("Bad memory map");
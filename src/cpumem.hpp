@@ -4,14 +4,83 @@
 #include <cstdint>
 
 #include "device.hpp"
+#include "counters.hpp"
+
+/*
+One entry per 256 bytes page of the cpu address space
+read/write point to the host memory of the page when it is plain memory,
+otherwise accesses go through the device
+*/
+struct MemoryPage {
+    const uint8_t *read = nullptr;
+    uint8_t *write = nullptr;
+    Device *device = nullptr; // nullptr if the page is shared by several devices
+};
 
 class Memory {
  public:
     Memory(const std::vector<std::pair<uint16_t, Device*>>& memory_map);
 
-    uint8_t get(uint16_t index);
-    void set(uint16_t index, uint8_t value);
+    uint8_t get(uint16_t index) {
+        const MemoryPage& page = pages[index >> 8];
+        COUNTERS(g_counters.page_reads[index >> 8]++);
+        if (page.read != nullptr) {
+            return page.read[index & 0xff];
+        }
+        COUNTERS(count_register_access(index, false));
+        return get_device(index)->get(index);
+    }
+
+    // true if index is in plain memory, i.e. not an I/O register
+    bool is_plain(uint16_t index) const {
+        return pages[index >> 8].read != nullptr;
+    }
+
+    // true if index is in plain memory that cannot be written (i.e. rom)
+    bool is_read_only(uint16_t index) const {
+        const MemoryPage& page = pages[index >> 8];
+        return page.read != nullptr && page.write == nullptr;
+    }
+
+    /**
+     * Copies the 256 bytes page starting at page_addr to dst, in one memcpy
+     * when the page is plain memory, through the device otherwise
+     */
+    void copy_page(uint16_t page_addr, uint8_t *dst);
+
+    const MemoryPage& get_page(uint16_t index) const {
+        return pages[index >> 8];
+    }
+
+    // true if a loop can poll index without side effect (see Device::is_idle_read)
+    bool is_idle_read(uint16_t index) {
+        if (is_plain(index)) {
+            return true;
+        }
+        return get_device(index)->is_idle_read(index);
+    }
+
+    void set(uint16_t index, uint8_t value) {
+        const MemoryPage& page = pages[index >> 8];
+        COUNTERS(g_counters.page_writes[index >> 8]++);
+        if (page.write != nullptr) {
+            page.write[index & 0xff] = value;
+            return;
+        }
+        COUNTERS(count_register_access(index, true));
+        get_device(index)->set(index, value);
+    }
 
  private:
+    Device * get_device(uint16_t index) {
+        Device * device = pages[index >> 8].device;
+        if (device != nullptr) {
+            return device;
+        }
+        return find_device(index);
+    }
+    Device * find_device(uint16_t index);
+
     std::vector<std::pair<uint16_t, Device*>> mmap;
+    MemoryPage pages[256];
 };
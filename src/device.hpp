@@ -22,10 +22,28 @@ enum {
     BIT15 = 1<<15,
 };
 
+// NES internal ram, mirrored up to 0x1fff
+const uint16_t CPU_RAM_SIZE = 0x800;
+
 class Device {
 public:
     virtual uint8_t get(uint16_t addr) = 0;
     virtual void set(uint16_t addr, uint8_t val) = 0;
+
+    /**
+     * Devices backed by plain memory return the host memory holding the
+     * 256 bytes page starting at page_addr, so that the bus can access it
+     * directly. nullptr means the page has to go through get/set.
+     */
+    virtual const uint8_t * read_page(uint16_t page_addr) { return nullptr; }
+    virtual uint8_t * write_page(uint16_t page_addr) { return nullptr; }
+
+    /**
+     * true if reading addr again and again gives the same value and has no
+     * other effect than the first read, as long as the device has no pending
+     * event. Lets the cpu fast forward the loops polling this register.
+     */
+    virtual bool is_idle_read(uint16_t addr) { return false; }
 };
 
 class CartridgeRomDevice : public Device {
@@ -47,23 +65,36 @@ class CartridgeRomDevice : public Device {
     void set(uint16_t addr, uint8_t val) {
         throw std::runtime_error("Rom don't support assignment");
     }
+
+    const uint8_t * read_page(uint16_t page_addr) {
+        return &mem[page_addr - m_base_addr];
+    }
 };
 
 
 class RamDevice : public Device {
  private:
-    uint8_t mem[0x8000];
+    uint8_t mem[CPU_RAM_SIZE] = {0};
     uint16_t m_base_addr;
 
  public:
     RamDevice(uint16_t base_addr) : m_base_addr(base_addr) {
     }
 
+    // the 2KB are mirrored every CPU_RAM_SIZE bytes
     uint8_t get(uint16_t addr) {
-        return mem[addr - m_base_addr];
+        return mem[(addr - m_base_addr) & (CPU_RAM_SIZE - 1)];
     }
 
     void set(uint16_t addr, uint8_t val) {
-        mem[addr - m_base_addr] = val;
+        mem[(addr - m_base_addr) & (CPU_RAM_SIZE - 1)] = val;
+    }
+
+    const uint8_t * read_page(uint16_t page_addr) {
+        return &mem[(page_addr - m_base_addr) & (CPU_RAM_SIZE - 1)];
+    }
+
+    uint8_t * write_page(uint16_t page_addr) {
+        return &mem[(page_addr - m_base_addr) & (CPU_RAM_SIZE - 1)];
     }
 };
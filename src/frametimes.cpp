@@ -0,0 +1,69 @@
+#include <algorithm>
+#include <cmath>
+#include <fstream>
+#include <stdexcept>
+
+#include "frametimes.hpp"
+
+void FrameTimes::push(const FrameTime& time) {
+    uint64_t head = m_head.load(std::memory_order_relaxed);
+    m_ring[head % CAPACITY] = time;
+    if (time.overrun) {
+        m_overruns.fetch_add(1, std::memory_order_relaxed);
+    }
+    m_head.store(head + 1, std::memory_order_release);
+}
+
+std::vector<FrameTime> FrameTimes::snapshot() const {
+    uint64_t head = m_head.load(std::memory_order_acquire);
+    // the slot of the frame head may be being written
+    uint64_t first = head >= CAPACITY ? head - CAPACITY + 1 : 0;
+    std::vector<FrameTime> times;
+    times.reserve(head - first);
+    for (uint64_t i = first; i < head; i++) {
+        times.push_back(m_ring[i % CAPACITY]);
+    }
+    std::atomic_thread_fence(std::memory_order_acquire);
+    // the slots reused by the frames pushed during the copy
+    uint64_t new_head = m_head.load(std::memory_order_relaxed);
+    if (new_head >= CAPACITY && new_head - CAPACITY + 1 > first) {
+        size_t nreused = std::min<uint64_t>(new_head - CAPACITY + 1 - first, times.size());
+        times.erase(times.begin(), times.begin() + nreused);
+    }
+    return times;
+}
+
+FrameStats FrameTimes::get_stats() const {
+    std::vector<FrameTime> times = snapshot();
+    FrameStats stats = {0, 0, 0, 0, m_overruns.load(std::memory_order_relaxed), times.size()};
+    if (times.empty()) {
+        return stats;
+    }
+    std::vector<float> frame_us;
+    for (const FrameTime& time : times) {
+        frame_us.push_back(time.frame_us);
+    }
+    std::sort(frame_us.begin(), frame_us.end());
+    // nearest rank
+    auto rank = [&frame_us](double percentile) {
+        size_t index = static_cast<size_t>(std::ceil(percentile * frame_us.size()));
+        return frame_us[std::max<size_t>(index, 1) - 1];
+    };
+    stats.p50_us = rank(0.5);
+    stats.p95_us = rank(0.95);
+    stats.p99_us = rank(0.99);
+    stats.max_us = frame_us.back();
+    return stats;
+}
+
+void FrameTimes::write_csv(const std::string& path) const {
+    std::ofstream out(path);
+    if (!out) {
+        throw std::runtime_error("Unable to open " + path);
+    }
+    out << "frame,cpu_us,ppu_us,apu_us,sleep_us,present_us,frame_us,overrun\n";
+    for (const FrameTime& time : snapshot()) {
+        out << time.frame_no << "," << time.cpu_us << "," << time.ppu_us << "," << time.apu_us << ","
+            << time.sleep_us << "," << time.present_us << "," << time.frame_us << "," << time.overrun << "\n";
+    }
+}
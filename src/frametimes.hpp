@@ -0,0 +1,73 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "apu.hpp"
+
+// NTSC frame : 341 * 262 dots minus the one skipped every odd frame, in cpu cycles
+const double FRAME_NCYCLE = 29780.5;
+// host time of a frame at the console speed, 60.0988 fps
+const double FRAME_PERIOD_NS = FRAME_NCYCLE * 1e9 / CLOCK_FREQUENCY;
+
+/*
+Host time of an emulated frame, in microseconds
+cpu, ppu and apu : emulation, the PPU and APU being timed while they catch up
+(see Scheduler::set_timing) and the cpu getting the rest
+sleep : throttling to the console speed
+present : conversion and display of the last frame shown by the ui
+frame : since the end of the previous frame, sleep included
+*/
+struct FrameTime {
+    long frame_no;
+    float cpu_us;
+    float ppu_us;
+    float apu_us;
+    float sleep_us;
+    float present_us;
+    float frame_us;
+    // the emulation of the frame ended after its deadline
+    bool overrun;
+};
+
+// of the frame field over the frames still in the ring
+struct FrameStats {
+    float p50_us;
+    float p95_us;
+    float p99_us;
+    float max_us;
+    long overruns; // since the start
+    size_t nframes;
+};
+
+/*
+The last CAPACITY frame times, written by the emulation thread and read by
+any other one (overlay, dump) without lock : the writer fills the slot then
+publishes it by moving the head, the readers copy the slots and drop the
+ones the writer may have reused meanwhile.
+*/
+class FrameTimes {
+public:
+    static size_t const CAPACITY = 1024;
+
+    // from the emulation thread only
+    void push(const FrameTime& time);
+    // the frames of the ring, oldest first
+    std::vector<FrameTime> snapshot() const;
+    FrameStats get_stats() const;
+    // one line per frame of the ring, with a header
+    void write_csv(const std::string& path) const;
+
+    // by the ui, after each presented frame
+    void set_present_us(float present_us) { m_present_us.store(present_us, std::memory_order_relaxed); }
+    float get_present_us() const { return m_present_us.load(std::memory_order_relaxed); }
+
+private:
+    FrameTime m_ring[CAPACITY];
+    // number of frames pushed so far
+    std::atomic<uint64_t> m_head{0};
+    std::atomic<long> m_overruns{0};
+    std::atomic<float> m_present_us{0};
+};
@@ -0,0 +1,800 @@
+#include <algorithm>
+#include <cstring>
+#include <stdexcept>
+
+#include "jit.hpp"
+#include "utils.hpp"
+
+#if defined(__x86_64__) && defined(__unix__)
+#define JIT_X64 1
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+#ifdef JIT_X64
+
+namespace {
+
+const size_t ARENA_SIZE = 16 << 20;
+// upper bound of the host code emitted for one guest instruction (a fallback call is ~80 bytes)
+const size_t INST_MAX_CODE = 128;
+// prologue and the two exits of a branch
+const size_t BLOCK_EXTRA_CODE = 256;
+
+enum {
+    RAX = 0, RCX, RDX, RBX, RSP, RBP, RSI, RDI,
+    R8, R9, R10, R11, R12, R13, R14, R15,
+};
+
+// guest registers are pinned in callee saved host registers within a block
+const int HOST_A = RBX;
+const int HOST_X = RBP;
+const int HOST_Y = R14;
+const int HOST_P = R15;
+const int HOST_REGS = R12; // &cpu->regs[0]
+const int HOST_CPU = R13;
+
+// stack slots of the block frame
+const uint8_t SLOT_EXTRA_CYCLES = 0;
+const uint8_t SLOT_PC_PTR = 8;
+const uint8_t FRAME_SIZE = 24; // keeps rsp 16 bytes aligned for the fallback calls
+
+// x86 condition codes
+enum {
+    CC_O = 0x0,
+    CC_B = 0x2,
+    CC_AE = 0x3,
+    CC_E = 0x4,
+    CC_NE = 0x5,
+};
+
+// 6502 Z and N flags of a value
+struct ZnTable {
+    uint8_t flags[256];
+    constexpr ZnTable() : flags() {
+        for (int val = 0; val < 256; val++) {
+            flags[val] = (val == 0 ? STATUS_ZERO : 0) | (val & STATUS_NEG);
+        }
+    }
+};
+const ZnTable ZN_TABLE;
+
+/*
+Minimal x86-64 encoder, only the forms needed by the block compiler
+8 bits operations work on the low byte of the registers
+*/
+class X64Emitter {
+public:
+    X64Emitter(uint8_t *buf) : m_buf(buf) {}
+
+    size_t size() const { return m_pos; }
+
+    void byte(uint8_t val) { m_buf[m_pos++] = val; }
+    void dword(uint32_t val) { memcpy(m_buf + m_pos, &val, 4); m_pos += 4; }
+    void qword(uint64_t val) { memcpy(m_buf + m_pos, &val, 8); m_pos += 8; }
+
+    // spl, bpl, sil and dil are only reachable with a REX prefix
+    static bool needs_rex8(int reg) { return reg >= RSP && reg <= RDI; }
+
+    void rex(bool wide, int reg, int index, int base, bool force) {
+        uint8_t prefix = 0x40 | (wide << 3) | ((reg & 8) >> 1) | ((index & 8) >> 2) | ((base & 8) >> 3);
+        if (prefix != 0x40 || force) {
+            byte(prefix);
+        }
+    }
+    void modrm(int mod, int reg, int rm) { byte((mod << 6) | ((reg & 7) << 3) | (rm & 7)); }
+    void sib(int index, int base) { byte(((index & 7) << 3) | (base & 7)); }
+
+    // op r/m8, r8 (add 00, or 08, adc 10, and 20, sub 28, xor 30, cmp 38, mov 88)
+    void alu8_rr(uint8_t op, int dst, int src) {
+        rex(false, src, 0, dst, needs_rex8(src) || needs_rex8(dst));
+        byte(op);
+        modrm(3, src, dst);
+    }
+    // op r/m8, imm8 (add 0, or 1, adc 2, and 4, sub 5, xor 6, cmp 7)
+    void alu8_ri(int digit, int dst, uint8_t imm) {
+        rex(false, 0, 0, dst, needs_rex8(dst));
+        byte(0x80);
+        modrm(3, digit, dst);
+        byte(imm);
+    }
+    // unary r/m8 (FE : inc 0, dec 1 / F6 : not 2) and shifts by one (D0 : rcl 2, rcr 3, shl 4, shr 5)
+    void unary8(uint8_t op, int digit, int dst) {
+        rex(false, 0, 0, dst, needs_rex8(dst));
+        byte(op);
+        modrm(3, digit, dst);
+    }
+    void shl8_ri(int dst, uint8_t imm) {
+        rex(false, 0, 0, dst, needs_rex8(dst));
+        byte(0xc0);
+        modrm(3, 4, dst);
+        byte(imm);
+    }
+    void test8_ri(int dst, uint8_t imm) {
+        rex(false, 0, 0, dst, needs_rex8(dst));
+        byte(0xf6);
+        modrm(3, 0, dst);
+        byte(imm);
+    }
+    void mov8_ri(int dst, uint8_t imm) {
+        rex(false, 0, 0, dst, needs_rex8(dst));
+        byte(0xc6);
+        modrm(3, 0, dst);
+        byte(imm);
+    }
+    void setcc(int cc, int dst) {
+        rex(false, 0, 0, dst, needs_rex8(dst));
+        byte(0x0f);
+        byte(0x90 + cc);
+        modrm(3, 0, dst);
+    }
+    // mov r8, [base + index] / mov [base + index], r8 / or r8, [base + index]
+    // base can not be rbp, r13 and index can not be rsp
+    void load8(int dst, int base, int index) { mem8(0x8a, dst, base, index); }
+    void store8(int base, int index, int src) { mem8(0x88, src, base, index); }
+    void or8_rm(int dst, int base, int index) { mem8(0x0a, dst, base, index); }
+
+    void mov32_rr(int dst, int src) {
+        rex(false, src, 0, dst, false);
+        byte(0x89);
+        modrm(3, src, dst);
+    }
+    void xor32_rr(int dst, int src) {
+        rex(false, src, 0, dst, false);
+        byte(0x31);
+        modrm(3, src, dst);
+    }
+    void movzx32_r8(int dst, int src) {
+        rex(false, dst, 0, src, needs_rex8(src));
+        byte(0x0f);
+        byte(0xb6);
+        modrm(3, dst, src);
+    }
+    void mov32_ri(int dst, uint32_t imm) {
+        rex(false, 0, 0, dst, false);
+        byte(0xb8 + (dst & 7));
+        dword(imm);
+    }
+    void add32_ri(int dst, uint32_t imm) {
+        rex(false, 0, 0, dst, false);
+        byte(0x81);
+        modrm(3, 0, dst);
+        dword(imm);
+    }
+    void shr32_ri(int dst, uint8_t imm) {
+        rex(false, 0, 0, dst, false);
+        byte(0xc1);
+        modrm(3, 5, dst);
+        byte(imm);
+    }
+    void bt32_ri(int dst, uint8_t bit) {
+        rex(false, 0, 0, dst, false);
+        byte(0x0f);
+        byte(0xba);
+        modrm(3, 4, dst);
+        byte(bit);
+    }
+    // lea r32, [base + disp32], base can not be rsp, r12
+    void lea32(int dst, int base, int32_t disp) {
+        rex(false, dst, 0, base, false);
+        byte(0x8d);
+        modrm(2, dst, base);
+        dword(static_cast<uint32_t>(disp));
+    }
+    void mov64_rr(int dst, int src) {
+        rex(true, src, 0, dst, false);
+        byte(0x89);
+        modrm(3, src, dst);
+    }
+    void mov64_ri(int dst, uint64_t imm) {
+        rex(true, 0, 0, dst, false);
+        byte(0xb8 + (dst & 7));
+        qword(imm);
+    }
+    // mov word [base], imm16, base can not be rsp, rbp, r12, r13
+    void store16_i(int base, uint16_t imm) {
+        byte(0x66);
+        rex(false, 0, 0, base, false);
+        byte(0xc7);
+        modrm(0, 0, base);
+        byte(imm & 0xff);
+        byte(imm >> 8);
+    }
+
+    // movzx r32, byte [r12 + disp8] / mov byte [r12 + disp8], r8
+    void load8_regs(int dst, uint8_t disp) {
+        rex(false, dst, 0, HOST_REGS, false);
+        byte(0x0f);
+        byte(0xb6);
+        modrm(1, dst, RSP);
+        sib(RSP, HOST_REGS);
+        byte(disp);
+    }
+    void store8_regs(uint8_t disp, int src) {
+        rex(false, src, 0, HOST_REGS, needs_rex8(src));
+        byte(0x88);
+        modrm(1, src, RSP);
+        sib(RSP, HOST_REGS);
+        byte(disp);
+    }
+
+    // stack slots [rsp + disp8]
+    void stack_op(bool wide, uint8_t op, int reg, uint8_t disp) {
+        rex(wide, reg, 0, RSP, false);
+        byte(op);
+        modrm(1, reg, RSP);
+        sib(RSP, RSP);
+        byte(disp);
+    }
+    void add32_stack_r(uint8_t disp, int src) { stack_op(false, 0x01, src, disp); }
+    void mov32_r_stack(int dst, uint8_t disp) { stack_op(false, 0x8b, dst, disp); }
+    void mov64_stack_r(uint8_t disp, int src) { stack_op(true, 0x89, src, disp); }
+    void mov64_r_stack(int dst, uint8_t disp) { stack_op(true, 0x8b, dst, disp); }
+    void mov32_stack_i(uint8_t disp, uint32_t imm) {
+        stack_op(false, 0xc7, 0, disp);
+        dword(imm);
+    }
+
+    void push(int reg) { rex(false, 0, 0, reg, false); byte(0x50 + (reg & 7)); }
+    void pop(int reg) { rex(false, 0, 0, reg, false); byte(0x58 + (reg & 7)); }
+    void sub_rsp(uint8_t imm) { byte(0x48); byte(0x83); byte(0xec); byte(imm); }
+    void add_rsp(uint8_t imm) { byte(0x48); byte(0x83); byte(0xc4); byte(imm); }
+    void call_r(int reg) {
+        rex(false, 0, 0, reg, false);
+        byte(0xff);
+        modrm(3, 2, reg);
+    }
+    void ret() { byte(0xc3); }
+
+    // forward conditional jump, returns the position to patch
+    size_t jcc32(int cc) {
+        byte(0x0f);
+        byte(0x80 + cc);
+        dword(0);
+        return m_pos - 4;
+    }
+    void patch32(size_t at) {
+        uint32_t rel = static_cast<uint32_t>(m_pos - (at + 4));
+        memcpy(m_buf + at, &rel, 4);
+    }
+
+private:
+    void mem8(uint8_t op, int reg, int base, int index) {
+        rex(false, reg, index, base, needs_rex8(reg));
+        byte(op);
+        modrm(0, reg, RSP);
+        sib(index, base);
+    }
+
+    uint8_t *m_buf;
+    size_t m_pos = 0;
+};
+
+// what the native code generator knows how to emit
+enum {
+    KIND_NONE, // interpreter fallback
+    KIND_LOAD,
+    KIND_STORE,
+    KIND_AND,
+    KIND_ORA,
+    KIND_EOR,
+    KIND_ADC,
+    KIND_SBC,
+    KIND_CMP,
+    KIND_INC_MEM,
+    KIND_DEC_MEM,
+    KIND_INC_REG,
+    KIND_DEC_REG,
+    KIND_TRANSFER,
+    KIND_CLEAR_FLAG,
+    KIND_SET_FLAG,
+    KIND_NOP,
+    KIND_LSR_ACC,
+    KIND_ASL_ACC,
+    KIND_ROR_ACC,
+    KIND_ROL_ACC,
+    KIND_BRANCH,
+    KIND_JMP,
+};
+
+struct NativeOp {
+    int kind = KIND_NONE;
+    int reg = 0; // host register operand (or destination of a transfer)
+    int src = 0; // source of a transfer
+    uint8_t flag = 0; // status bit of flag operations and branches
+};
+
+NativeOp native_op(uint8_t opcode) {
+    NativeOp op;
+    switch (opcode) {
+    case 0xa9: case 0xa5: case 0xb5: case 0xad: case 0xbd: case 0xb9:
+        op.kind = KIND_LOAD; op.reg = HOST_A; break;
+    case 0xa2: case 0xa6: case 0xb6: case 0xae: case 0xbe:
+        op.kind = KIND_LOAD; op.reg = HOST_X; break;
+    case 0xa0: case 0xa4: case 0xb4: case 0xac: case 0xbc:
+        op.kind = KIND_LOAD; op.reg = HOST_Y; break;
+    case 0x85: case 0x95: case 0x8d: case 0x9d: case 0x99:
+        op.kind = KIND_STORE; op.reg = HOST_A; break;
+    case 0x86: case 0x96: case 0x8e:
+        op.kind = KIND_STORE; op.reg = HOST_X; break;
+    case 0x84: case 0x94: case 0x8c:
+        op.kind = KIND_STORE; op.reg = HOST_Y; break;
+    case 0x29: case 0x25: case 0x35: case 0x2d: case 0x3d: case 0x39:
+        op.kind = KIND_AND; break;
+    case 0x09: case 0x05: case 0x15: case 0x0d: case 0x1d: case 0x19:
+        op.kind = KIND_ORA; break;
+    case 0x49: case 0x45: case 0x55: case 0x4d: case 0x5d: case 0x59:
+        op.kind = KIND_EOR; break;
+    case 0x69: case 0x65: case 0x75: case 0x6d: case 0x7d: case 0x79:
+        op.kind = KIND_ADC; break;
+    case 0xe9: case 0xe5: case 0xf5: case 0xed: case 0xfd: case 0xf9:
+        op.kind = KIND_SBC; break;
+    case 0xc9: case 0xc5: case 0xd5: case 0xcd: case 0xdd: case 0xd9:
+        op.kind = KIND_CMP; op.reg = HOST_A; break;
+    case 0xe0: case 0xe4: case 0xec:
+        op.kind = KIND_CMP; op.reg = HOST_X; break;
+    case 0xc0: case 0xc4: case 0xcc:
+        op.kind = KIND_CMP; op.reg = HOST_Y; break;
+    case 0xe6: case 0xf6: case 0xee: case 0xfe:
+        op.kind = KIND_INC_MEM; break;
+    case 0xc6: case 0xd6: case 0xce: case 0xde:
+        op.kind = KIND_DEC_MEM; break;
+    case 0xe8: op.kind = KIND_INC_REG; op.reg = HOST_X; break;
+    case 0xc8: op.kind = KIND_INC_REG; op.reg = HOST_Y; break;
+    case 0xca: op.kind = KIND_DEC_REG; op.reg = HOST_X; break;
+    case 0x88: op.kind = KIND_DEC_REG; op.reg = HOST_Y; break;
+    case 0xaa: op.kind = KIND_TRANSFER; op.src = HOST_A; op.reg = HOST_X; break;
+    case 0xa8: op.kind = KIND_TRANSFER; op.src = HOST_A; op.reg = HOST_Y; break;
+    case 0x8a: op.kind = KIND_TRANSFER; op.src = HOST_X; op.reg = HOST_A; break;
+    case 0x98: op.kind = KIND_TRANSFER; op.src = HOST_Y; op.reg = HOST_A; break;
+    case 0x18: op.kind = KIND_CLEAR_FLAG; op.flag = STATUS_CARRY; break;
+    case 0xd8: op.kind = KIND_CLEAR_FLAG; op.flag = STATUS_DEC; break;
+    case 0x58: op.kind = KIND_CLEAR_FLAG; op.flag = STATUS_INTER; break;
+    case 0xb8: op.kind = KIND_CLEAR_FLAG; op.flag = STATUS_OVFLO; break;
+    case 0x38: op.kind = KIND_SET_FLAG; op.flag = STATUS_CARRY; break;
+    case 0xf8: op.kind = KIND_SET_FLAG; op.flag = STATUS_DEC; break;
+    case 0x78: op.kind = KIND_SET_FLAG; op.flag = STATUS_INTER; break;
+    case 0xea: op.kind = KIND_NOP; break;
+    case 0x4a: op.kind = KIND_LSR_ACC; break;
+    case 0x0a: op.kind = KIND_ASL_ACC; break;
+    case 0x6a: op.kind = KIND_ROR_ACC; break;
+    case 0x2a: op.kind = KIND_ROL_ACC; break;
+    case 0x10: op.kind = KIND_BRANCH; op.flag = STATUS_NEG; break;
+    case 0x30: op.kind = KIND_BRANCH; op.flag = STATUS_NEG; break;
+    case 0x50: op.kind = KIND_BRANCH; op.flag = STATUS_OVFLO; break;
+    case 0x70: op.kind = KIND_BRANCH; op.flag = STATUS_OVFLO; break;
+    case 0x90: op.kind = KIND_BRANCH; op.flag = STATUS_CARRY; break;
+    case 0xb0: op.kind = KIND_BRANCH; op.flag = STATUS_CARRY; break;
+    case 0xd0: op.kind = KIND_BRANCH; op.flag = STATUS_ZERO; break;
+    case 0xf0: op.kind = KIND_BRANCH; op.flag = STATUS_ZERO; break;
+    case 0x4c: op.kind = KIND_JMP; break;
+    default:
+        break;
+    }
+    return op;
+}
+
+enum {
+    ACCESS_READ,
+    ACCESS_WRITE,
+    ACCESS_RMW,
+};
+
+/*
+Translates one block, instruction after instruction
+Memory operands are resolved into rdx (host base pointer) + rcx (index)
+*/
+class BlockCompiler {
+public:
+    BlockCompiler(uint8_t *buf, const Memory *mem) : m_emit(buf), m_mem(mem) {}
+
+    size_t size() const { return m_emit.size(); }
+
+    void prologue() {
+        m_emit.push(RBX);
+        m_emit.push(RBP);
+        m_emit.push(R12);
+        m_emit.push(R13);
+        m_emit.push(R14);
+        m_emit.push(R15);
+        m_emit.sub_rsp(FRAME_SIZE);
+        m_emit.mov64_rr(HOST_CPU, RDI);
+        m_emit.mov64_rr(HOST_REGS, RSI);
+        m_emit.mov64_stack_r(SLOT_PC_PTR, RDX);
+        m_emit.mov32_stack_i(SLOT_EXTRA_CYCLES, 0);
+        reload();
+    }
+
+    // leaves the block, pc < 0 means it has already been set by a fallback
+    void exit(int32_t pc, uint32_t ncycle) {
+        spill();
+        if (pc >= 0) {
+            m_emit.mov64_r_stack(RDX, SLOT_PC_PTR);
+            m_emit.store16_i(RDX, static_cast<uint16_t>(pc));
+        }
+        m_emit.mov32_r_stack(RAX, SLOT_EXTRA_CYCLES);
+        m_emit.add32_ri(RAX, ncycle);
+        m_emit.add_rsp(FRAME_SIZE);
+        m_emit.pop(R15);
+        m_emit.pop(R14);
+        m_emit.pop(R13);
+        m_emit.pop(R12);
+        m_emit.pop(RBP);
+        m_emit.pop(RBX);
+        m_emit.ret();
+    }
+
+    void fallback(const void *inst, uint16_t pc, const void *func) {
+        spill();
+        m_emit.mov64_rr(RDI, HOST_CPU);
+        m_emit.mov64_ri(RSI, reinterpret_cast<uint64_t>(inst));
+        m_emit.mov32_ri(RDX, pc);
+        m_emit.mov64_ri(RAX, reinterpret_cast<uint64_t>(func));
+        m_emit.call_r(RAX);
+        // extra cycles reported by the handler
+        m_emit.add32_stack_r(SLOT_EXTRA_CYCLES, RAX);
+        reload();
+    }
+
+    /*
+    Emits op natively, returns false (without emitting anything) when it
+    has to go through the interpreter
+    */
+    bool native(const NativeOp& op, int mode, bool page_penalty, uint16_t operand) {
+        switch (op.kind) {
+        case KIND_LOAD:
+            if (!operand_value(mode, page_penalty, operand)) return false;
+            m_emit.movzx32_r8(op.reg, RCX);
+            update_zn(op.reg);
+            return true;
+        case KIND_STORE:
+            if (!operand_addr(mode, ACCESS_WRITE, page_penalty, operand)) return false;
+            m_emit.store8(RDX, RCX, op.reg);
+            return true;
+        case KIND_AND:
+        case KIND_ORA:
+        case KIND_EOR:
+            if (!operand_value(mode, page_penalty, operand)) return false;
+            m_emit.alu8_rr(op.kind == KIND_AND ? 0x20 : op.kind == KIND_ORA ? 0x08 : 0x30, HOST_A, RCX);
+            update_zn(HOST_A);
+            return true;
+        case KIND_ADC:
+        case KIND_SBC:
+            if (!operand_value(mode, page_penalty, operand)) return false;
+            if (op.kind == KIND_SBC) {
+                // same as the interpreter, add the one's complement
+                m_emit.unary8(0xf6, 2, RCX);
+            }
+            // x86 adc has the 6502 carry and overflow semantic
+            m_emit.bt32_ri(HOST_P, 0);
+            m_emit.alu8_rr(0x10, HOST_A, RCX);
+            m_emit.setcc(CC_B, R8);
+            m_emit.setcc(CC_O, R9);
+            m_emit.shl8_ri(R9, 6);
+            m_emit.alu8_ri(4, HOST_P, static_cast<uint8_t>(~(STATUS_CARRY | STATUS_OVFLO)));
+            m_emit.alu8_rr(0x08, HOST_P, R8);
+            m_emit.alu8_rr(0x08, HOST_P, R9);
+            update_zn(HOST_A);
+            return true;
+        case KIND_CMP:
+            if (!operand_value(mode, page_penalty, operand)) return false;
+            m_emit.alu8_rr(0x88, RAX, op.reg);
+            m_emit.alu8_rr(0x28, RAX, RCX);
+            // no borrow means reg >= val
+            m_emit.setcc(CC_AE, R8);
+            update_zn(RAX);
+            update_carry();
+            return true;
+        case KIND_INC_MEM:
+        case KIND_DEC_MEM:
+            if (!operand_addr(mode, ACCESS_RMW, page_penalty, operand)) return false;
+            m_emit.load8(RAX, RDX, RCX);
+            m_emit.unary8(0xfe, op.kind == KIND_INC_MEM ? 0 : 1, RAX);
+            m_emit.store8(RDX, RCX, RAX);
+            update_zn(RAX);
+            return true;
+        case KIND_INC_REG:
+        case KIND_DEC_REG:
+            m_emit.unary8(0xfe, op.kind == KIND_INC_REG ? 0 : 1, op.reg);
+            update_zn(op.reg);
+            return true;
+        case KIND_TRANSFER:
+            m_emit.mov32_rr(op.reg, op.src);
+            update_zn(op.reg);
+            return true;
+        case KIND_CLEAR_FLAG:
+            m_emit.alu8_ri(4, HOST_P, static_cast<uint8_t>(~op.flag));
+            return true;
+        case KIND_SET_FLAG:
+            m_emit.alu8_ri(1, HOST_P, op.flag);
+            return true;
+        case KIND_NOP:
+            return true;
+        case KIND_LSR_ACC:
+        case KIND_ASL_ACC:
+        case KIND_ROR_ACC:
+        case KIND_ROL_ACC:
+            if (op.kind == KIND_ROR_ACC || op.kind == KIND_ROL_ACC) {
+                // rotate through the guest carry
+                m_emit.bt32_ri(HOST_P, 0);
+            }
+            m_emit.unary8(0xd0, op.kind == KIND_LSR_ACC ? 5 : op.kind == KIND_ASL_ACC ? 4 : op.kind == KIND_ROR_ACC ? 3 : 2, HOST_A);
+            m_emit.setcc(CC_B, R8);
+            update_zn(HOST_A);
+            update_carry();
+            return true;
+        default:
+            return false;
+        }
+    }
+
+    // conditional branch ending the block, both exits are static
+    void branch(const NativeOp& op, uint8_t opcode, uint16_t pc, uint8_t offset, uint32_t ncycle) {
+        // bit 5 of the opcode tells if the branch is taken on a set flag
+        bool taken_if_set = (opcode & 0x20) != 0;
+        uint16_t dest = pc + static_cast<int8_t>(offset);
+        uint32_t extra_cycles = ((dest >> 8) == (pc >> 8)) ? 1 : 2;
+        m_emit.test8_ri(HOST_P, op.flag);
+        size_t not_taken = m_emit.jcc32(taken_if_set ? CC_E : CC_NE);
+        exit(static_cast<uint16_t>(dest + 2), ncycle + extra_cycles);
+        m_emit.patch32(not_taken);
+        exit(static_cast<uint16_t>(pc + 2), ncycle);
+    }
+
+private:
+    void spill() {
+        m_emit.store8_regs(REG_A, HOST_A);
+        m_emit.store8_regs(REG_X, HOST_X);
+        m_emit.store8_regs(REG_Y, HOST_Y);
+        m_emit.store8_regs(REG_S, HOST_P);
+    }
+
+    void reload() {
+        m_emit.load8_regs(HOST_A, REG_A);
+        m_emit.load8_regs(HOST_X, REG_X);
+        m_emit.load8_regs(HOST_Y, REG_Y);
+        m_emit.load8_regs(HOST_P, REG_S);
+    }
+
+    void update_zn(int reg) {
+        m_emit.movzx32_r8(RAX, reg);
+        m_emit.mov64_ri(RDX, reinterpret_cast<uint64_t>(ZN_TABLE.flags));
+        m_emit.alu8_ri(4, HOST_P, static_cast<uint8_t>(~(STATUS_ZERO | STATUS_NEG)));
+        m_emit.or8_rm(HOST_P, RDX, RAX);
+    }
+
+    // carry taken from r8b
+    void update_carry() {
+        m_emit.alu8_ri(4, HOST_P, static_cast<uint8_t>(~STATUS_CARRY));
+        m_emit.alu8_rr(0x08, HOST_P, R8);
+    }
+
+    // host memory of the page holding addr, nullptr if it is not plain memory
+    uint8_t * page_ptr(uint16_t addr, int access) {
+        const MemoryPage& page = m_mem->get_page(addr);
+        if (access == ACCESS_READ) {
+            return const_cast<uint8_t *>(page.read);
+        }
+        if (access == ACCESS_RMW && page.read != page.write) {
+            return nullptr;
+        }
+        return page.write;
+    }
+
+    bool operand_addr(int mode, int access, bool page_penalty, uint16_t operand) {
+        uint8_t low = operand & 0xff;
+        uint8_t *base;
+        int index = (mode == ZEROPAGE_Y || mode == ABSOLUTE_Y) ? HOST_Y : HOST_X;
+        switch (mode) {
+        case ZEROPAGE:
+        case ABSOLUTE:
+            base = page_ptr(operand, access);
+            if (base == nullptr) return false;
+            m_emit.mov64_ri(RDX, reinterpret_cast<uint64_t>(base + low));
+            m_emit.xor32_rr(RCX, RCX);
+            return true;
+        case ZEROPAGE_X:
+        case ZEROPAGE_Y:
+            base = page_ptr(0, access);
+            if (base == nullptr) return false;
+            m_emit.mov64_ri(RDX, reinterpret_cast<uint64_t>(base));
+            m_emit.mov32_rr(RCX, index);
+            // wraps within the zero page
+            m_emit.alu8_ri(0, RCX, low);
+            m_emit.movzx32_r8(RCX, RCX);
+            return true;
+        case ABSOLUTE_X:
+        case ABSOLUTE_Y:
+            base = page_ptr(operand, access);
+            if (base == nullptr) return false;
+            // the index may reach the next page, it has to follow in host memory
+            if (low != 0 && page_ptr(operand + 0x100, access) != base + 0x100) return false;
+            m_emit.mov64_ri(RDX, reinterpret_cast<uint64_t>(base + low));
+            m_emit.mov32_rr(RCX, index);
+            if (page_penalty && low != 0) {
+                // (low + index) >> 8 is 1 on page crossing
+                m_emit.lea32(RAX, RCX, low);
+                m_emit.shr32_ri(RAX, 8);
+                m_emit.add32_stack_r(SLOT_EXTRA_CYCLES, RAX);
+            }
+            return true;
+        default:
+            return false;
+        }
+    }
+
+    // operand value in cl
+    bool operand_value(int mode, bool page_penalty, uint16_t operand) {
+        if (mode == IMMEDIATE) {
+            m_emit.mov8_ri(RCX, operand & 0xff);
+            return true;
+        }
+        if (!operand_addr(mode, ACCESS_READ, page_penalty, operand)) {
+            return false;
+        }
+        m_emit.load8(RCX, RDX, RCX);
+        return true;
+    }
+
+    X64Emitter m_emit;
+    const Memory *m_mem;
+};
+
+} // namespace
+
+Jit6502::Jit6502(Emu6502 *cpu) : m_cpu(cpu) {
+    // never writable and executable at once, see set_writable
+    void *arena = mmap(nullptr, ARENA_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (arena == MAP_FAILED) {
+        throw std::runtime_error("Unable to map the JIT arena");
+    }
+    m_arena = static_cast<uint8_t *>(arena);
+}
+
+Jit6502::~Jit6502() {
+    munmap(m_arena, ARENA_SIZE);
+}
+
+bool Jit6502::is_supported() {
+    return true;
+}
+
+void Jit6502::flush() {
+    m_blocks.clear();
+    m_arena_used = 0;
+}
+
+void Jit6502::set_writable(size_t begin, size_t end, bool writable) {
+    // whole pages, the first one may hold the end of the previous block
+    size_t page_size = sysconf(_SC_PAGESIZE);
+    begin -= begin % page_size;
+    end = std::min((end + page_size - 1) / page_size * page_size, ARENA_SIZE);
+    int prot = writable ? PROT_READ | PROT_WRITE : PROT_READ | PROT_EXEC;
+    if (mprotect(m_arena + begin, end - begin, prot) != 0) {
+        throw std::runtime_error("Unable to change the protection of the JIT arena");
+    }
+}
+
+int Jit6502::exec_fallback(Emu6502 *cpu, const Emu6502::DecodedInst *inst, uint32_t pc) {
+    // same as one step of Emu6502::interpret_block
+    cpu->prgm_ctr = pc;
+    cpu->op_operand = inst->operand;
+    cpu->op_extra_cycles = 0;
+    (cpu->*inst->func)();
+    cpu->prgm_ctr += inst->nbytes;
+    return cpu->op_extra_cycles;
+}
+
+void Jit6502::compile(uint16_t addr, const std::vector<Emu6502::DecodedInst>& insts, CompiledBlock *block) {
+    // nothing runs from the arena while a block is emitted and its jumps patched
+    set_writable(m_arena_used, m_arena_used + INST_MAX_CODE * Emu6502::BLOCK_MAX_LENGTH + BLOCK_EXTRA_CODE, true);
+    BlockCompiler compiler(m_arena + m_arena_used, m_cpu->mem);
+    compiler.prologue();
+
+    // cycles known at compile time, the dynamic extra cycles are summed by the host code
+    uint32_t ncycle = 0;
+    int max_ncycle = 0;
+    for (const Emu6502::DecodedInst& inst : insts) {
+        ncycle += inst.base_ncycle;
+        max_ncycle += inst.base_ncycle;
+        if (inst.extra_cycle_type == YESEC) {
+            max_ncycle += 1;
+        } else if (inst.extra_cycle_type == BRANCHEC) {
+            max_ncycle += 2;
+        }
+    }
+
+    uint16_t pc = addr;
+    bool pc_set = false;
+    for (size_t i = 0; i < insts.size(); i++) {
+        const Emu6502::DecodedInst& inst = insts[i];
+        uint8_t opcode = m_cpu->mem->get(pc);
+        NativeOp op = native_op(opcode);
+        if (op.kind == KIND_BRANCH) {
+            // control flow is always the last instruction of the block
+            compiler.branch(op, opcode, pc, low_byte(inst.operand), ncycle);
+            pc_set = true;
+            break;
+        }
+        if (op.kind == KIND_JMP) {
+            compiler.exit(inst.operand, ncycle);
+            pc_set = true;
+            break;
+        }
+        if (!compiler.native(op, inst.addr_mode, inst.extra_cycle_type == YESEC, inst.operand)) {
+            compiler.fallback(&insts[i], pc, reinterpret_cast<const void *>(&Jit6502::exec_fallback));
+        }
+        if (Emu6502::is_control_flow(inst.nbytes, inst.extra_cycle_type)) {
+            // the handler set the PC
+            compiler.exit(-1, ncycle);
+            pc_set = true;
+            break;
+        }
+        pc += inst.nbytes;
+    }
+    if (!pc_set) {
+        compiler.exit(pc, ncycle);
+    }
+
+    set_writable(m_arena_used, m_arena_used + compiler.size(), false);
+    block->func = reinterpret_cast<BlockFunc>(m_arena + m_arena_used);
+    block->max_ncycle = max_ncycle;
+    m_arena_used += compiler.size();
+}
+
+const Jit6502::CompiledBlock * Jit6502::get_block(uint16_t addr) {
+    auto it = m_blocks.find(addr);
+    if (it != m_blocks.end()) {
+        return &it->second;
+    }
+    const Emu6502::Block *source = m_cpu->get_block(addr);
+    if (source == nullptr) {
+        // not in rom
+        return nullptr;
+    }
+    if (m_arena_used + INST_MAX_CODE * Emu6502::BLOCK_MAX_LENGTH + BLOCK_EXTRA_CODE > ARENA_SIZE) {
+        flush();
+    }
+    CompiledBlock& block = m_blocks[addr];
+    // the host code points into this copy, it must not move afterwards
+    block.insts = source->insts;
+    if (!block.insts.empty()) {
+        compile(addr, block.insts, &block);
+    }
+    return &block;
+}
+
+int Jit6502::run_block(int max_cycles) {
+    if (m_cpu->m_debug || m_cpu->interrupt_type != INTERRUPT_NO) {
+        return m_cpu->exec_inst();
+    }
+    const CompiledBlock *block = get_block(m_cpu->prgm_ctr);
+    if (block == nullptr || block->func == nullptr || block->max_ncycle > max_cycles) {
+        return m_cpu->interpret_block(max_cycles);
+    }
+    // compiled blocks always run to their end
+    m_cpu->instruction_count += block->insts.size();
+    return block->func(m_cpu, m_cpu->regs, &m_cpu->prgm_ctr);
+}
+
+#else
+
+Jit6502::Jit6502(Emu6502 *cpu) : m_cpu(cpu) {
+    throw std::runtime_error("JIT not supported on this host");
+}
+
+Jit6502::~Jit6502() {
+}
+
+bool Jit6502::is_supported() {
+    return false;
+}
+
+void Jit6502::flush() {
+}
+
+int Jit6502::run_block(int max_cycles) {
+    return m_cpu->interpret_block(max_cycles);
+}
+
+#endif
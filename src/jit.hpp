@@ -0,0 +1,64 @@
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+#include <vector>
+#include <unordered_map>
+
+#include "cpu.hpp"
+
+/*
+x86-64 dynamic recompiler for the blocks of Emu6502
+
+Each block found by the interpreter (see Emu6502::get_block) is translated
+once into host machine code in an arena, whose pages are made executable once
+written and are never writable and executable at the same time. Within a
+block the guest A, X, Y and P registers live in host registers, plain ram/rom
+accesses are resolved at compile time into host pointers and the most common
+instructions are emitted natively. The other instructions call back the
+interpreter handler. The cycles are summed at the block exit so that the
+caller can bring the PPU and APU up to date.
+
+Only built on x86-64 unix hosts, is_supported() is false elsewhere.
+*/
+class Jit6502 {
+public:
+    Jit6502(Emu6502 *cpu);
+    ~Jit6502();
+
+    static bool is_supported();
+
+    /**
+     * Same contract as Emu6502::run_block : a compiled block only runs if its
+     * worst case cycle count fits in max_cycles, otherwise the interpreter
+     * takes over, so that both modes stop at the same instruction boundary
+     */
+    int run_block(int max_cycles);
+
+    // Drop all the compiled blocks (e.g. on bank switch)
+    void flush();
+
+private:
+    // returns the cycles spent, writes the guest PC back in *pc
+    typedef int (*BlockFunc)(Emu6502 *cpu, uint8_t *regs, uint16_t *pc);
+
+    struct CompiledBlock {
+        BlockFunc func = nullptr; // nullptr : nothing to compile, always interpreted
+        int max_ncycle = 0; // worst case cycle count
+        // instructions run by the interpreter handlers, referenced from the host code
+        std::vector<Emu6502::DecodedInst> insts;
+    };
+
+    const CompiledBlock * get_block(uint16_t addr);
+    void compile(uint16_t addr, const std::vector<Emu6502::DecodedInst>& insts, CompiledBlock *block);
+    // pages of the arena between the offsets made read/write, or read/execute
+    void set_writable(size_t begin, size_t end, bool writable);
+
+    // called from the host code for the instructions that are not emitted natively
+    static int exec_fallback(Emu6502 *cpu, const Emu6502::DecodedInst *inst, uint32_t pc);
+
+    Emu6502 *m_cpu;
+    uint8_t *m_arena = nullptr;
+    size_t m_arena_used = 0;
+    std::unordered_map<uint16_t, CompiledBlock> m_blocks;
+};
@@ -1,14 +1,23 @@
 #include <iostream>
 #include <chrono>
+#include <string>
+#include <memory>
+
+#include <vector>
+#include <cstring>
+#include <fstream>
+#include <sstream>
+#include <iomanip>
 
 #include "lstdebugger.hpp"
-#include "cpu.hpp"
 #include "utils.hpp"
-#include "device.hpp"
-#include "ppu.hpp"
-#include "apu.hpp"
+#include "nes.hpp"
+#include "audio.hpp"
+#include "ppukernels.hpp"
+#include "triplebuffer.hpp"
+#include "frametimes.hpp"
+#include "pacer.hpp"
 
-#include <opencv2/opencv.hpp>
 #include <SDL.h>
 
 #include <iostream>
@@ -20,13 +29,29 @@
 #define DEBUG_WINDOW false
 #define LOG_DEBUG false
 
-typedef std::chrono::high_resolution_clock Clock;
+// longest wait of the ui for a frame, so that events are still handled when the emulation is paused
+static int const FRAME_WAIT_MS = 20;
+
+// cpu cycles between two state comparisons of --check
+static uint64_t const CHECK_NCYCLE = 29780;
 
-static int const NSTEPS_PAUSE = 10000;
-static long const TIME_BETWEEN_PAUSE_US = (double)NSTEPS_PAUSE * 1000000.0f /(double)CLOCK_FREQUENCY * 2;
+// height of the bars of the timing overlay for a frame taking its whole period
+static int const OVERLAY_PERIOD_HEIGHT = 48;
+// frames between two updates of the timing stats in the window title
+static int const OVERLAY_STATS_NFRAME = 30;
+
+typedef std::chrono::high_resolution_clock Clock;
+typedef std::chrono::steady_clock SteadyClock;
 
 std::map<char,uint8_t> CONTROLLER_MAPPING = {{'p', 0}, {'o', 1}, {'b', 2}, {'n', 3}, {'z', 4}, {'s', 5}, {'q', 6}, {'d', 7}}; // A, B, Select, Start, Up, Down, Left, Right
 
+// buttons of the --input scripts, same bits as CONTROLLER_MAPPING
+std::map<std::string,uint8_t> BUTTON_NAMES = {{"A", 0}, {"B", 1}, {"Select", 2}, {"Start", 3}, {"Up", 4}, {"Down", 5}, {"Left", 6}, {"Right", 7}};
+
+// where the rom and its listing (for the debugger) are taken from when no ROM is given
+static const std::string DEFAULT_ROM = "/home/titus/dev/nesquick/rom/smb1/bin/smb1.nes";
+static const std::string DEFAULT_LST = "/home/titus/dev/nesquick/rom/smb1/bin/smb1.lst";
+
 void turn_bit_off(uint8_t * value, uint8_t bit) {
     *value &= ~(1 << bit);
 }
@@ -36,7 +61,189 @@ void turn_bit_on(uint8_t * value, uint8_t bit) {
 }
 
 
-void ui(Emu6502 * cpu, PpuDevice * ppu, ApuDevice * apu) {
+/*
+Sinks of the headless mode : the video one prints the CRC of each frame (of
+its color indices), the audio one chains all the samples synthesized from
+the APU (see SampleStream) into a single CRC
+*/
+class CrcVideo : public VideoSink {
+public:
+    void present_frame() {
+        std::cout << "frame " << m_frame_no << " " << std::hex << std::setw(8) << std::setfill('0')
+            << crc32(m_frame, sizeof(m_frame)) << std::dec << "\n";
+        m_frame_no++;
+    }
+
+private:
+    long m_frame_no = 0;
+};
+
+class CrcAudio : public SampleStream {
+public:
+    // the samples rendered up to cycle are taken out of the ring into the CRC
+    void set_cycle(uint64_t cycle) override {
+        SampleStream::set_cycle(cycle);
+        int16_t samples[SAMPLE_RING_CAPACITY];
+        size_t nsamples = get_ring()->pop(samples, SAMPLE_RING_CAPACITY);
+        m_crc = crc32(reinterpret_cast<uint8_t *>(samples), nsamples * sizeof(int16_t), m_crc);
+    }
+    uint32_t get_crc() { return m_crc; }
+
+private:
+    uint32_t m_crc = 0;
+};
+
+/**
+ * Reads a controller script of the headless mode, one line per change of the
+ * buttons : "<frame> <buttons>", the buttons (see BUTTON_NAMES) joined by '+'
+ * or '-' for none, held from the start of that frame on
+ * Empty lines and the ones starting with # are skipped
+ * Returns the controller state by frame
+ */
+std::map<long, uint8_t> parse_input_script(const std::string& filename) {
+    std::ifstream file(filename);
+    if (!file) {
+        throw std::runtime_error("Unable to open file");
+    }
+    std::map<long, uint8_t> input;
+    std::string line;
+    while (std::getline(file, line)) {
+        if (line.empty() || line[0] == '#') {
+            continue;
+        }
+        std::istringstream fields(line);
+        long frame;
+        std::string buttons;
+        if (!(fields >> frame >> buttons)) {
+            throw std::runtime_error("Bad input script line : " + line);
+        }
+        uint8_t state = 0;
+        if (buttons != "-") {
+            std::istringstream names(buttons);
+            std::string name;
+            while (std::getline(names, name, '+')) {
+                auto button = BUTTON_NAMES.find(name);
+                if (button == BUTTON_NAMES.end()) {
+                    throw std::runtime_error("Unknown button " + name);
+                }
+                turn_bit_on(&state, button->second);
+            }
+        }
+        input[frame] = state;
+    }
+    return input;
+}
+
+/**
+ * Runs nframes frames as fast as possible, without ui nor sound, the
+ * controller following input (see parse_input_script)
+ * Prints the CRC of each frame then the one of the audio samples
+ */
+void headless(Nes * nes, long nframes, const std::map<long, uint8_t>& input) {
+    std::unique_ptr<CrcVideo> video(new CrcVideo());
+    CrcAudio audio;
+    nes->ppu.set_video_sink(video.get());
+    nes->apu.set_audio_sink(&audio);
+
+    auto start = Clock::now();
+    for (long frame = 0; frame < nframes; frame++) {
+        auto state = input.find(frame);
+        if (state != input.end()) {
+            nes->ppu.set_kb_state(state->second);
+        }
+        nes->scheduler.run_frame();
+    }
+    // the samples after the last change of the APU
+    audio.set_cycle(nes->scheduler.get_cycle());
+    double elapsed = std::chrono::duration<double>(Clock::now() - start).count();
+
+    std::cout << "audio " << std::hex << std::setw(8) << std::setfill('0') << audio.get_crc() << std::dec << std::endl;
+    std::cerr << nframes << " frames in " << elapsed << " s, " << nframes / elapsed << " fps" << std::endl;
+}
+
+/**
+ * Runs the same rom with the single cycle lockstep loop (interpreter) and with
+ * the scheduler (with the JIT if use_jit) and compares the cpu state hashes
+ * every CHECK_NCYCLE cycles
+ * Returns false on the first mismatch
+ */
+bool check(uint8_t *prg, uint8_t *chr, uint16_t rom_base_addr, long nframes, bool use_jit) {
+    std::unique_ptr<Nes> reference_nes(new Nes(prg, chr, rom_base_addr, nullptr));
+    std::unique_ptr<Nes> scheduled_nes(new Nes(prg, chr, rom_base_addr, nullptr));
+    Nes& reference = *reference_nes;
+    Nes& scheduled = *scheduled_nes;
+    if (use_jit && !scheduled.cpu.set_jit(true)) {
+        std::cerr << "JIT not supported on this host" << std::endl;
+        return false;
+    }
+    for (long frame = 1; frame <= nframes; frame++) {
+        reference.scheduler.run_lockstep_until(frame * CHECK_NCYCLE);
+        scheduled.scheduler.run_until(frame * CHECK_NCYCLE);
+        uint64_t hash_reference = reference.cpu.state_hash();
+        uint64_t hash_scheduled = scheduled.cpu.state_hash();
+        if (hash_reference != hash_scheduled) {
+            std::cout << "frame " << frame << " mismatch : lockstep " << std::hex << hash_reference
+                << " scheduled " << hash_scheduled << std::dec << std::endl;
+            return false;
+        }
+    }
+    std::cout << nframes << " frames identical" << std::endl;
+    return true;
+}
+
+static float to_us(std::chrono::nanoseconds duration) {
+    return duration.count() / 1000.0f;
+}
+
+/**
+ * Timing overlay : one column per frame at the bottom of the screen, the
+ * last ones on the right, the cpu (blue), ppu (green), apu (yellow) and
+ * present (magenta) times stacked, on red when the frame overran
+ * The dotted line is the frame period
+ */
+static void draw_timing_overlay(uint8_t * texture_rows, int pitch, const std::vector<FrameTime>& times) {
+    static const uint8_t COLORS[5][3] = {{60, 60, 255}, {60, 220, 60}, {240, 220, 40}, {230, 60, 230}, {200, 0, 0}};
+    size_t first = times.size() > FRAME_WIDTH ? times.size() - FRAME_WIDTH : 0;
+    auto put = [texture_rows, pitch](int x, int y, const uint8_t color[3]) {
+        if (y >= 0) {
+            memcpy(texture_rows + y * pitch + 3 * x, color, 3);
+        }
+    };
+    float us_per_px = FRAME_PERIOD_NS / 1000.0f / OVERLAY_PERIOD_HEIGHT;
+    for (size_t i = first; i < times.size(); i++) {
+        const FrameTime& time = times[i];
+        int x = FRAME_WIDTH - (times.size() - i);
+        int y = FRAME_HEIGHT - 1;
+        if (time.overrun) {
+            for (int k = 0; k < OVERLAY_PERIOD_HEIGHT; k++) {
+                put(x, y - k, COLORS[4]);
+            }
+        }
+        const float parts_us[4] = {time.cpu_us, time.ppu_us, time.apu_us, time.present_us};
+        float top_us = 0;
+        for (int part = 0; part < 4; part++) {
+            int bottom = y - static_cast<int>(top_us / us_per_px);
+            top_us += parts_us[part];
+            for (int k = bottom; k > y - static_cast<int>(top_us / us_per_px); k--) {
+                put(x, k, COLORS[part]);
+            }
+        }
+    }
+    static const uint8_t WHITE[3] = {255, 255, 255};
+    for (int x = 0; x < FRAME_WIDTH; x += 2) {
+        put(x, FRAME_HEIGHT - 1 - OVERLAY_PERIOD_HEIGHT, WHITE);
+    }
+}
+
+// p50 / p95 / p99 / max frame times in ms and the overruns
+static std::string format_stats(const FrameStats& stats) {
+    std::ostringstream text;
+    text << std::fixed << std::setprecision(2) << "frame p50 " << stats.p50_us / 1000 << " p95 " << stats.p95_us / 1000
+        << " p99 " << stats.p99_us / 1000 << " max " << stats.max_us / 1000 << " ms, " << stats.overruns << " overruns";
+    return text.str();
+}
+
+void ui(Emu6502 * cpu, PpuDevice * ppu, SoundEngine * sound, TripleBuffer * video, FrameTimes * times) {
     
     // init SDL
     struct sigaction action;
@@ -49,7 +256,7 @@ void ui(Emu6502 * cpu, PpuDevice * ppu, ApuDevice * apu) {
     sigaction(SIGINT, &action, NULL);
 
 
-    apu->start_sound();
+    sound->startSound();
 
 
     if(!SDL_SetHint(SDL_HINT_VIDEO_X11_NET_WM_BYPASS_COMPOSITOR, "0"))
@@ -88,10 +295,14 @@ void ui(Emu6502 * cpu, PpuDevice * ppu, ApuDevice * apu) {
         return;
     }
 
-    cv::Mat * frame = ppu->getFrame();
-    cv::Mat dbg_frame(64*8, 64*8, CV_8UC3);
+    // 4 nametables of 256x240
+    std::vector<uint8_t> dbg_frame(64*8 * 60*8);
+    RgbKernel to_rgb = select_pixel_kernels().to_rgb;
     
     bool thread_done = false;
+    // toggled with t
+    bool show_timing = false;
+    long nshown = 0;
 
     uint8_t kb_state = 0;
 
@@ -111,6 +322,12 @@ void ui(Emu6502 * cpu, PpuDevice * ppu, ApuDevice * apu) {
                     if (e.key.keysym.sym == 'g') {
                         cpu->setDebug(true);
                     }
+                    if (e.key.keysym.sym == 't' && e.type == SDL_KEYDOWN) {
+                        show_timing = !show_timing;
+                        if (!show_timing) {
+                            SDL_SetWindowTitle(window, "Display Image");
+                        }
+                    }
                     continue;
                 }
                 if (e.type == SDL_KEYDOWN) {
@@ -122,25 +339,45 @@ void ui(Emu6502 * cpu, PpuDevice * ppu, ApuDevice * apu) {
         }
 
         ppu->set_kb_state(kb_state);
-
+        // paced by the emulation : wakes up when a frame is finished
+        const uint8_t * frame = video->acquire_frame(FRAME_WAIT_MS);
+        if (frame == nullptr) {
+            continue;
+        }
+        auto present_start = SteadyClock::now();
+
+        // converted to RGB straight into the texture
+        void * pixels;
+        int pitch;
+        if (SDL_LockTexture(texture, nullptr, &pixels, &pitch) != 0) {
+            std::cerr << "SDL_LockTexture Error: " << SDL_GetError() << std::endl;
+            break;
+        }
+        uint8_t * texture_rows = static_cast<uint8_t *>(pixels);
         if (DEBUG_WINDOW) {
-          ppu->dbg_render_fullnametable(&dbg_frame);
-
-          // Define the ROI in the larger frame where the smaller frame will be placed
-          cv::Rect roi(0, 240, 256, 240);
-
-          // Copy the smaller frame into the ROI of the larger frame
-          frame->copyTo(dbg_frame(roi));
-
-          SDL_UpdateTexture(texture, nullptr, dbg_frame.data, dbg_frame.step1());
-        } else {
-          SDL_UpdateTexture(texture, nullptr, frame->data, frame->step1());
+          ppu->dbg_render_fullnametable(dbg_frame.data());
+          for (int y = 0; y < 60*8; y++) {
+              to_rgb(texture_rows + y * pitch, &dbg_frame[y * 64*8], 64*8);
+          }
+          // the frame at (0, 240) in the larger frame
+          texture_rows += 240 * pitch;
+        }
+        for (int y = 0; y < FRAME_HEIGHT; y++) {
+            to_rgb(texture_rows + y * pitch, frame + y * FRAME_WIDTH, FRAME_WIDTH);
         }
+        if (show_timing) {
+            draw_timing_overlay(texture_rows, pitch, times->snapshot());
+            if (nshown % OVERLAY_STATS_NFRAME == 0) {
+                SDL_SetWindowTitle(window, format_stats(times->get_stats()).c_str());
+            }
+        }
+        SDL_UnlockTexture(texture);
 
         SDL_RenderClear(renderer);
         SDL_RenderCopy(renderer, texture, nullptr, nullptr);
         SDL_RenderPresent(renderer);
-        SDL_Delay(10);
+        times->set_present_us(to_us(SteadyClock::now() - present_start));
+        nshown++;
     }
 
     SDL_DestroyTexture(texture);
@@ -149,50 +386,89 @@ void ui(Emu6502 * cpu, PpuDevice * ppu, ApuDevice * apu) {
     SDL_Quit();
 }
 
-void run(Emu6502 * cpu, PpuDevice * ppu, ApuDevice * apu, bool * thread_done) {
-    unsigned long long loopCount = 0;
-    auto last_t = Clock::now();
-    float load_sum = 0.0f;
-    int load_num = 0;
+/**
+ * Emulation thread : runs the console from vblank to vblank, paced by pacer
+ * when each frame is presented, before the NMI handler reads the controller,
+ * and records the host time of each frame in times
+ */
+void run(Nes * nes, Pacer * pacer, FrameTimes * times, bool * thread_done) {
+    nes->scheduler.set_timing(true);
+    auto last_end = SteadyClock::now();
+    long frame_no = 0;
     while (!(*thread_done)) {
-        cpu->tick();
-
-        ppu->tick();
-        ppu->tick();
-        ppu->tick();
-
-        cpu->tick();
-
-        ppu->tick();
-        ppu->tick();
-        ppu->tick();
+        auto frame_start = SteadyClock::now();
+        // the cpu runs ahead, the ppu and apu catch up on register accesses and events
+        nes->scheduler.run_to_vblank();
+        auto emulated = SteadyClock::now();
+        std::chrono::nanoseconds ppu_time, apu_time;
+        nes->scheduler.take_device_time(&ppu_time, &apu_time);
+
+        frame_no++;
+        bool overrun = pacer->end_frame();
+        auto end = SteadyClock::now();
+
+        times->push({
+            frame_no,
+            to_us(emulated - frame_start - ppu_time - apu_time),
+            to_us(ppu_time),
+            to_us(apu_time),
+            to_us(end - emulated),
+            times->get_present_us(),
+            to_us(end - last_end),
+            overrun,
+        });
+        last_end = end;
+    }
+}
 
-        apu->tick();
-    
-        loopCount++;
-
-        if (loopCount % NSTEPS_PAUSE == 0) {
-            auto now = Clock::now();
-            // slow down !
-            loopCount = 0;
-            long elapsed_time = std::chrono::duration_cast<std::chrono::microseconds>(now - last_t).count(); 
-
-            // evaluating cpu load
-            load_sum += (float)elapsed_time / (float)TIME_BETWEEN_PAUSE_US;
-            load_num++;
-            if (load_num == 100) {
-                // std::cout << "Load : " << load_sum << "% " << TIME_BETWEEN_PAUSE_US << "µs" << std::endl;
-                load_sum = 0.0f;
-                load_num = 0;
+int main(int argc, char **argv) {
+    // ROM : ines file to run, DEFAULT_ROM otherwise
+    // --jit : run the cpu by blocks compiled to host code
+    // --check N : compare the scheduled run with the lockstep one over N frames, without ui
+    // --headless N : run N frames uncapped, without ui nor sound, printing the CRC of each frame
+    // --input SCRIPT : controller script of --headless (see parse_input_script)
+    // --timing-csv FILE : host times of the last frames written at exit (see FrameTimes)
+    // --speed X : emulation speed, 0.5 to 8 times the console one
+    // --uncapped : as fast as possible
+    // --audio-sync : in real time, follow the clock of the audio device (see Pacer)
+    bool use_jit = false;
+    long check_frames = 0;
+    long headless_frames = 0;
+    std::string rom_path = DEFAULT_ROM;
+    std::string input_path;
+    std::string timing_csv_path;
+    double speed = 1;
+    bool audio_sync = false;
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        if (arg == "--jit") {
+            use_jit = true;
+        } else if (arg == "--check" && i + 1 < argc) {
+            check_frames = std::stol(argv[++i]);
+        } else if (arg == "--headless" && i + 1 < argc) {
+            headless_frames = std::stol(argv[++i]);
+        } else if (arg == "--input" && i + 1 < argc) {
+            input_path = argv[++i];
+        } else if (arg == "--timing-csv" && i + 1 < argc) {
+            timing_csv_path = argv[++i];
+        } else if (arg == "--speed" && i + 1 < argc) {
+            speed = std::stod(argv[++i]);
+            if (speed < Pacer::MIN_SPEED || speed > Pacer::MAX_SPEED) {
+                std::cerr << "Speed out of range : " << speed << std::endl;
+                return 1;
             }
-            
-            std::this_thread::sleep_for(std::chrono::microseconds(TIME_BETWEEN_PAUSE_US - elapsed_time));
-            last_t = Clock::now();
+        } else if (arg == "--uncapped") {
+            speed = 0;
+        } else if (arg == "--audio-sync") {
+            audio_sync = true;
+        } else if (arg[0] != '-') {
+            rom_path = arg;
+        } else {
+            std::cerr << "Unknown option " << arg << std::endl;
+            return 1;
         }
     }
-}
 
-int main() {
     uint8_t prg[0x8000] = {0};
     uint8_t chr[0x4000] = {0}; // TODO : check sizes
     uint16_t prgLen, chrLen;
@@ -200,8 +476,7 @@ int main() {
     // parseInes("../rom/Donkey-Kong-NES-Disassembly/dk.nes", prg, chr, &prgLen, &chrLen);
     // LstDebuggerAsm6 lst("../rom/Donkey-Kong-NES-Disassembly/dk.lst", true);
 
-    parseInes("/home/titus/dev/nesquick/rom/smb1/bin/smb1.nes", prg, chr, &prgLen, &chrLen);
-    LstDebuggerAsm6 lst("/home/titus/dev/nesquick/rom/smb1/bin/smb1.lst", true);
+    parseInes(rom_path, prg, chr, &prgLen, &chrLen);
 
     // parseInes("/home/titus/dev/nesquick/rom/tetris.nes", prg, chr, &prgLen, &chrLen);
 
@@ -210,32 +485,61 @@ int main() {
 
     uint16_t rom_base_addr = 0x10000 - prgLen;
 
-    CartridgeRomDevice rom(prg, rom_base_addr);
-    RamDevice ram(0x0000);
-    ApuDevice apu;
-    PpuDevice ppu(chr, &ram, &apu);
+    if (check_frames > 0) {
+        return check(prg, chr, rom_base_addr, check_frames, use_jit) ? 0 : 1;
+    }
+
+    if (headless_frames > 0) {
+        std::map<long, uint8_t> input;
+        if (!input_path.empty()) {
+            input = parse_input_script(input_path);
+        }
+        std::unique_ptr<Nes> nes(new Nes(prg, chr, rom_base_addr));
+        if (use_jit && !nes->cpu.set_jit(true)) {
+            std::cerr << "JIT not supported on this host, blocks are interpreted" << std::endl;
+        }
+        headless(nes.get(), headless_frames, input);
+        return 0;
+    }
 
-    Memory mem({
-        {0x0000, &ram},
-        {0x2000, &ppu},
-        {0x4000, &apu},
-        {0x4014, &ppu},
-        {rom_base_addr, &rom},
-    });
+    std::unique_ptr<LstDebuggerAsm6> lst;
+    if (rom_path == DEFAULT_ROM) {
+        lst.reset(new LstDebuggerAsm6(DEFAULT_LST, true));
+    }
 
-    Emu6502 cpu(&mem, LOG_DEBUG, &lst);
-    ppu.set_cpu(&cpu); // urgh
-    apu.set_cpu(&cpu); // urgh
+    // too big for the stack
+    std::unique_ptr<Nes> nes(new Nes(prg, chr, rom_base_addr, lst.get(), LOG_DEBUG));
+    // synthesized by the emulation thread, played by the audio device one
+    SampleStream samples;
+    SoundEngine sound(samples.get_ring());
+    std::unique_ptr<TripleBuffer> video(new TripleBuffer());
+    nes->apu.set_audio_sink(&samples);
+    nes->ppu.set_video_sink(video.get());
+    if (use_jit && !nes->cpu.set_jit(true)) {
+        std::cerr << "JIT not supported on this host, blocks are interpreted" << std::endl;
+    }
 
 
+    Pacer pacer(speed);
+    if (audio_sync) {
+        pacer.set_audio_clock([&sound] { return sound.get_seconds_played(); });
+    }
+    std::unique_ptr<FrameTimes> times(new FrameTimes());
     bool kill = false;
-    std::thread t1(run, &cpu, &ppu, &apu, &kill); 
+    std::thread t1(run, nes.get(), &pacer, times.get(), &kill);
 
-    ui(&cpu, &ppu, &apu);
+    ui(&nes->cpu, &nes->ppu, &sound, video.get(), times.get());
 
     kill = true;
 
     t1.join();
-    
+
+    std::cerr << format_stats(times->get_stats()) << std::endl;
+    std::cerr << "audio latency " << sound.get_latency() * 1000 << " ms, " << sound.get_underrun_samples()
+        << " underrun samples, " << samples.get_dropped_count() << " dropped samples" << std::endl;
+    if (!timing_csv_path.empty()) {
+        times->write_csv(timing_csv_path);
+    }
+
     return 0;
 }
@@ -0,0 +1,44 @@
+#pragma once
+
+#include "lstdebugger.hpp"
+#include "cpu.hpp"
+#include "device.hpp"
+#include "ppu.hpp"
+#include "apu.hpp"
+#include "scheduler.hpp"
+#include "sinks.hpp"
+
+/*
+All the devices of the console, wired on the cpu bus
+The PPU and APU are reached through the scheduler ports
+Frames and sound go to the sinks given with ppu.set_video_sink and
+apu.set_audio_sink, they are dropped otherwise
+*/
+struct Nes {
+    CartridgeRomDevice rom;
+    RamDevice ram;
+    ApuDevice apu;
+    PpuDevice ppu;
+    Scheduler scheduler;
+    Memory mem;
+    Emu6502 cpu;
+
+    Nes(uint8_t *prg, uint8_t *chr, uint16_t rom_base_addr, LstDebuggerAsm6 *lst = nullptr, bool debug = false)
+        : rom(prg, rom_base_addr),
+          ram(0x0000),
+          ppu(chr, &apu),
+          scheduler(&ppu, &apu),
+          mem({
+              {0x0000, &ram},
+              {0x2000, scheduler.ppu_port()},
+              {0x4000, scheduler.apu_port()},
+              {0x4014, scheduler.ppu_port()},
+              {rom_base_addr, &rom},
+          }),
+          cpu(&mem, debug, lst) {
+        ppu.set_cpu(&cpu); // urgh
+        ppu.set_bus(&mem);
+        apu.set_cpu(&cpu); // urgh
+        scheduler.set_cpu(&cpu);
+    }
+};
@@ -0,0 +1,96 @@
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <stdexcept>
+#include <string>
+#include <thread>
+
+#ifdef __linux__
+#include <time.h>
+#endif
+
+#include "pacer.hpp"
+#include "frametimes.hpp"
+
+static int64_t monotonic_ns() {
+#ifdef __linux__
+    timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return static_cast<int64_t>(now.tv_sec) * 1000000000 + now.tv_nsec;
+#else
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+#endif
+}
+
+static void sleep_until_ns(int64_t deadline_ns) {
+#ifdef __linux__
+    timespec deadline = {static_cast<time_t>(deadline_ns / 1000000000), static_cast<long>(deadline_ns % 1000000000)};
+    // an absolute deadline is simply retried when a signal interrupts the sleep
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &deadline, nullptr) == EINTR) {
+    }
+#else
+    std::this_thread::sleep_until(std::chrono::steady_clock::time_point(std::chrono::nanoseconds(deadline_ns)));
+#endif
+}
+
+Pacer::Pacer(double speed) {
+    set_speed(speed);
+}
+
+void Pacer::set_speed(double speed) {
+    if (speed != 0 && (speed < MIN_SPEED || speed > MAX_SPEED)) {
+        throw std::runtime_error("Speed out of range : " + std::to_string(speed));
+    }
+    m_speed = speed;
+    // the next deadlines are counted from the next frame end
+    m_deadline_ns = -1;
+}
+
+void Pacer::set_audio_clock(std::function<double()> audio_clock) {
+    m_audio_clock = audio_clock;
+    m_audio_started = false;
+}
+
+double Pacer::audio_adjust() {
+    double played_s = m_audio_clock();
+    if (played_s <= 0) {
+        // the device has not started yet
+        return 1;
+    }
+    double emulated_s = m_nframes * FRAME_PERIOD_NS / 1e9;
+    if (!m_audio_started) {
+        m_audio_lead_s = emulated_s - played_s;
+        m_audio_started = true;
+    }
+    // positive when the emulation runs ahead of the sound, the frames are then made longer
+    double error_s = emulated_s - played_s - m_audio_lead_s;
+    // 10 ms off : 0.5% slower or faster
+    return 1 + std::clamp(error_s * MAX_AUDIO_ADJUST / 0.01, -MAX_AUDIO_ADJUST, MAX_AUDIO_ADJUST);
+}
+
+bool Pacer::end_frame() {
+    m_nframes++;
+    int64_t now_ns = monotonic_ns();
+    if (m_speed == 0 || m_deadline_ns < 0) {
+        m_deadline_ns = now_ns;
+        return false;
+    }
+    double period_ns = FRAME_PERIOD_NS / m_speed;
+    if (m_audio_clock && m_speed == 1) {
+        period_ns *= audio_adjust();
+    }
+    m_deadline_ns += period_ns;
+    double late_ns = now_ns - m_deadline_ns;
+    if (late_ns > MAX_LATE_FRAMES * period_ns) {
+        // too far behind to catch up
+        m_deadline_ns = now_ns;
+        return true;
+    }
+    if (late_ns > 0) {
+        // made up by the next frames
+        return true;
+    }
+    sleep_until_ns(static_cast<int64_t>(m_deadline_ns));
+    return false;
+}
@@ -0,0 +1,58 @@
+#pragma once
+
+#include <cstdint>
+#include <functional>
+
+/*
+Paces the emulation at the start of each vblank, when the PPU presents a
+frame and before the NMI handler of the game reads the controller, against
+absolute deadlines on the monotonic clock (clock_nanosleep on Linux), so
+that the oversleeps are made up by the next frames instead of adding up.
+
+A frame a bit late is caught up by the next ones. Past MAX_LATE_FRAMES
+behind (the host could not keep up, the process was suspended), the lost
+time is dropped and the deadlines restart from now.
+
+The speed is real time (1), a fixed multiplier (0.5 to 8) or uncapped (0).
+In real time, the pace can follow the clock of the audio device, which
+drifts from the host one : the frame period is stretched by up to
+MAX_AUDIO_ADJUST so that the sound played stays at the same distance behind
+the emulation.
+*/
+class Pacer {
+public:
+    static double constexpr MIN_SPEED = 0.5;
+    static double constexpr MAX_SPEED = 8;
+    static int const MAX_LATE_FRAMES = 2;
+    static double constexpr MAX_AUDIO_ADJUST = 0.005;
+
+    // speed : emulated seconds by host second, 0 for uncapped
+    explicit Pacer(double speed = 1);
+    void set_speed(double speed);
+    double get_speed() const { return m_speed; }
+    /**
+     * audio_clock : seconds of sound played so far by the audio device,
+     * followed in real time, nullptr for the host clock only
+     */
+    void set_audio_clock(std::function<double()> audio_clock);
+
+    /**
+     * Called at the start of each vblank (see Scheduler::run_to_vblank),
+     * sleeps until the deadline of the frame
+     * Returns true if the frame ended after it (overrun)
+     */
+    bool end_frame();
+
+private:
+    // the audio clock correction of the frame period, 1 without it
+    double audio_adjust();
+
+    double m_speed;
+    std::function<double()> m_audio_clock;
+    // deadline of the end of the current frame, in monotonic clock ns, < 0 before the first frame
+    double m_deadline_ns = -1;
+    long m_nframes = 0;
+    // emulated minus played sound seconds when the audio clock started
+    double m_audio_lead_s = 0;
+    bool m_audio_started = false;
+};
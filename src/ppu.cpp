@@ -1,19 +1,33 @@
 #include <cstdint>
+#include <algorithm>
+#include <array>
+#include <cstring>
+#include <iostream>
 #include "ppu.hpp"
 #include "utils.hpp"
+#include "ppukernels.hpp"
+#include "counters.hpp"
 
-PpuDevice::PpuDevice(uint8_t * _chr_rom, Device * cpu_ram, Device * apu) : 
-    m_cpu_ram(cpu_ram), m_cpu(nullptr), m_apu(apu), m_last_frame(30*8, 32*8, CV_8UC3), m_next_frame(30*8, 32*8, CV_8UC3) {
+PpuDevice::PpuDevice(uint8_t * _chr_rom, Device * apu) : 
+    m_apu(apu), m_cpu(nullptr) {
 
-    for (uint16_t addr = 0; addr < 0x4000; addr ++) {
-        m_chr_rom[addr] = _chr_rom[addr];
-    }
+    set_chr_rom(_chr_rom);
+    m_kernels = select_pixel_kernels();
 }
 
 void PpuDevice::set_cpu(Emu6502 *_cpu) {
     m_cpu = _cpu;
 }
 
+void PpuDevice::set_bus(Memory *bus) {
+    m_bus = bus;
+}
+
+void PpuDevice::set_video_sink(VideoSink *video) {
+    m_video = video;
+    m_next_frame = m_video->draw_buffer();
+}
+
 void PpuDevice::set_kb_state(uint8_t kb_state) {
     m_kb_state = kb_state;
 }
@@ -30,7 +44,7 @@ void PpuDevice::inc_ppuaddr() {
     or sprite rendering is enabled), it will update v in an odd way, triggering 
     a coarse X increment and a Y increment simultaneously
     */
-    uint16_t scanline_no = m_ntick / SCANLINE_LENGHT;
+    uint16_t scanline_no = m_scanline;
     if (SCANLINE_LAST_VISIBLE < scanline_no && scanline_no < SCANLINE_PRE_RENDER || true) { // TODO : why is this true fixing the dbg nametable (hence fixing the write in the vram) ? This makes no sense
         // outside rendering
         // quite normal ppu addr incr
@@ -84,7 +98,7 @@ void PpuDevice::set(uint16_t addr, uint8_t value) {
         m_last_bus_value = value;
         addr = ((addr - 0x2000) % 8) + 0x2000; // mirroring every 8 bits
     }
-    uint16_t oamdma_source_addr;
+    uint8_t oamdma_page[256];
     switch (addr)
     {
     case KEY_PPUCTRL:
@@ -93,9 +107,7 @@ void PpuDevice::set(uint16_t addr, uint8_t value) {
         
         if ((m_ppuctrl & 0b11) != (value & 0b11) ) {
 
-            uint16_t scanline_no = m_ntick / SCANLINE_LENGHT;
-            uint16_t column_no = m_ntick % SCANLINE_LENGHT;
-            // std::cout << "nametable set to " << (int) (value & 0b11) << " frame " << m_n_frame << " scanline " << (int) scanline_no << " column " << (int) column_no << std::endl;
+            // std::cout << "nametable set to " << (int) (value & 0b11) << " frame " << m_n_frame << " scanline " << (int) m_scanline << " column " << (int) m_dot << std::endl;
             // m_cpu->dbg();
 
             // sleep(2);
@@ -144,6 +156,9 @@ void PpuDevice::set(uint16_t addr, uint8_t value) {
 
     case KEY_PPUDATA:
         m_vram[m_ppuaddr] = value;
+        if (0x3f00 <= m_ppuaddr && m_ppuaddr < 0x3f20) {
+            update_palette();
+        }
         inc_ppuaddr();
         break;
 
@@ -177,16 +192,25 @@ void PpuDevice::set(uint16_t addr, uint8_t value) {
         break;
 
     case KEY_OAMDMA:
-        // todo : emulate cpu cycles for DMA ?
-        oamdma_source_addr = (value16b << 8);
-        for (uint16_t i = 0; i < 256; i ++) {
-            m_ppuoam[i] = m_cpu_ram->get(oamdma_source_addr + i);
-        }
+        // the page is written to OAMDATA, thus from OAMADDR on
+        m_bus->copy_page(value16b << 8, oamdma_page);
+        memcpy(m_ppuoam + m_ppu_oam_addr, oamdma_page, 256 - m_ppu_oam_addr);
+        memcpy(m_ppuoam, oamdma_page + 256 - m_ppu_oam_addr, m_ppu_oam_addr);
+        m_oam_dirty = true;
+        // the PPU is up to date with the start of the writing instruction, whose
+        // length (4 cycles for STA abs) does not change the parity of the first DMA cycle
+        m_cpu->stall(OAMDMA_NCYCLE + (get_dot() / 3) % 2);
         break;
 
     case KEY_OAMADDR:
-        // oamdata is not implemented yet, so m_ppu_oam_addr is useless for now
         m_ppu_oam_addr = value;
+        break;
+
+    case KEY_OAMDATA:
+        m_ppuoam[m_ppu_oam_addr] = value;
+        m_ppu_oam_addr++;
+        m_oam_dirty = true;
+        break;
 
     case KEY_CTRL1:
         m_controller_strobe = (value & 1); // get lsb
@@ -275,71 +299,297 @@ uint8_t PpuDevice::get(uint16_t addr) {
     return retval;
 }
 
-// https://www.nesdev.org/w/images/default/4/4f/Ppu.svg
-void PpuDevice::tick() {
-    uint16_t scanline_no = m_ntick / SCANLINE_LENGHT;
-    uint16_t column_no = m_ntick % SCANLINE_LENGHT;
-
-    // TODO : turn this into a lookup tab)le of pointer to exec function for matching columns
-    if (column_no == 0) {
-        // beginning of a new visible scanline
-
-    } else if (column_no == 1) {
-        if (scanline_no == SCANLINE_VBLANK_START) {
-            // we are in the first tick of vblank
-            // Let's finish rendering the frame
-            // render_oam();
-            saveFrame();
-            m_ppustatus |= PPUSTATUS_VBLANK;
-
-            // TODO : should not be byte_not a macro or something so it gets notted at compil and not runtime ?
-            // TODO : check we are resetting SPRITE0 collision flag at the right moment
-            if (get_ppuctrl_bit(PPUCTRL_VBLANKNMI)) {
-                m_cpu->interrupt(false);
+bool PpuDevice::is_idle_read(uint16_t addr) {
+    // PPUSTATUS read clears vblank and w, which stay cleared until the next event
+    return addr < 0x4000 && ((addr - 0x2000) % 8) + 0x2000 == KEY_PPUSTATUS;
+}
+
+// the event dots only depend on the position in the frame
+static const long FRAME_NTICK = SCANLINE_NUMBER * SCANLINE_LENGHT;
+static const long VBLANK_START_TICK = SCANLINE_VBLANK_START * SCANLINE_LENGHT + 1;
+static const long PRE_RENDER_TICK = SCANLINE_PRE_RENDER * SCANLINE_LENGHT + 1;
+static const long SPRITE0_CHECK_COLUMN = 258;
+static const long FRAME_NEVENT = SCANLINE_VBLANK_START + 3;
+
+// number of event dots of a frame before ntick
+static long events_before(long ntick) {
+    long nevent = 0;
+    if (ntick > SPRITE0_CHECK_COLUMN) {
+        nevent += std::min((ntick - SPRITE0_CHECK_COLUMN + SCANLINE_LENGHT - 1) / SCANLINE_LENGHT, (long)SCANLINE_VBLANK_START);
+    }
+    nevent += (ntick > VBLANK_START_TICK) + (ntick > PRE_RENDER_TICK) + (ntick > FRAME_NTICK - 1);
+    return nevent;
+}
+
+long PpuDevice::frame_tick() {
+    return static_cast<long>(m_scanline) * SCANLINE_LENGHT + m_dot;
+}
+
+long PpuDevice::ticks_to_next_event(long ahead) {
+    long ntick = (frame_tick() + ahead) % FRAME_NTICK;
+    long next_event;
+    if (ntick <= (SCANLINE_VBLANK_START - 1) * SCANLINE_LENGHT + SPRITE0_CHECK_COLUMN) {
+        // sprite 0 collision is checked at dot 258 of each scanline before vblank
+        next_event = (ntick / SCANLINE_LENGHT) * SCANLINE_LENGHT + SPRITE0_CHECK_COLUMN;
+        if (ntick > next_event) {
+            next_event += SCANLINE_LENGHT;
+        }
+    } else if (ntick <= VBLANK_START_TICK) {
+        next_event = VBLANK_START_TICK;
+    } else if (ntick <= PRE_RENDER_TICK) {
+        next_event = PRE_RENDER_TICK;
+    } else {
+        // last dot, the frame count changes
+        next_event = FRAME_NTICK - 1;
+    }
+    return next_event - ntick;
+}
+
+long PpuDevice::get_event_count(long ahead) {
+    long ntick = frame_tick() + ahead;
+    return (m_n_frame + ntick / FRAME_NTICK) * FRAME_NEVENT + events_before(ntick % FRAME_NTICK);
+}
+
+long PpuDevice::ticks_to_next_sync() {
+    long ntick = frame_tick();
+    if (get_ppuctrl_bit(PPUCTRL_VBLANKNMI) && ntick <= VBLANK_START_TICK) {
+        return VBLANK_START_TICK - ntick;
+    }
+    return FRAME_NTICK - 1 - ntick;
+}
+
+long PpuDevice::ticks_to_vblank() {
+    long ntick = frame_tick();
+    if (ntick <= VBLANK_START_TICK) {
+        return VBLANK_START_TICK - ntick;
+    }
+    return FRAME_NTICK - ntick + VBLANK_START_TICK;
+}
+
+uint64_t PpuDevice::get_dot() {
+    return static_cast<uint64_t>(m_n_frame) * FRAME_NTICK + frame_tick();
+}
+
+/*
+What tick does on each dot, it only depends on the kind of scanline
+https://www.nesdev.org/w/images/default/4/4f/Ppu.svg
+*/
+enum : uint8_t {
+    DOT_IDLE,
+    DOT_VBLANK_START,
+    DOT_CLEAR_STATUS,
+    DOT_NAMETABLE_SEGMENT, // 8px of background, at columns 8 to 240
+    DOT_PREFETCH0, // first two segments of the next scanline
+    DOT_PREFETCH1,
+    DOT_Y_INCR,
+    DOT_HORI_COPY,
+    DOT_OAM_SCANLINE,
+    DOT_VERT_COPY,
+};
+
+enum {
+    SCANLINE_TYPE_VISIBLE,
+    SCANLINE_TYPE_LAST_VISIBLE, // the prefetched segments are for the pre-render line
+    SCANLINE_TYPE_POST_RENDER,
+    SCANLINE_TYPE_VBLANK_START,
+    SCANLINE_TYPE_VBLANK,
+    SCANLINE_TYPE_PRE_RENDER,
+    SCANLINE_TYPE_NUMBER,
+};
+
+static constexpr int scanline_type(uint16_t scanline_no) {
+    if (scanline_no < SCANLINE_LAST_VISIBLE) {
+        return SCANLINE_TYPE_VISIBLE;
+    } else if (scanline_no == SCANLINE_LAST_VISIBLE) {
+        return SCANLINE_TYPE_LAST_VISIBLE;
+    } else if (scanline_no < SCANLINE_VBLANK_START) {
+        return SCANLINE_TYPE_POST_RENDER;
+    } else if (scanline_no == SCANLINE_VBLANK_START) {
+        return SCANLINE_TYPE_VBLANK_START;
+    } else if (scanline_no < SCANLINE_PRE_RENDER) {
+        return SCANLINE_TYPE_VBLANK;
+    }
+    return SCANLINE_TYPE_PRE_RENDER;
+}
+
+// one entry per dot for each kind of scanline
+template<typename T>
+using DotTable = std::array<std::array<T, SCANLINE_LENGHT>, SCANLINE_TYPE_NUMBER>;
+
+static constexpr DotTable<uint8_t> make_dot_actions() {
+    DotTable<uint8_t> actions = {};
+    for (int type = 0; type < SCANLINE_TYPE_NUMBER; type++) {
+        bool rendered = type == SCANLINE_TYPE_VISIBLE || type == SCANLINE_TYPE_LAST_VISIBLE;
+        if (rendered) {
+            for (int column_no = 8; column_no <= 240; column_no += 8) {
+                actions[type][column_no] = DOT_NAMETABLE_SEGMENT;
             }
-        } else if (scanline_no == SCANLINE_PRE_RENDER) {
-            // clear vblank and sprite 0 collision
-            // TODO : clear also sprite overflow
-            m_ppustatus &= byte_not(PPUSTATUS_OVERFLOW);
-            m_ppustatus &= byte_not(PPUSTATUS_SPRITE0_COLLISION);
-            m_ppustatus &= byte_not(PPUSTATUS_VBLANK);
         }
-    } else if (8 <= column_no && column_no <= 240 && column_no%8 == 0) {
-        render_nametable_segment(column_no/8+1);
-    } else if (column_no == 256) {
-        // https://www.nesdev.org/wiki/PPU_scrolling#At_dot_256_of_each_scanline
-        if (scanline_no == SCANLINE_PRE_RENDER || scanline_no <= SCANLINE_LAST_VISIBLE) {
-            y_incr();
-            // probably uneeded:
-            // coarse_x_incr();
+        if (rendered || type == SCANLINE_TYPE_PRE_RENDER) {
+            actions[type][256] = DOT_Y_INCR;
+        }
+        // done on every scanline, even during vblank
+        actions[type][257] = DOT_HORI_COPY;
+        // nothing is drawn on the post-render scanline, no sprite 0 hit nor overflow
+        if (rendered) {
+            actions[type][SPRITE0_CHECK_COLUMN] = DOT_OAM_SCANLINE;
+        }
+        if (type == SCANLINE_TYPE_VISIBLE || type == SCANLINE_TYPE_PRE_RENDER) {
+            actions[type][328] = DOT_PREFETCH0;
+            actions[type][336] = DOT_PREFETCH1;
+        }
+    }
+    actions[SCANLINE_TYPE_VBLANK_START][1] = DOT_VBLANK_START;
+    actions[SCANLINE_TYPE_PRE_RENDER][1] = DOT_CLEAR_STATUS;
+    for (int column_no = 280; column_no <= 304; column_no++) {
+        actions[SCANLINE_TYPE_PRE_RENDER][column_no] = DOT_VERT_COPY;
+    }
+    return actions;
+}
+
+// first dot at or after each dot that is not idle, SCANLINE_LENGHT if none
+static constexpr DotTable<uint16_t> make_next_action_dots(const DotTable<uint8_t>& actions) {
+    DotTable<uint16_t> next = {};
+    for (int type = 0; type < SCANLINE_TYPE_NUMBER; type++) {
+        uint16_t next_dot = SCANLINE_LENGHT;
+        for (int column_no = SCANLINE_LENGHT - 1; column_no >= 0; column_no--) {
+            if (actions[type][column_no] != DOT_IDLE) {
+                next_dot = column_no;
+            }
+            next[type][column_no] = next_dot;
         }
-    } else if (column_no == 257) {
+    }
+    return next;
+}
+
+static constexpr DotTable<uint8_t> DOT_ACTIONS = make_dot_actions();
+static constexpr DotTable<uint16_t> NEXT_ACTION_DOTS = make_next_action_dots(DOT_ACTIONS);
+
+void PpuDevice::tick() {
+    switch (DOT_ACTIONS[m_scanline_type][m_dot]) {
+    case DOT_IDLE:
+        break;
+    case DOT_VBLANK_START:
+        // we are in the first tick of vblank
+        // Let's finish rendering the frame
+        saveFrame();
+        m_n_vblank++;
+        m_ppustatus |= PPUSTATUS_VBLANK;
+
+        // TODO : check we are resetting SPRITE0 collision flag at the right moment
+        if (get_ppuctrl_bit(PPUCTRL_VBLANKNMI)) {
+            m_cpu->interrupt(false);
+        }
+        break;
+    case DOT_CLEAR_STATUS:
+        // clear vblank, sprite 0 collision and sprite overflow
+        m_ppustatus &= byte_not(PPUSTATUS_OVERFLOW);
+        m_ppustatus &= byte_not(PPUSTATUS_SPRITE0_COLLISION);
+        m_ppustatus &= byte_not(PPUSTATUS_VBLANK);
+        break;
+    case DOT_NAMETABLE_SEGMENT:
+        render_nametable_segment(m_dot/8+1);
+        break;
+    case DOT_PREFETCH0:
+        render_nametable_segment(0);
+        break;
+    case DOT_PREFETCH1:
+        render_nametable_segment(1);
+        break;
+    case DOT_Y_INCR:
+        // https://www.nesdev.org/wiki/PPU_scrolling#At_dot_256_of_each_scanline
+        y_incr();
+        break;
+    case DOT_HORI_COPY: {
         // hori(t) -> hori(v) :
         // v: ....A.. ...BCDEF <- t: ....A.. ...BCDEF
         uint16_t filter = 0b0000010000011111;
         m_reg_v = (m_reg_v & ~filter) | (m_reg_t & filter);
+        break;
+    }
+    case DOT_OAM_SCANLINE:
+        render_oam_scanline(m_scanline);
+        break;
+    case DOT_VERT_COPY: {
+        // https://www.nesdev.org/wiki/PPU_scrolling#During_dots_280_to_304_of_the_pre-render_scanline_(end_of_vblank)
+        // vert(t) -> vert(v) :
+        // v: GHIA.BC DEF..... <- t: GHIA.BC DEF.....
+        uint16_t filter = 0b0111101111100000;
+        m_reg_v = (m_reg_v & ~filter) | (m_reg_t & filter);
+        break;
+    }
+    }
+    m_dot++;
+    if (m_dot == SCANLINE_LENGHT) {
+        next_scanline();
+    }
+}
 
-    }  else if (column_no == 258) {
-        if (scanline_no < SCANLINE_VBLANK_START) {
-            render_oam_scanline(scanline_no);
+void PpuDevice::next_scanline() {
+    m_dot = 0;
+    m_scanline++;
+    if (m_scanline == SCANLINE_NUMBER) {
+        m_scanline = 0;
+        m_n_frame++;
+    }
+    m_scanline_type = scanline_type(m_scanline);
+}
+
+void PpuDevice::run_to(uint64_t dot) {
+    uint64_t now = get_dot();
+    while (now < dot) {
+        // jump over the idle dots up to the next action or the end of the scanline
+        uint64_t nidle = std::min<uint64_t>(NEXT_ACTION_DOTS[m_scanline_type][m_dot] - m_dot, dot - now);
+        if (nidle == 0) {
+            tick();
+            now++;
+            continue;
         }
-    } else if (280 <= column_no && column_no <= 304) {
-        // https://www.nesdev.org/wiki/PPU_scrolling#During_dots_280_to_304_of_the_pre-render_scanline_(end_of_vblank)
-        if (scanline_no == SCANLINE_PRE_RENDER) {
-            // vert(t) -> vert(v) :
-            // v: GHIA.BC DEF..... <- t: GHIA.BC DEF.....
-            uint16_t filter = 0b0111101111100000;
-            m_reg_v = (m_reg_v & ~filter) | (m_reg_t & filter);
+        m_dot += nidle;
+        now += nidle;
+        if (m_dot == SCANLINE_LENGHT) {
+            next_scanline();
         }
-    } else if (column_no == 328) {
-        render_nametable_segment(0);
-    } else if (column_no == 336) {
-        render_nametable_segment(1);
-    } 
-    m_ntick++;
-    if (m_ntick == SCANLINE_NUMBER * SCANLINE_LENGHT) {
-        m_ntick = 0;
-        m_n_frame++;
+    }
+}
+
+// bit x set if the pixel x of a packed row (see m_chr_rows) is not of color 0
+static uint8_t row_opacity(uint16_t row) {
+    uint16_t bits = (row | (row >> 1)) & 0x5555;
+    bits = (bits | (bits >> 1)) & 0x3333;
+    bits = (bits | (bits >> 2)) & 0x0f0f;
+    return (bits | (bits >> 4)) & 0x00ff;
+}
+
+// the reverse : both bits of the pixel x of a packed row set if bit x is set
+static uint16_t opacity_to_row(uint8_t opaque) {
+    uint16_t bits = opaque;
+    bits = (bits | (bits << 4)) & 0x0f0f;
+    bits = (bits | (bits << 2)) & 0x3333;
+    bits = (bits | (bits << 1)) & 0x5555;
+    return bits | (bits << 1);
+}
+
+static const int LINE_MASK_WORDS = FRAME_WIDTH / 64;
+
+// the 8 bits of a scanline mask from the pixel x, wrapping around the right edge
+static uint8_t get_line_mask(const uint64_t *line, uint8_t x) {
+    int word = x / 64;
+    int shift = x % 64;
+    uint64_t bits = line[word] >> shift;
+    if (shift > 56) {
+        bits |= line[(word + 1) % LINE_MASK_WORDS] << (64 - shift);
+    }
+    return bits & 0xff;
+}
+
+static void set_line_mask(uint64_t *line, uint8_t x, uint8_t bits) {
+    int word = x / 64;
+    int shift = x % 64;
+    line[word] = (line[word] & ~(0xffull << shift)) | (static_cast<uint64_t>(bits) << shift);
+    if (shift > 56) {
+        int next = (word + 1) % LINE_MASK_WORDS;
+        line[next] = (line[next] & ~(0xffull >> (64 - shift))) | (static_cast<uint64_t>(bits) >> (64 - shift));
     }
 }
 
@@ -349,12 +599,11 @@ void PpuDevice::render_nametable_segment(uint8_t sprite_x) {
     // y is up to down
     // but for imshow x is up to down, y is left to right
 
-    uint16_t scanline_no = m_ntick / SCANLINE_LENGHT;
+    uint16_t scanline_no = m_scanline;
     // only render for visible scanline
     if (!(scanline_no <= SCANLINE_LAST_VISIBLE || scanline_no == SCANLINE_PRE_RENDER)) {
         return;
     }
-    uint16_t column_no = m_ntick % SCANLINE_LENGHT;
     if (scanline_no == SCANLINE_PRE_RENDER && sprite_x > 1) {
         return;
     } else if (scanline_no == SCANLINE_LAST_VISIBLE && sprite_x < 2) {
@@ -405,11 +654,13 @@ void PpuDevice::render_nametable_segment(uint8_t sprite_x) {
 
     bool table_no = get_ppuctrl_bit(PPUCTRL_BGPATTTABLE);
     // shift by fine x (thus register x)
-    add_sprite_line_to_frame(&m_next_frame, sprite_no, table_no, sprite_x*8-m_reg_x, sprite_y*8, sprite_line_no, palette_no, false, false, false, false);
+    uint16_t frame_x = sprite_x*8-m_reg_x;
+    uint8_t opaque = add_sprite_line_to_frame(m_next_frame, sprite_no, table_no, frame_x, sprite_y*8, sprite_line_no, palette_no, false, false, false);
+    set_line_mask(m_bg_opaque, frame_x, opaque);
     coarse_x_incr();
 }
 
-void PpuDevice::dbg_render_fullnametable(cv::Mat * dbg_frame) {
+void PpuDevice::dbg_render_fullnametable(uint8_t * dbg_frame) {
     // x is left to right
     // y is up to down
     // but for imshow x is up to down, y is left to right
@@ -448,123 +699,181 @@ void PpuDevice::dbg_render_fullnametable(cv::Mat * dbg_frame) {
             uint8_t palette_no = ((m_vram[nametable_base_addr + attribute_table_addr] >> attr_bitshift) & 0b11);
             bool table_no = 1; //get_ppuctrl_bit(PPUCTRL_BGPATTTABLE);
             for (uint8_t line_no = 0; line_no < 8; line_no++) {
-                add_sprite_line_to_frame(dbg_frame, sprite_no, table_no, screen_sprite_x*8, screen_sprite_y*8, line_no, palette_no, false, false, false, false, 512, 480);
+                add_sprite_line_to_frame(dbg_frame, sprite_no, table_no, screen_sprite_x*8, screen_sprite_y*8, line_no, palette_no, false, false, false, 512, 480);
+            }
+        }
+    }
+}
+
+void PpuDevice::evaluate_oam() {
+    memset(m_line_sprite_count, 0, sizeof(m_line_sprite_count));
+    for (uint8_t i = 0; i < 64; i++) {
+        uint8_t sprite_y = m_ppuoam[i*4]; // top to bottom
+        if (sprite_y == 255) {
+            // TODO : I guess this should be handled differently!
+            continue;
+        }
+        for (uint16_t line_no = sprite_y; line_no < sprite_y + 8 && line_no < FRAME_HEIGHT; line_no++) {
+            uint8_t count = m_line_sprite_count[line_no]++;
+            if (count < LINE_SPRITE_NUMBER) {
+                m_line_sprites[line_no][count] = i;
             }
         }
     }
+    m_oam_dirty = false;
 }
 
 // renders the various sprites
 // used for OAM render
 void PpuDevice::render_oam_scanline(uint8_t line_no) {
+    if (line_no >= FRAME_HEIGHT) {
+        // no sprite outside of the visible scanlines
+        return;
+    }
     
     bool spritesize = get_ppuctrl_bit(PPUCTRL_SPRITESIZE);
 
     if (spritesize) {
         throw std::runtime_error("16x8 tiles not supported yet");
     }
-    for (int8_t i = 0; i < 64; i++) { // i = sprite no. thus i = 0 => sprite 0 for collision
-        uint8_t sprite_y = m_ppuoam[i*4]; // top to bottom
+    if (m_oam_dirty) {
+        evaluate_oam();
+    }
+    uint8_t count = m_line_sprite_count[line_no];
+    if (count > LINE_SPRITE_NUMBER) {
+        if (m_ppumask & (PPUMASK_ENABLE_BG|PPUMASK_ENABLE_SPRITE)) {
+            m_ppustatus |= PPUSTATUS_OVERFLOW;
+        }
+        count = LINE_SPRITE_NUMBER;
+    }
+    bool table_no = get_ppuctrl_bit(PPUCTRL_OAMPATTTABLE);
+    bool rendering = (m_ppumask & (PPUMASK_ENABLE_BG|PPUMASK_ENABLE_SPRITE)) == (PPUMASK_ENABLE_BG|PPUMASK_ENABLE_SPRITE);
+    bool left_shown = (m_ppumask & (PPUMASK_SHOW_BG_LEFT8PX|PPUMASK_SHOW_SPRITE_LEFT8PX)) == (PPUMASK_SHOW_BG_LEFT8PX|PPUMASK_SHOW_SPRITE_LEFT8PX);
+    memset(m_sprite_opaque, 0, sizeof(m_sprite_opaque));
+    for (uint8_t k = 0; k < count; k++) {
+        uint8_t i = m_line_sprites[line_no][k]; // i = sprite no. thus i = 0 => sprite 0 for collision
+        uint8_t sprite_y = m_ppuoam[i*4];
         uint8_t sprite_no = m_ppuoam[i*4+1];
         uint8_t sprite_attr = m_ppuoam[i*4+2];
         uint8_t sprite_x = m_ppuoam[i*4+3]; // left to right
-        if (sprite_y < line_no - 7 || sprite_y > line_no) {
-            // sprite not on this line
-            continue;
-        }
-        if (sprite_y == 255) {
-            // TODO : I guess this should be handled differently!
-            continue;
-        }
-        // TODO : those declare should not rather be outside the loop ? Maybe it is optimized by the compil.
         bool hflip = ((sprite_attr & PPUOAM_ATT_HFLIP) != 0);
         bool vflip = ((sprite_attr & PPUOAM_ATT_VFLIP) != 0);
         uint8_t palette_no = (sprite_attr & 0b11) + 4; // add 4 to reach OAM palette
-        bool table_no = get_ppuctrl_bit(PPUCTRL_OAMPATTTABLE);
-        // TODO : this is a lot of checks just for the first sprite...
-        bool collision;
-        if (i==0 && line_no >= 2) {
-            collision = add_sprite_line_to_frame(&m_next_frame, sprite_no, table_no, sprite_x, sprite_y, line_no - sprite_y, palette_no, hflip, vflip, true, true);
-            if (collision && 
-                ((m_ppumask & (PPUMASK_ENABLE_BG|PPUMASK_ENABLE_SPRITE))==(PPUMASK_ENABLE_BG|PPUMASK_ENABLE_SPRITE))) {
+
+        uint16_t row = get_sprite_line(sprite_no, table_no, line_no - sprite_y, hflip, vflip);
+        uint8_t opaque = row_opacity(row);
+        if (sprite_x > FRAME_WIDTH - 8) {
+            // sprites do not wrap around the right edge
+            opaque &= 0xff >> (sprite_x - (FRAME_WIDTH - 8));
+        }
+        uint8_t bg_opaque = get_line_mask(m_bg_opaque, sprite_x);
+
+        if (i == 0 && line_no >= 2) {
+            uint8_t hit = opaque & bg_opaque;
+            if (sprite_x >= FRAME_WIDTH - 8) {
+                // never on the last pixel
+                hit &= 0x7f >> (sprite_x - (FRAME_WIDTH - 8));
+            }
+            if (sprite_x < 8 && !left_shown) {
+                // nor on the 8 left ones when the background or sprites are hidden there
+                hit &= static_cast<uint8_t>(0xff << (8 - sprite_x));
+            }
+            if (hit && rendering) {
                 m_ppustatus |= PPUSTATUS_SPRITE0_COLLISION;
             }
-        } else {
-            add_sprite_line_to_frame(&m_next_frame, sprite_no, table_no, sprite_x, sprite_y, line_no - sprite_y, palette_no, hflip, vflip, true, false);
         }
+
+        // the first sprites in OAM order are in front, even those behind the background
+        uint8_t covered = get_line_mask(m_sprite_opaque, sprite_x);
+        set_line_mask(m_sprite_opaque, sprite_x, covered | opaque);
+        uint8_t drawn = opaque & ~covered;
+        if (sprite_attr & PPUOAM_ATT_PRIORITY) {
+            drawn &= ~bg_opaque;
+        }
+        draw_row_to_frame(m_next_frame, row & opacity_to_row(drawn), sprite_x, line_no, palette_no, true);
     }
 }
 
-bool PpuDevice::add_sprite_line_to_frame(cv::Mat * frame, uint8_t sprite_no, bool table_no, uint16_t sprite_x, uint16_t sprite_y, uint8_t sprite_line, uint8_t palette_no, bool hflip, bool vflip, bool transparent_bg, bool check_collision, uint16_t frame_width, uint16_t frame_height) { 
-    uint8_t sprite[8];
-    get_sprite_line_from_rom(sprite, sprite_no, table_no, sprite_line, hflip, vflip);
-    bool sprite0_collision = false;
-    uint8_t bg_color_no = m_vram[0x3f10];
-    uint8_t bg_color_r = NES_COLORS[bg_color_no][0];
-    uint8_t bg_color_g = NES_COLORS[bg_color_no][1];
-    uint8_t bg_color_b = NES_COLORS[bg_color_no][2];
-    uint16_t frame_y = (sprite_y + sprite_line) % frame_height;
-    for (uint8_t x = 0; x < 8; x++) {
-        uint16_t frame_x = (sprite_x + x) % frame_width;
-        uint8_t pix_color = sprite[x];
-        uint8_t color_no;
-        if (pix_color != 0) {
-            // 0x3f00 : palettes location in vram
-            // a palette : a set of 4 colors (4 bytes then)
-            // palette_no : the index of the palette in the palette list
-            // pix_color : the color in the palette
-            color_no = m_vram[0x3f00 + static_cast<uint16_t>(palette_no) * 4 + static_cast<uint16_t>(pix_color)];
-        } else if (!transparent_bg) {
-            color_no = m_vram[0x3f10];
-        } else {
-            continue;
+uint8_t PpuDevice::add_sprite_line_to_frame(uint8_t * frame, uint8_t sprite_no, bool table_no, uint16_t sprite_x, uint16_t sprite_y, uint8_t sprite_line, uint8_t palette_no, bool hflip, bool vflip, bool transparent_bg, uint16_t frame_width, uint16_t frame_height) { 
+    uint16_t sprite = get_sprite_line(sprite_no, table_no, sprite_line, hflip, vflip);
+    draw_row_to_frame(frame, sprite, sprite_x, sprite_y + sprite_line, palette_no, transparent_bg, frame_width, frame_height);
+    return row_opacity(sprite);
+}
+
+void PpuDevice::draw_row_to_frame(uint8_t * frame, uint16_t row, uint16_t frame_x, uint16_t frame_y, uint8_t palette_no, bool transparent_bg, uint16_t frame_width, uint16_t frame_height) {
+    const uint8_t *colors = m_palette + palette_no * 4;
+    frame_x %= frame_width;
+    uint8_t *line = frame + (frame_y % frame_height) * frame_width;
+    if (frame_x + 8 <= frame_width) {
+        m_kernels.draw_row(line + frame_x, row, colors, transparent_bg);
+    } else {
+        // the row wraps around the right edge of the frame
+        uint8_t pixels[8];
+        for (uint8_t x = 0; x < 8; x++) {
+            pixels[x] = line[(frame_x + x) % frame_width];
         }
-        uint8_t r = NES_COLORS[color_no][0]; // TODO : get pointer
-        uint8_t g = NES_COLORS[color_no][1];
-        uint8_t b = NES_COLORS[color_no][2];
-        cv::Vec3b bg_color = frame->at<cv::Vec3b>(frame_y, frame_x);
-        // TODO : same here,a lot of check for the sprite 0
-        if (check_collision && (bg_color[0] != bg_color_r || bg_color[1] != bg_color_g || bg_color[2] != bg_color_b)) {
-            // background is set
-            // TODO : do better, it relies on the background being black and nothing else being black
-            sprite0_collision = true;
+        draw_row_scalar(pixels, row, colors, transparent_bg);
+        for (uint8_t x = 0; x < 8; x++) {
+            line[(frame_x + x) % frame_width] = pixels[x];
         }
-        // TODO there are fatser ways to populate a frame
-        frame->at<cv::Vec3b>(frame_y, frame_x) = cv::Vec3b(r, g, b);
     }
-    return sprite0_collision;
 }
 
-void PpuDevice::get_sprite_line_from_rom(uint8_t sprite[8], uint8_t sprite_no, bool table_no, uint8_t sprite_line, bool hflip, bool vflip) {
-    /*
-    sprite is a uint8_t[8];
-    doubletile : 16x8 tile mode
-    */
-    uint8_t local_sprite_line = sprite_line;
-    if (vflip) {
-        local_sprite_line = 7 - sprite_line;
-    }
-    uint16_t plane0_addr = (sprite_no + 256*table_no) << 4;
-    uint8_t plane0 = m_chr_rom[plane0_addr + local_sprite_line];
-    uint8_t plane1 = m_chr_rom[plane0_addr + local_sprite_line + 8];
-    for (uint8_t i = 0; i < 8; i++) {
-        uint8_t color0 = (plane0 >> i) & 1;
-        uint8_t color1 = (plane1 >> i) & 1;
-        uint8_t color = (color1 << 1) + color0;
-        if (hflip) {
-            sprite[i] = color;
-        } else {
-            sprite[7-i] = color;
+void PpuDevice::update_palette() {
+    // 0x3f00 : palettes location in vram
+    // a palette : a set of 4 colors (4 bytes then)
+    for (uint8_t palette_no = 0; palette_no < 8; palette_no++) {
+        m_palette[palette_no * 4] = m_vram[0x3f10] & 0x3f;
+        for (uint8_t pix_color = 1; pix_color < 4; pix_color++) {
+            m_palette[palette_no * 4 + pix_color] = m_vram[0x3f00 + palette_no * 4 + pix_color] & 0x3f;
         }
     }
 }
 
+void PpuDevice::decode_chr() {
+    for (uint16_t tile_no = 0; tile_no < CHR_TILE_NUMBER; tile_no++) {
+        for (uint8_t line = 0; line < 8; line++) {
+            uint8_t plane0 = m_chr_rom[(tile_no << 4) + line];
+            uint8_t plane1 = m_chr_rom[(tile_no << 4) + line + 8];
+            uint16_t row = 0;
+            uint16_t row_hflip = 0;
+            for (uint8_t i = 0; i < 8; i++) {
+                uint16_t color = (((plane1 >> i) & 1) << 1) | ((plane0 >> i) & 1);
+                // the msb of the planes is the leftmost pixel
+                row |= color << (2 * (7 - i));
+                row_hflip |= color << (2 * i);
+            }
+            m_chr_rows[0][tile_no * 8 + line] = row;
+            m_chr_rows[1][tile_no * 8 + line] = row_hflip;
+        }
+    }
+}
+
+void PpuDevice::set_chr_rom(uint8_t *chr_rom) {
+    for (uint16_t addr = 0; addr < 0x4000; addr ++) {
+        m_chr_rom[addr] = chr_rom[addr];
+    }
+    decode_chr();
+}
+
+uint16_t PpuDevice::get_sprite_line(uint8_t sprite_no, bool table_no, uint8_t sprite_line, bool hflip, bool vflip) {
+    uint8_t local_sprite_line = vflip ? 7 - sprite_line : sprite_line;
+    return m_chr_rows[hflip][(sprite_no + 256*table_no) * 8 + local_sprite_line];
+}
+
 
-cv::Mat * PpuDevice::getFrame() {
-    return &m_last_frame;
+long PpuDevice::get_frame_count() {
+    return m_n_frame;
 }
 
+long PpuDevice::get_vblank_count() {
+    return m_n_vblank;
+}
+
+
 void PpuDevice::saveFrame() {
-    m_next_frame.copyTo(m_last_frame);
-    
+    // the sink keeps the frame, the next one is drawn in a buffer it hands over
+    m_video->present_frame();
+    m_next_frame = m_video->draw_buffer();
+    COUNTERS(poll_counters_signal());
 }
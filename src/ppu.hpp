@@ -1,9 +1,9 @@
 #pragma once
 
-#include <opencv2/opencv.hpp> 
-
 #include "device.hpp"
 #include "cpu.hpp"
+#include "ppukernels.hpp"
+#include "sinks.hpp"
 
 
 enum {
@@ -35,12 +35,23 @@ static const uint8_t PPUMASK_SHOW_BG_LEFT8PX     = BIT1;
 
 static const uint8_t PPUOAM_ATT_HFLIP = 0b01000000;
 static const uint8_t PPUOAM_ATT_VFLIP = 0b10000000;
+static const uint8_t PPUOAM_ATT_PRIORITY = 0b00100000; // 1 : behind the background
 
 static const uint8_t PPUSTATUS_VBLANK = BIT7;
 static const uint8_t PPUSTATUS_SPRITE0_COLLISION = BIT6;
 static const uint8_t PPUSTATUS_OVERFLOW = BIT5;
 
-const uint8_t NES_COLORS[64][3] = {{124, 124, 124}, {0, 0, 252}, {0, 0, 188}, {68, 40, 188}, {148, 0, 132}, {168, 0, 32}, {168, 16, 0}, {136, 20, 0}, {80, 48, 0}, {0, 120, 0}, {0, 104, 0}, {0, 88, 0}, {0, 64, 88}, {0, 0, 0}, {0, 0, 0}, {0, 0, 0}, {188, 188, 188}, {0, 120, 248}, {0, 88, 248}, {104, 68, 252}, {216, 0, 204}, {228, 0, 88}, {248, 56, 0}, {228, 92, 16}, {172, 124, 0}, {0, 184, 0}, {0, 168, 0}, {0, 168, 68}, {0, 136, 136}, {0, 0, 0}, {0, 0, 0}, {0, 0, 0}, {248, 248, 248}, {60, 188, 252}, {104, 136, 252}, {152, 120, 248}, {248, 120, 248}, {248, 88, 152}, {248, 120, 88}, {252, 160, 68}, {248, 184, 0}, {184, 248, 24}, {88, 216, 84}, {88, 248, 152}, {0, 232, 216}, {120, 120, 120}, {0, 0, 0}, {0, 0, 0}, {252, 252, 252}, {164, 228, 252}, {184, 184, 248}, {216, 184, 248}, {248, 184, 248}, {248, 164, 192}, {240, 208, 176}, {252, 224, 168}, {248, 216, 120}, {216, 248, 120}, {184, 248, 184}, {184, 248, 216}, {0, 252, 252}, {248, 216, 248}, {0, 0, 0}, {0, 0, 0}};
+const uint16_t FRAME_WIDTH = 256;
+const uint16_t FRAME_HEIGHT = 240;
+
+// tiles of the two pattern tables
+const uint16_t CHR_TILE_NUMBER = 512;
+
+// cpu cycles the OAM DMA suspends the cpu for, one more when it starts on an odd cycle
+const int OAMDMA_NCYCLE = 513;
+
+// sprites drawn on a scanline, the next ones set the overflow flag
+const uint8_t LINE_SPRITE_NUMBER = 8;
 
 const uint16_t SCANLINE_LENGHT = 341;
 const uint16_t SCANLINE_NUMBER = 262;
@@ -50,18 +61,30 @@ const uint16_t SCANLINE_LAST_VISIBLE = 239;
 
 
 class PpuDevice : public Device {
+    // times the private hot paths (bench/micro.cpp)
+    friend class MicroBench;
 private:
     uint8_t m_chr_rom[0x4000];
-
-    // TODO : this is quite bad, we share here cpuram for OAMDMA
-    Device * m_cpu_ram;
+    /*
+    Decoded pattern tables, one row of a tile per entry (tile_no * 8 + line),
+    the 8 pixels as 2 bit color indices, leftmost pixel in the lowest bits
+    m_chr_rows[1] holds the horizontally flipped rows
+    */
+    uint16_t m_chr_rows[2][CHR_TILE_NUMBER * 8];
+    // pixel drawing and conversion, picked for the host
+    PixelKernels m_kernels;
+
+    // cpu bus, the source of the OAM DMA
+    Memory * m_bus = nullptr;
     // Same, needed to forward 4017 writes...
     Device * m_apu;
     // this is used to call the interrupt, same, could do better (interface ?)
     Emu6502 * m_cpu;
 
     uint8_t m_vram[0x4000] = {0}; // 14 bit addr space
-    uint32_t m_ntick = 0;
+    uint16_t m_scanline = 0;
+    uint16_t m_dot = 0; // column in the scanline
+    int m_scanline_type = 0; // row of the dot action tables in ppu.cpp
     bool m_reg_w = 0; // First or second write toggle (0 or 1)
     uint16_t m_reg_t = 0;
     uint16_t m_reg_v = 0;
@@ -72,6 +95,25 @@ private:
     uint8_t m_ppustatus = 0;
     uint8_t m_ppuoam[256] = {0};
     uint8_t m_ppu_oam_addr = 0;
+
+    /*
+    Sprites of each visible scanline, the first LINE_SPRITE_NUMBER in OAM
+    order, with the count of all those on the line
+    Rebuilt from m_ppuoam by evaluate_oam before rendering a scanline when
+    the OAM was written (OAMDMA or OAMDATA) since the last build
+    */
+    uint8_t m_line_sprites[FRAME_HEIGHT][LINE_SPRITE_NUMBER];
+    uint8_t m_line_sprite_count[FRAME_HEIGHT] = {0};
+    bool m_oam_dirty = true;
+    void evaluate_oam();
+
+    /*
+    Opaque pixels (not of color 0) of the scanline being drawn, bit x % 64 of
+    word x / 64 for the pixel x, of the background and of the sprites drawn
+    so far : sprite 0 hit and priorities are resolved on them
+    */
+    uint64_t m_bg_opaque[FRAME_WIDTH / 64] = {0};
+    uint64_t m_sprite_opaque[FRAME_WIDTH / 64] = {0};
     uint8_t m_ppudata_buffer = 0; // ppudata does not read directly ram but a buffer that is updated after each read
 
     uint8_t m_controller_strobe = 0;
@@ -79,28 +121,51 @@ private:
 
     uint8_t m_kb_state = 0;
     
-    cv::Mat m_next_frame; // frame that we are building
-    cv::Mat m_last_frame; // last frame that we built
+    VideoSink m_no_video;
+    VideoSink * m_video = &m_no_video;
+    // frame being built, as color indices (see NES_COLORS), owned by m_video
+    uint8_t * m_next_frame = m_no_video.draw_buffer();
+
+    /*
+    Color indices of the 8 palettes ($3f00-$3f1f), 4 entries each, with the
+    entry 0 replaced by the background color ($3f10) since it is the one drawn
+    Only rebuilt on writes to the palettes
+    */
+    uint8_t m_palette[32] = {0};
+    void update_palette();
 
     long m_n_frame = 0;
+    long m_n_vblank = 0;
 
     uint8_t m_last_bus_value = 0;
 
     bool get_ppuctrl_bit(uint8_t status_bit);
 
+    // dot number in the current frame
+    long frame_tick();
+    void next_scanline();
+
     void inc_ppuaddr();
     void coarse_x_incr();
     void y_incr();
 
     /**
      * Add an horizontal line (i.e. 8 px wide, 1 px high) ot the given frame
+     * Returns its opaque pixels, bit x for the pixel x of the line
      */
-    bool add_sprite_line_to_frame(cv::Mat *frame, uint8_t sprite_no, bool table_no, uint16_t sprite_x, uint16_t sprite_y, uint8_t sprite_line, uint8_t palette_no, bool hflip, bool vflip, bool transparent_bg, bool check_collision, uint16_t frame_width = 256, uint16_t frame_height = 240);
+    uint8_t add_sprite_line_to_frame(uint8_t *frame, uint8_t sprite_no, bool table_no, uint16_t sprite_x, uint16_t sprite_y, uint8_t sprite_line, uint8_t palette_no, bool hflip, bool vflip, bool transparent_bg, uint16_t frame_width = 256, uint16_t frame_height = 240);
+
+    // draws a packed row (see m_chr_rows) at frame_x, frame_y, wrapping around the right edge
+    void draw_row_to_frame(uint8_t *frame, uint16_t row, uint16_t frame_x, uint16_t frame_y, uint8_t palette_no, bool transparent_bg, uint16_t frame_width = 256, uint16_t frame_height = 240);
     
+    // rebuilds m_chr_rows from the chr rom
+    void decode_chr();
+
     /**
-     * Recover an horizontal line of the sprite in the chr rom
+     * Recover an horizontal line of the sprite from the decoded chr rom,
+     * packed as in m_chr_rows
      */
-    void get_sprite_line_from_rom(uint8_t sprite[8], uint8_t sprite_no, bool table_no, uint8_t sprite_line, bool hflip, bool vflip);
+    uint16_t get_sprite_line(uint8_t sprite_no, bool table_no, uint8_t sprite_line, bool hflip, bool vflip);
     
     /**
      * Renders one scanline of the OAM (i.e. the foreground)
@@ -116,14 +181,47 @@ private:
     void render_nametable_segment(uint8_t sprite_x);
     
 public:
-    void dbg_render_fullnametable(cv::Mat *dbg_frame);
-    PpuDevice(uint8_t *chr_rom, Device *cpu_ram, Device *apu);
+    // renders the 4 nametables in a 512x480 frame of color indices
+    void dbg_render_fullnametable(uint8_t *dbg_frame);
+    PpuDevice(uint8_t *chr_rom, Device *apu);
     uint8_t get(uint16_t addr);
     void set(uint16_t addr, uint8_t val);
+    bool is_idle_read(uint16_t addr);
     void tick();
+    /**
+     * Ticks up to the absolute dot (see get_dot), jumping over the runs of
+     * dots where nothing happens in one step
+     */
+    void run_to(uint64_t dot);
+    // number of dots ticked since power up
+    uint64_t get_dot();
+    /**
+     * Number of ticks before the next dot that may change PPUSTATUS or raise
+     * the NMI (vblank start, end of vblank, sprite 0 check of a scanline),
+     * or ends the frame, counted from ahead ticks after the current dot
+     */
+    long ticks_to_next_event(long ahead = 0);
+    // number of such dots passed ahead ticks after the current dot
+    long get_event_count(long ahead = 0);
+    /**
+     * Number of ticks the PPU can lag behind the cpu when the cpu does not
+     * touch its registers : up to the NMI at vblank start (when enabled)
+     * or else up to the end of the frame
+     */
+    long ticks_to_next_sync();
+    // ticks up to the next start of vblank (the dot that presents the frame)
+    long ticks_to_vblank();
     void set_cpu(Emu6502 *cpu);
+    void set_bus(Memory *bus);
+    // where the frames go, nowhere by default
+    void set_video_sink(VideoSink *video);
+    // replaces the chr rom (bank switch), the decoded tiles are rebuilt
+    void set_chr_rom(uint8_t *chr_rom);
     void set_kb_state(uint8_t kb_state);
     void render();
-    cv::Mat *getFrame();
+    // number of frames rendered so far
+    long get_frame_count();
+    // number of vblanks started so far, i.e. of frames presented
+    long get_vblank_count();
     void saveFrame();
 };
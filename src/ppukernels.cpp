@@ -0,0 +1,99 @@
+#include <array>
+#include <cstring>
+
+#include "ppukernels.hpp"
+
+#if (defined(__x86_64__) || defined(__i386__)) && (defined(__GNUC__) || defined(__clang__))
+#define KERNELS_X86 1
+#include <immintrin.h>
+#endif
+
+void draw_row_scalar(uint8_t *dst, uint16_t row, const uint8_t colors[4], bool transparent) {
+    for (uint8_t x = 0; x < 8; x++) {
+        uint8_t pix_color = (row >> (2 * x)) & 0b11;
+        if (pix_color == 0 && transparent) {
+            continue;
+        }
+        dst[x] = colors[pix_color];
+    }
+}
+
+void to_rgb_scalar(uint8_t *dst, const uint8_t *src, int npixel) {
+    for (int i = 0; i < npixel; i++) {
+        memcpy(dst + 3 * i, NES_COLORS[src[i] & 0x3f], 3);
+    }
+}
+
+#ifdef KERNELS_X86
+
+__attribute__((target("ssse3")))
+static void draw_row_ssse3(uint8_t *dst, uint16_t row, const uint8_t colors[4], bool transparent) {
+    // pixel x is at bits 2x, shift it left by 14 - 2x (a multiplication) then right by 14
+    __m128i shifted = _mm_mullo_epi16(_mm_set1_epi16(static_cast<short>(row)),
+        _mm_setr_epi16(1 << 14, 1 << 12, 1 << 10, 1 << 8, 1 << 6, 1 << 4, 1 << 2, 1));
+    __m128i pixels = _mm_packus_epi16(_mm_srli_epi16(shifted, 14), _mm_setzero_si128());
+    uint32_t palette;
+    memcpy(&palette, colors, 4);
+    __m128i drawn_colors = _mm_shuffle_epi8(_mm_cvtsi32_si128(palette), pixels);
+
+    if (!transparent) {
+        _mm_storel_epi64(reinterpret_cast<__m128i *>(dst), drawn_colors);
+        return;
+    }
+    __m128i old = _mm_loadl_epi64(reinterpret_cast<const __m128i *>(dst));
+    // the color 0 pixels keep the old colors
+    __m128i kept = _mm_cmpeq_epi8(pixels, _mm_setzero_si128());
+    _mm_storel_epi64(reinterpret_cast<__m128i *>(dst),
+        _mm_or_si128(_mm_andnot_si128(kept, drawn_colors), _mm_and_si128(kept, old)));
+}
+
+// NES_COLORS as 0x00bbggrr, i.e. the RGB bytes followed by a 0 in memory
+static const std::array<uint32_t, 64> RGB32_COLORS = [] {
+    std::array<uint32_t, 64> colors = {};
+    for (int i = 0; i < 64; i++) {
+        colors[i] = NES_COLORS[i][0] | (NES_COLORS[i][1] << 8) | (NES_COLORS[i][2] << 16);
+    }
+    return colors;
+}();
+
+__attribute__((target("avx2")))
+static void to_rgb_avx2(uint8_t *dst, const uint8_t *src, int npixel) {
+    const int *colors = reinterpret_cast<const int *>(RGB32_COLORS.data());
+    // drops the 4th byte of each pixel, 12 bytes of RGB per 128 bit lane
+    __m256i pack = _mm256_setr_epi8(
+        0, 1, 2, 4, 5, 6, 8, 9, 10, 12, 13, 14, -1, -1, -1, -1,
+        0, 1, 2, 4, 5, 6, 8, 9, 10, 12, 13, 14, -1, -1, -1, -1);
+    __m256i index_mask = _mm256_set1_epi32(0x3f);
+    int i = 0;
+    // the stores write 4 bytes past the 24 of the 8 pixels, overwritten by
+    // the next ones, so the last 8 pixels are left to the scalar loop
+    for (; i + 16 <= npixel; i += 8) {
+        __m256i indices = _mm256_cvtepu8_epi32(_mm_loadl_epi64(reinterpret_cast<const __m128i *>(src + i)));
+        __m256i rgb32 = _mm256_i32gather_epi32(colors, _mm256_and_si256(indices, index_mask), 4);
+        __m256i rgb24 = _mm256_shuffle_epi8(rgb32, pack);
+        _mm_storeu_si128(reinterpret_cast<__m128i *>(dst + 3 * i), _mm256_castsi256_si128(rgb24));
+        _mm_storeu_si128(reinterpret_cast<__m128i *>(dst + 3 * i + 12), _mm256_extracti128_si256(rgb24, 1));
+    }
+    to_rgb_scalar(dst + 3 * i, src + i, npixel - i);
+}
+
+PixelKernels select_pixel_kernels() {
+    PixelKernels kernels = {draw_row_scalar, to_rgb_scalar};
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("ssse3")) {
+        // 8 pixels are a single 64 bit lane, AVX2 has nothing to add
+        kernels.draw_row = draw_row_ssse3;
+    }
+    if (__builtin_cpu_supports("avx2")) {
+        kernels.to_rgb = to_rgb_avx2;
+    }
+    return kernels;
+}
+
+#else
+
+PixelKernels select_pixel_kernels() {
+    return {draw_row_scalar, to_rgb_scalar};
+}
+
+#endif
@@ -0,0 +1,38 @@
+#pragma once
+
+#include <cstdint>
+
+/*
+Pixel kernels of the PPU renderer
+
+The PPU draws NES color indices (6 bits, see NES_COLORS) in byte frames:
+a packed tile row (8 pixels as 2 bit color indices, leftmost in the lowest
+bits, see PpuDevice::m_chr_rows) is mapped through the 4 colors of a
+palette. The frame is converted to RGB24 once, when it is displayed.
+There are portable versions and SSSE3 / AVX2 ones, picked at run time
+from the CPUID of the host.
+*/
+
+// RGB of the color indices
+const uint8_t NES_COLORS[64][3] = {{124, 124, 124}, {0, 0, 252}, {0, 0, 188}, {68, 40, 188}, {148, 0, 132}, {168, 0, 32}, {168, 16, 0}, {136, 20, 0}, {80, 48, 0}, {0, 120, 0}, {0, 104, 0}, {0, 88, 0}, {0, 64, 88}, {0, 0, 0}, {0, 0, 0}, {0, 0, 0}, {188, 188, 188}, {0, 120, 248}, {0, 88, 248}, {104, 68, 252}, {216, 0, 204}, {228, 0, 88}, {248, 56, 0}, {228, 92, 16}, {172, 124, 0}, {0, 184, 0}, {0, 168, 0}, {0, 168, 68}, {0, 136, 136}, {0, 0, 0}, {0, 0, 0}, {0, 0, 0}, {248, 248, 248}, {60, 188, 252}, {104, 136, 252}, {152, 120, 248}, {248, 120, 248}, {248, 88, 152}, {248, 120, 88}, {252, 160, 68}, {248, 184, 0}, {184, 248, 24}, {88, 216, 84}, {88, 248, 152}, {0, 232, 216}, {120, 120, 120}, {0, 0, 0}, {0, 0, 0}, {252, 252, 252}, {164, 228, 252}, {184, 184, 248}, {216, 184, 248}, {248, 184, 248}, {248, 164, 192}, {240, 208, 176}, {252, 224, 168}, {248, 216, 120}, {216, 248, 120}, {184, 248, 184}, {184, 248, 216}, {0, 252, 252}, {248, 216, 248}, {0, 0, 0}, {0, 0, 0}};
+
+/**
+ * Draws the 8 pixels of row at dst
+ * colors : color indices of the 4 bitplane values
+ * transparent : the value 0 pixels leave dst untouched
+ */
+typedef void (*RowKernel)(uint8_t *dst, uint16_t row, const uint8_t colors[4], bool transparent);
+
+// Writes the RGB24 colors of the npixel color indices of src at dst
+typedef void (*RgbKernel)(uint8_t *dst, const uint8_t *src, int npixel);
+
+struct PixelKernels {
+    RowKernel draw_row;
+    RgbKernel to_rgb;
+};
+
+void draw_row_scalar(uint8_t *dst, uint16_t row, const uint8_t colors[4], bool transparent);
+void to_rgb_scalar(uint8_t *dst, const uint8_t *src, int npixel);
+
+// fastest kernels supported by the host
+PixelKernels select_pixel_kernels();
@@ -0,0 +1,101 @@
+#include <algorithm>
+#include <cmath>
+#include <stdexcept>
+
+#include "samplestream.hpp"
+#include "apu.hpp"
+
+// rendered by chunks, on the stack
+static int const SYNTHESIS_CHUNK = 256;
+
+SampleStream::SampleStream() {
+    m_square[2].current_phase = M_PI/2.0f; // set init phase of tri wave so that the sound wave starts at 0
+}
+
+void SampleStream::set_cycle(uint64_t cycle) {
+    uint64_t nsamples = cycle * SAMPLE_RATE / CLOCK_FREQUENCY;
+    int16_t chunk[SYNTHESIS_CHUNK];
+    while (m_nsamples < nsamples) {
+        int length = static_cast<int>(std::min<uint64_t>(nsamples - m_nsamples, SYNTHESIS_CHUNK));
+        synthesize(chunk, length);
+        m_ndropped += length - m_ring.push(chunk, length);
+        m_nsamples += length;
+    }
+}
+
+void SampleStream::validate_channel_no(int channel) {
+    if (!(channel <= 2 && channel >= 0)) {
+        throw std::runtime_error("Bad channel number");
+    }
+}
+
+void SampleStream::set_frequency(int channel, float frequency)
+{   
+    validate_channel_no(channel);
+    m_square[channel].frequency = frequency;
+}
+
+void SampleStream::set_duration(int channel, float duration) {
+    validate_channel_no(channel);
+    m_square[channel].left_duration = duration;
+}
+
+void SampleStream::set_amplitude(int channel, float amplitude)
+{   
+    validate_channel_no(channel);
+    m_square[channel].amplitude = amplitude;
+}
+
+void SampleStream::set_duty_cycle(int channel, float duty_cycle)
+{   
+    validate_channel_no(channel);
+    m_square[channel].duty_cycle = duty_cycle;
+}
+
+void SampleStream::set_channel_enable(int channel, bool enable)
+{   
+    validate_channel_no(channel);
+    m_square[channel].enabled = enable;
+}
+
+void SampleStream::synthesize(int16_t *stream, int length) {
+    for (int i = 0; i < length; i++) {
+        stream[i] = 0;
+        
+        for (int chan_no=0; chan_no < 2; chan_no++) {
+            squareWave * channel = &m_square[chan_no];
+            // std::cout << channel->enabled << " " << channel->left_duration << " " << channel->duty_cycle << " " << channel->current_phase << " " << channel->amplitude << std::endl;
+            if (!(channel->enabled && channel->left_duration > 0)) {
+                continue;
+            }
+            stream[i] += channel->amplitude * ((channel->current_phase < 2 * M_PI * channel->duty_cycle) ? 1.0f:-1.0f);
+            channel->left_duration -= 1.0f/SAMPLE_RATE;
+            // increase phase only if playing
+            channel->current_phase += 2 * M_PI * channel->frequency / SAMPLE_RATE;
+            // Wrap phase to avoid overflow
+            if (channel->current_phase > 2 * M_PI) {
+                channel->current_phase -= 2 * M_PI;
+            }
+        }
+
+        squareWave * channel = &m_square[2];
+
+        if ((channel->enabled && channel->left_duration > 0)) {
+            if (channel->current_phase < M_PI) {
+                stream[i] += 2*channel->amplitude * (channel->current_phase/M_PI*2 - 1);
+            } else {
+                stream[i] += 2*channel->amplitude * (3 - channel->current_phase/M_PI*2);
+            }
+        } else {
+            channel->current_phase = M_PI/2.0f; // resets phase so that we start at 0
+        }
+        channel->left_duration -= 1.0f/SAMPLE_RATE;
+        // increase phase only if playing
+        channel->current_phase += 2 * M_PI * channel->frequency / SAMPLE_RATE;
+        // Wrap phase to avoid overflow
+        if (channel->current_phase > 2 * M_PI) {
+            channel->current_phase -= 2 * M_PI;
+        }
+
+    }
+}
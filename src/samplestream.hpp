@@ -0,0 +1,67 @@
+#pragma once
+
+#include <cstdint>
+
+#include "sinks.hpp"
+#include "spscring.hpp"
+
+const int AMPLITUDE = 28000;
+const int SAMPLE_RATE = 44100;
+const float SAMPLE_RATE_PERIOD = 1.0f / SAMPLE_RATE;
+
+enum {
+    PULSE_DUTY_12 = 0,
+    PULSE_DUTY_25 = 1,
+    PULSE_DUTY_50 = 2,
+    PULSE_DUTY_25_NEGATED = 3,
+};
+
+struct squareWave {
+    float frequency = 400;
+    float left_duration = 0;
+    float amplitude = AMPLITUDE/4; // TODO : try setting at 0 the init amplitude
+    double current_phase = 0; // Tracks the phase of the wave
+    float duty_cycle = 0.5;
+    bool enabled = true;
+};
+
+// samples between the emulation and the audio device, 46 ms at most
+const size_t SAMPLE_RING_CAPACITY = 2048;
+typedef SpscRing<int16_t, SAMPLE_RING_CAPACITY> SampleRing;
+
+/*
+AudioSink synthesizing the channels on the emulation thread
+
+The sample n is the sound at the cpu cycle n * CLOCK_FREQUENCY / SAMPLE_RATE.
+When the APU gives the cycle of its next changes (set_cycle), the samples
+up to it are rendered with the current channels and pushed in the ring, so
+the changes apply at their sample. The audio device only drains the ring
+(see SoundEngine). When the ring is full (the emulation runs faster than the
+device), the new samples are dropped.
+*/
+class SampleStream : public AudioSink {
+public:
+    SampleStream();
+    void set_cycle(uint64_t cycle) override;
+    void set_frequency(int channel, float frequency) override;
+    void set_duration(int channel, float duration) override;
+    void set_amplitude(int channel, float amplitude) override;
+    void set_duty_cycle(int channel, float duty_cycle) override;
+    void set_channel_enable(int channel, bool enable) override;
+
+    SampleRing * get_ring() { return &m_ring; }
+    // samples rendered since power up
+    uint64_t get_sample_count() const { return m_nsamples; }
+    // samples the ring had no room for
+    uint64_t get_dropped_count() const { return m_ndropped; }
+    // renders the next length samples of the channels to stream
+    void synthesize(int16_t *stream, int length);
+
+private:
+    void validate_channel_no(int channel);
+
+    squareWave m_square[3];
+    uint64_t m_nsamples = 0;
+    uint64_t m_ndropped = 0;
+    SampleRing m_ring;
+};
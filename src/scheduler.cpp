@@ -0,0 +1,115 @@
+#include <algorithm>
+
+#include "scheduler.hpp"
+
+uint8_t CatchUpPort::get(uint16_t addr) {
+    m_scheduler->sync();
+    return m_device->get(addr);
+}
+
+void CatchUpPort::set(uint16_t addr, uint8_t val) {
+    m_scheduler->sync();
+    m_device->set(addr, val);
+    // the write may have enabled the NMI, update the sync limit
+    m_scheduler->sync();
+}
+
+Scheduler::Scheduler(PpuDevice *ppu, ApuDevice *apu)
+    : m_ppu(ppu), m_apu(apu), m_ppu_port(this, ppu), m_apu_port(this, apu) {
+}
+
+void Scheduler::set_cpu(Emu6502 *cpu) {
+    m_cpu = cpu;
+}
+
+void Scheduler::sync(uint64_t cycle) {
+    if (m_device_cycle < cycle) {
+        typedef std::chrono::steady_clock Clock;
+        Clock::time_point start = m_timing ? Clock::now() : Clock::time_point();
+        // the PPU and APU do not talk to each other, each one catches up on its own
+        m_ppu->run_to(3 * cycle);
+        Clock::time_point ppu_end = m_timing ? Clock::now() : Clock::time_point();
+        // the apu ticks every other cycle, after the odd ones
+        for (uint64_t napu_tick = cycle / 2 - m_device_cycle / 2; napu_tick > 0; napu_tick--) {
+            m_apu->tick();
+        }
+        if (m_timing) {
+            m_ppu_time += ppu_end - start;
+            m_apu_time += Clock::now() - ppu_end;
+        }
+        m_device_cycle = cycle;
+    }
+    m_limit = m_device_cycle + m_ppu->ticks_to_next_sync() / 3;
+}
+
+void Scheduler::take_device_time(std::chrono::nanoseconds *ppu_time, std::chrono::nanoseconds *apu_time) {
+    *ppu_time = m_ppu_time;
+    *apu_time = m_apu_time;
+    m_ppu_time = m_apu_time = std::chrono::nanoseconds(0);
+}
+
+void Scheduler::run_until(uint64_t cycle) {
+    while (m_cycle < cycle) {
+        if (m_cycle > m_limit) {
+            // the PPU may raise the NMI before this instruction
+            sync(m_cycle);
+        }
+        // instructions of the block can start up to the limit
+        uint64_t last_start = std::min(m_limit, cycle - 1);
+        m_cycle += m_cpu->run_block(static_cast<int>(last_start - m_cycle + 1));
+
+        if (m_idle_skip) {
+            // where the PPU would be if it was up to date
+            long ahead = 3 * (m_cycle - m_device_cycle);
+            int iteration_ncycle = m_cpu->idle_loop_cycles(m_ppu->get_event_count(ahead));
+            if (iteration_ncycle > 0 && m_cycle < cycle) {
+                // whole iterations whose reads all happen before the event
+                uint64_t nskip = m_ppu->ticks_to_next_event(ahead) / 3 / iteration_ncycle;
+                nskip = std::min(nskip, (cycle - m_cycle) / iteration_ncycle);
+                m_cycle += nskip * iteration_ncycle;
+            }
+        }
+    }
+    sync(cycle);
+}
+
+void Scheduler::run_frame() {
+    sync(m_cycle);
+    long frame = m_ppu->get_frame_count();
+    while (m_ppu->get_frame_count() == frame) {
+        // the end of the frame is at the latest the next sync
+        run_until(m_device_cycle + m_ppu->ticks_to_next_sync() / 3 + 1);
+    }
+}
+
+void Scheduler::run_to_vblank() {
+    sync(m_cycle);
+    long vblank = m_ppu->get_vblank_count();
+    while (m_ppu->get_vblank_count() == vblank) {
+        // the vblank is not a sync point when the NMI is off
+        long nticks = std::min(m_ppu->ticks_to_next_sync(), m_ppu->ticks_to_vblank());
+        run_until(m_device_cycle + nticks / 3 + 1);
+    }
+}
+
+void Scheduler::run_lockstep_until(uint64_t cycle) {
+    while (m_cycle < cycle) {
+        m_cpu->tick();
+
+        m_ppu->tick();
+        m_ppu->tick();
+        m_ppu->tick();
+
+        m_cpu->tick();
+
+        m_ppu->tick();
+        m_ppu->tick();
+        m_ppu->tick();
+
+        m_apu->tick();
+
+        // the ports never lag
+        m_cycle += 2;
+        m_device_cycle = m_cycle;
+    }
+}
@@ -0,0 +1,104 @@
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+
+#include "device.hpp"
+#include "cpu.hpp"
+#include "ppu.hpp"
+#include "apu.hpp"
+
+class Scheduler;
+
+/*
+Stands for a device on the cpu bus : brings the PPU and APU up to date
+with the cpu before forwarding the access
+*/
+class CatchUpPort : public Device {
+public:
+    CatchUpPort(Scheduler *scheduler, Device *device) : m_scheduler(scheduler), m_device(device) {}
+    uint8_t get(uint16_t addr);
+    void set(uint16_t addr, uint8_t val);
+    bool is_idle_read(uint16_t addr) { return m_device->is_idle_read(addr); }
+
+private:
+    Scheduler *m_scheduler;
+    Device *m_device;
+};
+
+/*
+Master clock of the console, counted in cpu cycles
+
+The cpu runs whole instructions or blocks ahead of the PPU and APU, which
+are only brought up to date when the cpu touches their registers (through
+the CatchUpPort of the memory map) or when the PPU may raise the NMI or ends
+a frame. An instruction starting at cycle c sees the devices as they are
+after 3*c PPU dots and c/2 APU ticks, which is exactly what the lockstep loop
+(cpu tick, 3 ppu ticks, cpu tick, 3 ppu ticks, apu tick) gives, so both are
+deterministically identical.
+
+Idle loops (see Emu6502::idle_loop_cycles) are skipped up to the next PPU
+event by moving the clock forward only.
+*/
+class Scheduler {
+public:
+    Scheduler(PpuDevice *ppu, ApuDevice *apu);
+    void set_cpu(Emu6502 *cpu);
+
+    // devices to put in the memory map in place of the PPU and APU
+    Device * ppu_port() { return &m_ppu_port; }
+    Device * apu_port() { return &m_apu_port; }
+
+    /**
+     * Runs the instructions starting before cycle, then brings the devices
+     * up to cycle
+     */
+    void run_until(uint64_t cycle);
+    // runs until the PPU ends the current frame
+    void run_frame();
+    /**
+     * Runs until the PPU starts the next vblank and presents its frame,
+     * stopping before the cpu takes the NMI
+     */
+    void run_to_vblank();
+
+    /**
+     * Reference implementation : single cycle lockstep up to cycle (which has to be even)
+     * Can not be mixed with run_until on the same console
+     */
+    void run_lockstep_until(uint64_t cycle);
+
+    void set_idle_skip(bool idle_skip) { m_idle_skip = idle_skip; }
+
+    /**
+     * Times the host time spent by the PPU and APU catching up, off by
+     * default (two clock reads by catch up)
+     */
+    void set_timing(bool timing) { m_timing = timing; }
+    /**
+     * Host time spent by the PPU and APU since the last call, needs set_timing
+     * The rest of the time spent in run_until is the cpu one
+     */
+    void take_device_time(std::chrono::nanoseconds *ppu_time, std::chrono::nanoseconds *apu_time);
+    uint64_t get_cycle() { return m_cycle; }
+
+    // brings the devices up to the start of the current instruction
+    void sync() { sync(m_cycle); }
+
+private:
+    void sync(uint64_t cycle);
+
+    Emu6502 *m_cpu = nullptr;
+    PpuDevice *m_ppu;
+    ApuDevice *m_apu;
+    CatchUpPort m_ppu_port;
+    CatchUpPort m_apu_port;
+    bool m_idle_skip = true;
+    bool m_timing = false;
+    std::chrono::nanoseconds m_ppu_time{0};
+    std::chrono::nanoseconds m_apu_time{0};
+
+    uint64_t m_cycle = 0; // start of the next cpu step
+    uint64_t m_device_cycle = 0; // the devices are up to date up to here
+    uint64_t m_limit = 0; // last cycle at which an instruction can start without sync
+};
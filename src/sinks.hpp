@@ -0,0 +1,52 @@
+#pragma once
+
+#include <cstdint>
+#include <cstring>
+
+/*
+Outputs of the console, implemented by the front-end
+The base classes drop everything, they are the default of the devices so
+that the core runs headless.
+*/
+
+/*
+The PPU draws each frame in the buffer given by draw_buffer, 256x240 NES
+color indices (see NES_COLORS) row by row. The base class has a single
+buffer, sinks with more of them can hand over a new one after each frame
+so that frames are never copied.
+*/
+class VideoSink {
+public:
+    // black until the first frame is drawn
+    VideoSink() { memset(m_frame, 0x0f, sizeof(m_frame)); }
+    virtual ~VideoSink() {}
+    // buffer the next frame is drawn into, asked again after each present_frame
+    virtual uint8_t * draw_buffer() { return m_frame; }
+    // called by the PPU at the start of each vblank, the last draw_buffer holds the finished frame
+    virtual void present_frame() {}
+
+protected:
+    uint8_t m_frame[256 * 240];
+};
+
+/*
+Sound channels driven by the APU : 0 and 1 are the square pulses, 2 the triangle
+The sink synthesizes the waves from these parameters
+*/
+class AudioSink {
+public:
+    virtual ~AudioSink() {}
+    /**
+     * cpu cycle of the changes that follow, given before each change and at
+     * each step of the APU frame sequencer : the sound up to there is made
+     * of the previous parameters
+     */
+    virtual void set_cycle(uint64_t cycle) {}
+    virtual void set_frequency(int channel, float frequency) {}
+    // in seconds
+    virtual void set_duration(int channel, float duration) {}
+    virtual void set_amplitude(int channel, float amplitude) {}
+    // fraction of the period the square wave is high
+    virtual void set_duty_cycle(int channel, float duty_cycle) {}
+    virtual void set_channel_enable(int channel, bool enable) {}
+};
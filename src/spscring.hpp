@@ -0,0 +1,52 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+
+/*
+Wait-free ring between a single producer thread and a single consumer one
+Each side owns its index and only reads the other one : push and pop never
+block nor retry, they move what fits and return how much it was.
+CAPACITY has to be a power of 2.
+*/
+template<typename T, size_t CAPACITY>
+class SpscRing {
+    static_assert((CAPACITY & (CAPACITY - 1)) == 0, "The capacity has to be a power of 2");
+
+public:
+    // from the producer : copies up to n items, returns the number copied
+    size_t push(const T *items, size_t n) {
+        size_t head = m_head.load(std::memory_order_relaxed);
+        size_t tail = m_tail.load(std::memory_order_acquire);
+        n = std::min(n, CAPACITY - (head - tail));
+        for (size_t i = 0; i < n; i++) {
+            m_items[(head + i) & (CAPACITY - 1)] = items[i];
+        }
+        m_head.store(head + n, std::memory_order_release);
+        return n;
+    }
+
+    // from the consumer : takes up to n items, returns the number taken
+    size_t pop(T *items, size_t n) {
+        size_t tail = m_tail.load(std::memory_order_relaxed);
+        size_t head = m_head.load(std::memory_order_acquire);
+        n = std::min(n, head - tail);
+        for (size_t i = 0; i < n; i++) {
+            items[i] = m_items[(tail + i) & (CAPACITY - 1)];
+        }
+        m_tail.store(tail + n, std::memory_order_release);
+        return n;
+    }
+
+    // items waiting, from either side
+    size_t size() const {
+        return m_head.load(std::memory_order_acquire) - m_tail.load(std::memory_order_acquire);
+    }
+
+private:
+    T m_items[CAPACITY];
+    // on their own cache lines, each one is written by a single side
+    alignas(64) std::atomic<size_t> m_head{0};
+    alignas(64) std::atomic<size_t> m_tail{0};
+};
@@ -0,0 +1,33 @@
+#include <chrono>
+
+#include "triplebuffer.hpp"
+
+TripleBuffer::TripleBuffer() {
+    memset(m_buffers, 0x0f, sizeof(m_buffers));
+}
+
+void TripleBuffer::present_frame() {
+    m_seq[m_back] = ++m_published;
+    // release : the frame is drawn before it is handed over
+    // acquire : the ui is done with the buffer we get back
+    m_back = m_middle.exchange(m_back | FRESH, std::memory_order_acq_rel) & 3;
+    {
+        // the lock orders the notification after the wait predicate check of the ui
+        std::lock_guard<std::mutex> lock(m_wake_mutex);
+    }
+    m_wake.notify_one();
+}
+
+const uint8_t * TripleBuffer::acquire_frame(int timeout_ms) {
+    if (!(m_middle.load(std::memory_order_acquire) & FRESH)) {
+        std::unique_lock<std::mutex> lock(m_wake_mutex);
+        bool fresh = m_wake.wait_for(lock, std::chrono::milliseconds(timeout_ms), [this] {
+            return (m_middle.load(std::memory_order_acquire) & FRESH) != 0;
+        });
+        if (!fresh) {
+            return nullptr;
+        }
+    }
+    m_front = m_middle.exchange(m_front, std::memory_order_acq_rel) & 3;
+    return m_buffers[m_front];
+}
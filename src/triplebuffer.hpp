@@ -0,0 +1,49 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <mutex>
+
+#include "sinks.hpp"
+
+/*
+Hands the frames of the PPU over to another thread without copying them
+
+Three buffers rotate : the PPU draws in the back one, the ui reads the front
+one and the middle one holds the last finished frame. Both sides swap their
+buffer with the middle one by an atomic exchange, so neither ever waits for
+the other nor sees a frame being drawn. A frame not taken by the ui before
+the next one is finished is dropped.
+*/
+class TripleBuffer : public VideoSink {
+public:
+    TripleBuffer();
+    uint8_t * draw_buffer() { return m_buffers[m_back]; }
+    void present_frame();
+
+    /**
+     * Takes the last finished frame, waiting at most timeout_ms for one if
+     * it was already taken
+     * Returns nullptr on timeout, the frame stays valid until the next call
+     */
+    const uint8_t * acquire_frame(int timeout_ms);
+    // number of the frame returned by acquire_frame, counted from 1
+    long get_frame_no() const { return m_seq[m_front]; }
+
+private:
+    // set in m_middle when it holds a frame not taken yet, the index is in the low bits
+    static uint32_t const FRESH = 4;
+
+    uint8_t m_buffers[3][256 * 240];
+    long m_seq[3] = {0, 0, 0};
+    // only used by the PPU thread
+    int m_back = 0;
+    long m_published = 0;
+    // only used by the ui thread
+    int m_front = 2;
+    std::atomic<uint32_t> m_middle{1};
+    // only to wake the ui up, the buffers are not guarded by it
+    std::mutex m_wake_mutex;
+    std::condition_variable m_wake;
+};
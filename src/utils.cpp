@@ -7,6 +7,7 @@
 #include <bitset>
 #include <thread>
 #include <chrono>
+#include <array>
 #include "utils.hpp"
 
 uint8_t byte_not(uint8_t val) {
@@ -100,3 +101,23 @@ void clear_bits(uint16_t *value, uint16_t bitmask) {
     *value &= byte_not(bitmask);
 }
 
+
+static const std::array<uint32_t, 256> CRC32_TABLE = [] {
+    std::array<uint32_t, 256> table = {};
+    for (uint32_t byte = 0; byte < 256; byte++) {
+        uint32_t crc = byte;
+        for (int bit = 0; bit < 8; bit++) {
+            crc = (crc >> 1) ^ ((crc & 1) ? 0xedb88320 : 0);
+        }
+        table[byte] = crc;
+    }
+    return table;
+}();
+
+uint32_t crc32(const uint8_t *data, size_t size, uint32_t crc) {
+    crc = ~crc;
+    for (size_t i = 0; i < size; i++) {
+        crc = (crc >> 8) ^ CRC32_TABLE[(crc ^ data[i]) & 0xff];
+    }
+    return ~crc;
+}
@@ -1,5 +1,6 @@
 #pragma once
 
+#include <cstddef>
 #include <cstdint>
 #include <string>
 
@@ -18,3 +19,5 @@ std::string hexstr(uint16_t value);
 void parseInes(const std::string& filename, uint8_t * prg, uint8_t * chr, uint16_t *prgLen, uint16_t *chrLen);
 void clear_bits(uint8_t *value, uint8_t bitmask);
 void clear_bits(uint16_t *value, uint16_t bitmask);
+// CRC-32 (zlib), crc is the one of the previous data to chain them
+uint32_t crc32(const uint8_t *data, size_t size, uint32_t crc = 0);
@@ -0,0 +1,99 @@
+#include <iostream>
+#include <memory>
+#include <string>
+
+#include "cpu.hpp"
+#include "cpumem.hpp"
+#include "device.hpp"
+#include "programs.hpp"
+
+/*
+Cpu checks, run by ctest
+
+- run_cycles : the programs without device access run on a bus of ram and
+  rom only, by run_cycles with pseudo-random budgets (the overshoot carried
+  into the next one) and by tick(), with the interpreter and with the JIT.
+  After each budget the tick() run, brought to the same cycle, has to have
+  the same state and be at an instruction boundary : the next tick starts a
+  new instruction.
+*/
+
+static const int BUDGET_NUMBER = 20000;
+static const int BUDGET_MAX = 200;
+
+// ram at 0, rom at 0x8000
+struct Bus {
+    CartridgeRomDevice rom;
+    RamDevice ram;
+    Memory mem;
+
+    Bus(uint8_t *prg) : rom(prg, 0x8000), ram(0x0000), mem({{0x0000, &ram}, {0x8000, &rom}}) {}
+};
+
+static bool run_cycles(Program& program, bool use_jit) {
+    std::string mode = program.name + (use_jit ? " jit" : "");
+    std::unique_ptr<Bus> ticked_bus(new Bus(program.prg.data()));
+    std::unique_ptr<Bus> budgeted_bus(new Bus(program.prg.data()));
+    std::unique_ptr<Emu6502> ticked(new Emu6502(&ticked_bus->mem));
+    std::unique_ptr<Emu6502> budgeted(new Emu6502(&budgeted_bus->mem));
+    if (use_jit && !budgeted->set_jit(true)) {
+        std::cout << mode << " : JIT not supported on this host, skipped" << std::endl;
+        return true;
+    }
+
+    uint32_t seed = 1;
+    uint64_t ticked_cycle = 0;
+    uint64_t budgeted_cycle = 0;
+    int carry = 0;
+    for (int i = 0; i < BUDGET_NUMBER; i++) {
+        seed = seed * 1103515245 + 12345;
+        int budget = 1 + (seed >> 16) % BUDGET_MAX;
+        // the overshoot of the previous budget is taken out of this one
+        int overshoot = budgeted->run_cycles(budget - carry);
+        if (overshoot < 0) {
+            std::cout << mode << " : negative overshoot at budget " << i << std::endl;
+            return false;
+        }
+        budgeted_cycle += budget - carry + overshoot;
+        if (budget - carry + overshoot == 0) {
+            // the previous overshoot took the whole budget, nothing ran
+            carry -= budget;
+            continue;
+        }
+        carry = overshoot;
+
+        while (ticked_cycle < budgeted_cycle) {
+            ticked->tick();
+            ticked_cycle++;
+        }
+        if (ticked->state_hash() != budgeted->state_hash()
+            || ticked->get_instruction_count() != budgeted->get_instruction_count()) {
+            std::cout << mode << " : state mismatch at budget " << i << std::endl;
+            return false;
+        }
+        // run_cycles stopped at the end of an instruction, the next tick starts one
+        ticked->tick();
+        ticked_cycle++;
+        if (ticked->get_instruction_count() != budgeted->get_instruction_count() + 1) {
+            std::cout << mode << " : wrong overshoot at budget " << i << std::endl;
+            return false;
+        }
+    }
+    return true;
+}
+
+int main() {
+    bool ok = true;
+    for (Program& program : synthetic_programs()) {
+        if (program.name != "cpu_alu" && program.name != "ram_copy") {
+            // the others need the PPU
+            continue;
+        }
+        for (bool use_jit : {false, true}) {
+            bool program_ok = run_cycles(program, use_jit);
+            std::cout << "run_cycles " << program.name << (use_jit ? " jit " : " ") << (program_ok ? "ok" : "failed") << std::endl;
+            ok = ok && program_ok;
+        }
+    }
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,69 @@
+#include <iostream>
+#include <memory>
+
+#include "nes.hpp"
+#include "programs.hpp"
+
+/*
+PPU checks, run by ctest on the core built with the array bounds checked
+(see CMakeLists.txt) : an out of bounds access aborts the run
+
+- post_render : frames of ppu_game, sprites and background shown, one of the
+  sprites crossing the bottom of the screen, run through the post-render
+  scanline (240) where no sprite is drawn
+- run_to_vblank : frames of ppu_game (NMI on) and vblank_poll (NMI off) run
+  by Scheduler::run_to_vblank, each one has to stop a few dots after the
+  start of the next vblank, once the frame is presented
+*/
+
+static bool post_render() {
+    for (const Program& program : synthetic_programs()) {
+        if (program.name != "ppu_game") {
+            continue;
+        }
+        // sprite i at y = 4 * i, the 60th one on the scanlines 236 to 243
+        std::vector<uint8_t> prg = program.prg;
+        std::vector<uint8_t> chr = program.chr;
+        // too big for the stack
+        std::unique_ptr<Nes> nes(new Nes(prg.data(), chr.data(), 0x8000));
+        for (int frame = 0; frame < 10; frame++) {
+            nes->scheduler.run_frame();
+        }
+        return nes->ppu.get_frame_count() >= 10;
+    }
+    return false;
+}
+
+// dots past the vblank start run_to_vblank can stop at, the longest instruction
+static const long VBLANK_MAX_LATE_TICK = 3 * 7;
+
+static bool run_to_vblank() {
+    for (const Program& program : synthetic_programs()) {
+        if (program.name != "ppu_game" && program.name != "vblank_poll") {
+            continue;
+        }
+        std::vector<uint8_t> prg = program.prg;
+        std::vector<uint8_t> chr = program.chr;
+        std::unique_ptr<Nes> nes(new Nes(prg.data(), chr.data(), 0x8000));
+        for (long vblank = 1; vblank <= 60; vblank++) {
+            nes->scheduler.run_to_vblank();
+            // just past the vblank start, the next one is almost a frame away
+            long late = SCANLINE_NUMBER * SCANLINE_LENGHT - nes->ppu.ticks_to_vblank();
+            if (nes->ppu.get_vblank_count() != vblank || late < 0 || late > VBLANK_MAX_LATE_TICK) {
+                std::cout << program.name << " : vblank " << vblank << " stopped " << late << " dots late" << std::endl;
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+int main() {
+    bool ok = true;
+    for (auto check : {std::make_pair("post_render", post_render), std::make_pair("run_to_vblank", run_to_vblank)}) {
+        bool check_ok = check.second();
+        std::cout << check.first << " " << (check_ok ? "ok" : "failed") << std::endl;
+        ok = ok && check_ok;
+    }
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,90 @@
+#include <iostream>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "nes.hpp"
+#include "utils.hpp"
+#include "programs.hpp"
+
+/*
+Scheduler checks, run by ctest
+
+- lockstep : each synthetic program runs with the single cycle lockstep
+  loop (the reference) and with the scheduler, without idle loop skipping,
+  with it and with the JIT. Every CHECK_NCYCLE cycles, the cpu state hashes
+  and the CRCs of the frames drawn so far, the one being drawn included,
+  have to be the same.
+*/
+
+// cpu cycles between two comparisons, about a frame
+static const uint64_t CHECK_NCYCLE = 29780;
+static const long CHECK_NUMBER = 600;
+
+// CRC of each finished frame
+class CrcFrames : public VideoSink {
+public:
+    void present_frame() { m_crcs.push_back(crc32(m_frame, sizeof(m_frame))); }
+    // the finished frames then the one being drawn
+    std::vector<uint32_t> get_crcs() const {
+        std::vector<uint32_t> crcs = m_crcs;
+        crcs.push_back(crc32(m_frame, sizeof(m_frame)));
+        return crcs;
+    }
+
+private:
+    std::vector<uint32_t> m_crcs;
+};
+
+struct Console {
+    std::string mode;
+    std::unique_ptr<Nes> nes;
+    std::unique_ptr<CrcFrames> video;
+};
+
+static Console make_console(const std::string& mode, Program& program) {
+    Console console = {mode, std::unique_ptr<Nes>(new Nes(program.prg.data(), program.chr.data(), 0x8000)), std::unique_ptr<CrcFrames>(new CrcFrames())};
+    console.nes->ppu.set_video_sink(console.video.get());
+    return console;
+}
+
+static bool lockstep(Program& program) {
+    Console reference = make_console("lockstep", program);
+    std::vector<Console> scheduled;
+    scheduled.push_back(make_console("sched", program));
+    scheduled.back().nes->scheduler.set_idle_skip(false);
+    scheduled.push_back(make_console("sched+skip", program));
+    scheduled.push_back(make_console("sched+skip+jit", program));
+    if (!scheduled.back().nes->cpu.set_jit(true)) {
+        // JIT not supported on this host
+        scheduled.pop_back();
+    }
+
+    for (long check = 1; check <= CHECK_NUMBER; check++) {
+        reference.nes->scheduler.run_lockstep_until(check * CHECK_NCYCLE);
+        uint64_t hash_reference = reference.nes->cpu.state_hash();
+        std::vector<uint32_t> crcs_reference = reference.video->get_crcs();
+        for (Console& console : scheduled) {
+            console.nes->scheduler.run_until(check * CHECK_NCYCLE);
+            if (console.nes->cpu.state_hash() != hash_reference) {
+                std::cout << program.name << " " << console.mode << " : cpu state mismatch at check " << check << std::endl;
+                return false;
+            }
+            if (console.video->get_crcs() != crcs_reference) {
+                std::cout << program.name << " " << console.mode << " : frame mismatch at check " << check << std::endl;
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+int main() {
+    bool ok = true;
+    for (Program& program : synthetic_programs()) {
+        bool program_ok = lockstep(program);
+        std::cout << "lockstep " << program.name << " " << (program_ok ? "ok" : "failed") << std::endl;
+        ok = ok && program_ok;
+    }
+    return ok ? 0 : 1;
+}